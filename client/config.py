@@ -7,6 +7,8 @@ import os
 import json
 import sys
 import getpass
+import ipaddress
+import struct
 
 class Device:
     def __init__(self, dev):
@@ -31,6 +33,34 @@ class Device:
             if c == b'\n':
                 return ret
 
+def ipToInt(ip):
+    """Dotted address -> esp_ip4_addr_t value, 0 for none"""
+    return struct.unpack("<I", ipaddress.IPv4Address(ip).packed)[0] if ip else 0
+
+
+def intToIp(val):
+    return str(ipaddress.IPv4Address(struct.pack("<I", val))) if val else ""
+
+
+# INA3221 averaging and conversion time register codes
+INA_AVG = [1, 4, 16, 64, 128, 256, 512, 1024]
+INA_CONV_US = [140, 204, 332, 588, 1100, 2116, 4156, 8244]
+
+
+def inaToInt(channels, avg, conv_us):
+    """Configuration register value, the same conversion time for bus and shunt"""
+    ct = INA_CONV_US.index(conv_us)
+    val = INA_AVG.index(avg) << 9 | ct << 6 | ct << 3
+    for ch in channels:
+        val |= 0x4000 >> (ch - 1)
+    return val
+
+
+def intToIna(val):
+    return ([ch for ch in (1, 2, 3) if val & (0x4000 >> (ch - 1))], INA_AVG[(val >> 9) & 7],
+            INA_CONV_US[(val >> 6) & 7])
+
+
 class Config:
     def __init__(self, file=None):
         self.cfg = {}
@@ -45,13 +75,36 @@ class Config:
         uarts = int(p[3])
         scr = int(p[4])
         ina = int(p[5])
+        suart = int(p[6]) if len(p) > 7 else 0
         self.cfg = {
             'ssid': p[1],
             'port': int(p[2]),
             'uarts': [uarts & 0xFF, (uarts >> 8) & 0xFF, (uarts >> 16) & 0xFF],
             'screen': [scr & 0xFF, (scr >> 8) & 0xFF],
             'ina': [ina & 0xFF, (ina >> 8) & 0xFF],
+            'soft_uarts': [(suart >> (i * 8)) & 0xFF for i in range(8)],
+            'soft_baud': int(p[7]) if len(p) > 7 else 115200,
+            'auto_baud': [i for i in range(3) if len(p) > 9 and (int(p[8]) >> i) & 1],
+            'auto_baud_errors': int(p[9]) if len(p) > 9 else 8,
+            'static_ip': intToIp(int(p[10])) if len(p) > 12 else "",
+            'gateway': intToIp(int(p[11])) if len(p) > 12 else "",
+            'netmask': intToIp(int(p[12])) if len(p) > 12 else "",
+            'triggers': [x for x in p[13].split('|') if x] if len(p) > 13 else [],
         }
+        if len(p) > 16:
+            channels, avg, conv = intToIna(int(p[14]))
+            shunts = int(p[15])
+            self.cfg.update({
+                'ina_channels': channels,
+                'ina_avg': avg,
+                'ina_conv_us': conv,
+                'ina_shunt_mohm': [(shunts >> (i * 16)) & 0xFFFF for i in range(3)],
+                'ina_period_ms': int(p[16]),
+            })
+        if len(p) > 17:
+            self.cfg['ina_power_channel'] = int(p[17])
+        if len(p) > 18:
+            self.cfg['session_required'] = p[18] == "1"
 
     def print(self):
         print(json.dumps(self.cfg, indent=4))
@@ -61,8 +114,40 @@ class Config:
         uarts = c['uarts'][0] | (c['uarts'][1] << 8) | (c['uarts'][2] << 16)
         scr = c['screen'][0] | (c['screen'][1] << 8)
         ina = c['ina'][0] | (c['ina'][1] << 8)
+        suart = 0
+        for i, pin in enumerate(c.get('soft_uarts', [])[:8]):
+            suart |= (pin & 0xFF) << (i * 8)
+        baud = c.get('soft_baud', 115200)
+        abaud = 0
+        for port in c.get('auto_baud', []):
+            abaud |= 1 << port
+        aberr = c.get('auto_baud_errors', 8)
+        ip = ipToInt(c.get('static_ip', ""))
+        gw = ipToInt(c.get('gateway', ""))
+        mask = ipToInt(c.get('netmask', ""))
         pswd = getpass.getpass("WiFi password: ")
-        return f"{c['ssid']}:{pswd}:{c['port']}:{uarts}:{scr}:{ina}"
+        # never read back from the device
+        key = c.get('control_key')
+        if key is None:
+            key = getpass.getpass("Control key: ")
+        if not key:
+            raise RuntimeError("Control key can not be empty")
+        if ':' in key:
+            raise RuntimeError("Control key can not contain ':'")
+        triggers = c.get('triggers', ["Guru Meditation", "assert failed", "WDT"])
+        if any(':' in x or '|' in x for x in triggers):
+            raise RuntimeError("Trigger patterns can not contain ':' or '|'")
+        inacfg = inaToInt(c.get('ina_channels', [1, 2, 3]), c.get('ina_avg', 16), c.get('ina_conv_us', 1100))
+        shunts = 0
+        for i, mohm in enumerate(c.get('ina_shunt_mohm', [200, 200, 200])[:3]):
+            shunts |= (mohm & 0xFFFF) << (i * 16)
+        period = c.get('ina_period_ms', 5000)
+        # INA channel annotating UART records, 0 - off
+        power = c.get('ina_power_channel', 0)
+        # START and STOP signed, the stream encrypted, see session.py
+        session = 1 if c.get('session_required', False) else 0
+        return (f"{c['ssid']}:{pswd}:{c['port']}:{uarts}:{scr}:{ina}:{suart}:{baud}:{abaud}:{aberr}:"
+                f"{ip}:{gw}:{mask}:{key}:{'|'.join(triggers)}:{inacfg}:{shunts}:{period}:{power}:{session}")
 
 
 def find_device():
@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+"""Signed runtime changes, e.g.
+
+    control.py -H 192.168.1.50 UART1 baud=57600 parity=even
+    control.py -H 192.168.1.50 UART2 baud=auto pin=17
+    control.py -H 192.168.1.50 INA period=1000
+    control.py -H 192.168.1.50 INA annotate=1
+"""
+
+import argparse
+import getpass
+import hashlib
+import hmac
+import logging
+import os
+import socket
+import sys
+import time
+
+logger = logging.getLogger()
+
+# hex chars of the truncated HMAC-SHA256
+MAC_LEN = 32
+
+
+def sign(key, text):
+    return hmac.new(key.encode(), text.encode(), hashlib.sha256).hexdigest()[:MAC_LEN]
+
+
+def buildCommand(key, target, args, nonce=None):
+    """UUL SET <nonce> <target> <args...> <mac>; the nonce must grow, ms time by default"""
+    if nonce is None:
+        nonce = int(time.time() * 1000)
+    body = " ".join(["UUL SET", str(nonce), target] + list(args))
+    return f"{body} {sign(key, body)}"
+
+
+def sendCommand(host, port, cmd, timeout=2.0):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.settimeout(timeout)
+    logger.debug(f"< {cmd}")
+    sock.sendto(cmd.encode('ascii'), (host, port))
+    try:
+        data, _ = sock.recvfrom(512)
+    except socket.timeout:
+        return None
+    finally:
+        sock.close()
+    resp = data.decode('ascii', errors='replace')
+    logger.debug(f"> {resp}")
+    return resp
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--verbose", "-v", action="store_true")
+    parser.add_argument("--host", "-H", required=True)
+    parser.add_argument("--port", "-p", default=60606, type=int)
+    parser.add_argument("--key", "-k", default=os.environ.get("UUL_KEY"),
+                        help="control key, UUL_KEY or a prompt by default")
+    parser.add_argument("target", help="UART1, UART2 or INA")
+    parser.add_argument("args", nargs='+', help="key=value settings")
+    opts = parser.parse_args()
+    logging.basicConfig(level=logging.DEBUG if opts.verbose else logging.INFO, stream=sys.stderr)
+    key = opts.key if opts.key is not None else getpass.getpass("Control key: ")
+    resp = sendCommand(opts.host, opts.port, buildCommand(key, opts.target, opts.args))
+    if resp is None:
+        logger.error("No answer")
+        sys.exit(2)
+    print(resp)
+    # "UUL OK pending": the device reports the outcome as an EVT record
+    sys.exit(0 if resp.startswith("UUL OK") else 1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+"""Triggered INA captures: reassembly of "CAP" records and a block decoder.
+
+    inacap.py ina-192.168.1.50-12345.bin            # CSV to stdout
+    inacap.py ina-192.168.1.50-12345.bin --plot
+"""
+
+import argparse
+import csv
+import logging
+import struct
+import sys
+
+logger = logging.getLogger()
+
+CHUNK = struct.Struct("<HHH")
+HEADER = struct.Struct("<BBBBHHII")
+# version 1: one shunt LSB for all channels, version 2: one per channel
+LSBS = {1: struct.Struct("<ff"), 2: struct.Struct("<ffff")}
+SAMPLE = struct.Struct("<6h")
+REASONS = {1: "current", 2: "voltage"}
+
+
+class Assembler:
+    """Collects the chunks of a block per device, a new sequence number
+    drops an incomplete block"""
+
+    def __init__(self):
+        self.blocks = {}
+
+    def add(self, host, payload):
+        """Returns the block bytes when the last chunk arrives"""
+        if len(payload) < CHUNK.size:
+            return None
+        seq, index, count = CHUNK.unpack_from(payload)
+        cur = self.blocks.get(host)
+        if not cur or cur['seq'] != seq:
+            if cur:
+                logger.warning(f"{host}: capture {cur['seq']} incomplete, "
+                               f"{len(cur['chunks'])} of {cur['count']} chunks")
+            cur = self.blocks[host] = {'seq': seq, 'count': count, 'chunks': {}}
+        cur['chunks'][index] = payload[CHUNK.size:]
+        if len(cur['chunks']) < count:
+            return None
+        del self.blocks[host]
+        return b"".join(cur['chunks'][i] for i in range(count))
+
+
+def parseBlock(data):
+    version, channels, reason, channel, pre, post, period, trigger = HEADER.unpack_from(data)
+    if version not in LSBS:
+        raise RuntimeError(f"Unknown capture version {version}")
+    lsbs = LSBS[version].unpack_from(data, HEADER.size)
+    shunt_lsb = lsbs[:-1] * 3 if version == 1 else lsbs[:-1]
+    bus_lsb = lsbs[-1]
+    start = HEADER.size + LSBS[version].size
+    samples = []
+    for i in range(pre + post):
+        raw = SAMPLE.unpack_from(data, start + i * SAMPLE.size)
+        samples.append([x * (shunt_lsb[j // 2] if j % 2 == 0 else bus_lsb) for j, x in enumerate(raw)])
+    return {
+        'reason': REASONS.get(reason, str(reason)),
+        'channel': channel,
+        'pre': pre,
+        'post': post,
+        'period_us': period,
+        'trigger_ms': trigger,
+        'samples': samples,
+    }
+
+
+def writeCsv(block, f):
+    w = csv.writer(f)
+    w.writerow(["t_ms", "ch1_ma", "ch1_v", "ch2_ma", "ch2_v", "ch3_ma", "ch3_v"])
+    for i, s in enumerate(block['samples']):
+        t = (i - block['pre']) * block['period_us'] / 1000.0
+        w.writerow([f"{t:.3f}"] + [f"{x:.3f}" for x in s])
+
+
+def plot(block):
+    import matplotlib.pyplot as plt
+    t = [(i - block['pre']) * block['period_us'] / 1000.0 for i in range(len(block['samples']))]
+    fig, (ima, iv) = plt.subplots(2, 1, sharex=True)
+    for ch in range(3):
+        ima.plot(t, [s[ch * 2] for s in block['samples']], label=f"ch{ch + 1}")
+        iv.plot(t, [s[ch * 2 + 1] for s in block['samples']], label=f"ch{ch + 1}")
+    for ax in (ima, iv):
+        ax.axvline(0, color='gray', linestyle='--')
+        ax.legend()
+    ima.set_ylabel("mA")
+    iv.set_ylabel("V")
+    iv.set_xlabel("ms from trigger")
+    fig.suptitle(f"{block['reason']} trigger on ch{block['channel']} at {block['trigger_ms']} ms")
+    plt.show()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("file")
+    parser.add_argument("--plot", action="store_true")
+    opts = parser.parse_args()
+    with open(opts.file, "rb") as f:
+        block = parseBlock(f.read())
+    if opts.plot:
+        plot(block)
+    else:
+        writeCsv(block, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,333 @@
+#!/usr/bin/env python3
+"""Columnar store of INA telemetry and its extraction tool.
+
+A store file holds blocks of up to BLOCK_SAMPLES readings of one channel.
+A block header carries the time span, min/max/mean summaries and the
+column sizes, so readers skip blocks, or answer overviews, without
+decoding them. Columns: time as delta-of-delta zigzag varints, voltage
+and current as XOR (Gorilla) encoded doubles.
+
+    inastore.py ina-192.168.1.50.ina                        # CSV of everything
+    inastore.py ina-192.168.1.50.ina --from 2026-10-19T10:00 --to 2026-10-19T10:05 -c 1
+    inastore.py ina-192.168.1.50.ina --points 500           # min/mean/max overview
+"""
+
+import argparse
+import csv
+import datetime
+import os
+import struct
+import sys
+
+BLOCK_SAMPLES = 1024
+# magic, version, channel, count, first and last ms, v min/max/mean,
+# mA min/max/mean, column bytes of time, volts and mA
+HEADER = struct.Struct("<4sBBHqqffffffIII")
+MAGIC = b"INAB"
+VERSION = 1
+
+
+def zigzag(n):
+    return (n << 1) ^ (n >> 63)
+
+
+def unzigzag(n):
+    return (n >> 1) ^ -(n & 1)
+
+
+def encodeTimes(times):
+    """Delta-of-delta varints after the first time, which is in the header"""
+    out = bytearray()
+    if not times:
+        return b""
+    prev, delta = times[0], 0
+    for t in times[1:]:
+        d = t - prev
+        n = zigzag(d - delta)
+        while n >= 0x80:
+            out.append(n & 0x7F | 0x80)
+            n >>= 7
+        out.append(n)
+        prev, delta = t, d
+    return bytes(out)
+
+
+def decodeTimes(first, count, data):
+    if not count:
+        return []
+    ret = [first]
+    delta, pos = 0, 0
+    for _ in range(count - 1):
+        n, shift = 0, 0
+        while True:
+            b = data[pos]
+            pos += 1
+            n |= (b & 0x7F) << shift
+            shift += 7
+            if b < 0x80:
+                break
+        delta += unzigzag(n)
+        ret.append(ret[-1] + delta)
+    return ret
+
+
+class BitWriter:
+    def __init__(self):
+        self.acc = 0
+        self.bits = 0
+
+    def write(self, val, bits):
+        self.acc = (self.acc << bits) | val
+        self.bits += bits
+
+    def bytes(self):
+        pad = -self.bits % 8
+        return (self.acc << pad).to_bytes((self.bits + pad) // 8, 'big')
+
+
+class BitReader:
+    def __init__(self, data):
+        self.acc = int.from_bytes(data, 'big')
+        self.left = len(data) * 8
+
+    def read(self, bits):
+        self.left -= bits
+        return (self.acc >> self.left) & ((1 << bits) - 1)
+
+
+def floatBits(x):
+    return struct.unpack("<Q", struct.pack("<d", x))[0]
+
+
+def bitsFloat(n):
+    return struct.unpack("<d", struct.pack("<Q", n))[0]
+
+
+def encodeValues(values):
+    """XOR with the previous value: '0' same, '10' meaningful bits in the
+    previous window, '11' 5 bits leading zeros, 6 bits length, bits"""
+    w = BitWriter()
+    if not values:
+        return b""
+    prev = floatBits(values[0])
+    w.write(prev, 64)
+    lead, trail = 65, 0
+    for x in values[1:]:
+        cur = floatBits(x)
+        xor = cur ^ prev
+        prev = cur
+        if not xor:
+            w.write(0, 1)
+            continue
+        nl = min(64 - xor.bit_length(), 31)
+        nt = (xor & -xor).bit_length() - 1
+        if lead <= nl and trail <= nt:
+            w.write(0b10, 2)
+            w.write(xor >> trail, 64 - lead - trail)
+        else:
+            lead, trail = nl, nt
+            size = 64 - lead - trail
+            w.write(0b11, 2)
+            w.write(lead, 5)
+            # 64 meaningful bits do not fit, they are stored as 0
+            w.write(size & 63, 6)
+            w.write(xor >> trail, size)
+    return w.bytes()
+
+
+def decodeValues(count, data):
+    if not count:
+        return []
+    r = BitReader(data)
+    prev = r.read(64)
+    ret = [bitsFloat(prev)]
+    lead, trail = 0, 0
+    for _ in range(count - 1):
+        if r.read(1):
+            if r.read(1):
+                lead = r.read(5)
+                size = r.read(6) or 64
+                trail = 64 - lead - size
+            prev ^= r.read(64 - lead - trail) << trail
+        ret.append(bitsFloat(prev))
+    return ret
+
+
+class Block:
+    def __init__(self, header, offset):
+        (_, self.version, self.channel, self.count, self.first, self.last,
+         self.vmin, self.vmax, self.vmean, self.mamin, self.mamax, self.mamean,
+         self.tlen, self.vlen, self.malen) = header
+        self.offset = offset
+
+    def size(self):
+        return self.tlen + self.vlen + self.malen
+
+
+def encodeBlock(channel, times, volts, mas):
+    t = encodeTimes(times)
+    v = encodeValues(volts)
+    ma = encodeValues(mas)
+    n = len(times)
+    hdr = HEADER.pack(MAGIC, VERSION, channel, n, times[0], times[-1],
+                      min(volts), max(volts), sum(volts) / n, min(mas), max(mas), sum(mas) / n,
+                      len(t), len(v), len(ma))
+    return hdr + t + v + ma
+
+
+class Writer:
+    """Columns of the channels of one device, a block is appended to the
+    file when BLOCK_SAMPLES readings of a channel are collected"""
+
+    def __init__(self, path):
+        self.f = open(path, "ab")
+        self.cols = {ch: ([], [], []) for ch in (1, 2, 3)}
+
+    def add(self, t_ms, readings):
+        """readings: volts, mA of channel 1..3"""
+        for ch in (1, 2, 3):
+            times, volts, mas = self.cols[ch]
+            times.append(t_ms)
+            volts.append(readings[(ch - 1) * 2])
+            mas.append(readings[(ch - 1) * 2 + 1])
+            if len(times) >= BLOCK_SAMPLES:
+                self.flushChannel(ch)
+
+    def flushChannel(self, ch):
+        times, volts, mas = self.cols[ch]
+        if times:
+            self.f.write(encodeBlock(ch, times, volts, mas))
+            self.cols[ch] = ([], [], [])
+
+    def close(self):
+        for ch in (1, 2, 3):
+            self.flushChannel(ch)
+        self.f.close()
+
+
+class Store:
+    """A Writer per device in a directory"""
+
+    def __init__(self, directory):
+        self.directory = directory
+        self.writers = {}
+
+    def add(self, host, t_ms, readings):
+        w = self.writers.get(host)
+        if not w:
+            w = self.writers[host] = Writer(os.path.join(self.directory, f"ina-{host}.ina"))
+        w.add(t_ms, readings)
+
+    def close(self):
+        for w in self.writers.values():
+            w.close()
+        self.writers = {}
+
+
+class Reader:
+    def __init__(self, path):
+        self.f = open(path, "rb")
+        self.blocks = []
+        # headers only, the columns are skipped
+        while True:
+            hdr = self.f.read(HEADER.size)
+            if len(hdr) < HEADER.size:
+                break
+            h = HEADER.unpack(hdr)
+            if h[0] != MAGIC or h[1] != VERSION:
+                raise RuntimeError(f"{path}: bad block at {self.f.tell() - HEADER.size}")
+            b = Block(h, self.f.tell())
+            if self.f.seek(b.size(), os.SEEK_CUR) > os.fstat(self.f.fileno()).st_size:
+                break   # the last block was cut short
+            self.blocks.append(b)
+
+    def select(self, start, end, channel):
+        return [b for b in self.blocks if b.last >= start and b.first <= end
+                and (not channel or b.channel == channel)]
+
+    def decode(self, b):
+        self.f.seek(b.offset)
+        data = self.f.read(b.size())
+        times = decodeTimes(b.first, b.count, data[:b.tlen])
+        volts = decodeValues(b.count, data[b.tlen:b.tlen + b.vlen])
+        mas = decodeValues(b.count, data[b.tlen + b.vlen:])
+        return times, volts, mas
+
+    def samples(self, start, end, channel):
+        """(ms, channel, V, mA) in the range, blocks outside are not read"""
+        for b in self.select(start, end, channel):
+            for t, v, ma in zip(*self.decode(b)):
+                if start <= t <= end:
+                    yield t, b.channel, v, ma
+
+    def overview(self, start, end, channel, points):
+        """Rows of (ms, channel, count, V min/mean/max, mA min/mean/max) over
+        `points` buckets; a block inside one bucket is taken from its header"""
+        blocks = self.select(start, end, channel)
+        if not blocks:
+            return []
+        start = max(start, min(b.first for b in blocks))
+        end = min(end, max(b.last for b in blocks))
+        width = max(1, (end - start + points) // points)
+        buckets = {}
+
+        def put(t, ch, n, vmin, vmean, vmax, mamin, mamean, mamax):
+            key = ((t - start) // width, ch)
+            cur = buckets.get(key)
+            if not cur:
+                buckets[key] = [n, vmin, vmean * n, vmax, mamin, mamean * n, mamax]
+                return
+            cur[0] += n
+            cur[1] = min(cur[1], vmin)
+            cur[2] += vmean * n
+            cur[3] = max(cur[3], vmax)
+            cur[4] = min(cur[4], mamin)
+            cur[5] += mamean * n
+            cur[6] = max(cur[6], mamax)
+
+        for b in blocks:
+            inside = b.first >= start and b.last <= end
+            if inside and (b.first - start) // width == (b.last - start) // width:
+                put(b.first, b.channel, b.count, b.vmin, b.vmean, b.vmax, b.mamin, b.mamean, b.mamax)
+                continue
+            for t, v, ma in zip(*self.decode(b)):
+                if start <= t <= end:
+                    put(t, b.channel, 1, v, v, v, ma, ma, ma)
+        return [(start + k[0] * width, k[1], c[0], c[1], c[2] / c[0], c[3], c[4], c[5] / c[0], c[6])
+                for k, c in sorted(buckets.items())]
+
+
+def parseTime(s):
+    """Epoch ms or an ISO date and time, local"""
+    if s is None:
+        return None
+    if s.isdigit():
+        return int(s)
+    return int(datetime.datetime.fromisoformat(s).timestamp() * 1000)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("file")
+    parser.add_argument("--from", dest="start", default=None, help="epoch ms or ISO time")
+    parser.add_argument("--to", dest="end", default=None, help="epoch ms or ISO time")
+    parser.add_argument("--channel", "-c", type=int, default=0, help="1..3, all by default")
+    parser.add_argument("--points", "-n", type=int, default=0,
+                        help="downsample to this many buckets per channel")
+    opts = parser.parse_args()
+    start = parseTime(opts.start) or 0
+    end = parseTime(opts.end) or (1 << 62)
+    reader = Reader(opts.file)
+    w = csv.writer(sys.stdout)
+    if opts.points:
+        w.writerow(["t_ms", "channel", "count", "v_min", "v_mean", "v_max", "ma_min", "ma_mean", "ma_max"])
+        for row in reader.overview(start, end, opts.channel, opts.points):
+            w.writerow(row[:3] + tuple(f"{x:.6f}" for x in row[3:]))
+    else:
+        w.writerow(["t_ms", "channel", "v", "ma"])
+        for t, ch, v, ma in reader.samples(start, end, opts.channel):
+            w.writerow([t, ch, f"{v:.6f}", f"{ma:.6f}"])
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,406 @@
+#!/usr/bin/env python3
+"""Sharded ingest for large fleets.
+
+Devices are spread over shards. A shard is a receiver process owning one
+socket, the devices are told to send to it with UUL START, and a decoder
+process parsing records, assembling captures and writing the INA store.
+Stages are connected by single producer single consumer rings in shared
+memory, datagrams and records move in batches:
+
+    receiver --ring--> decoder --ring--> main (merge, print)
+       ^--ring-- main (START, STATS)
+
+Without a GIL or a lock shared between shards, throughput grows with the
+cores. The synthetic load benchmark measures it:
+
+    ingest.py --workers 1 2 4 --devices 32 --seconds 5
+"""
+
+import argparse
+import logging
+import marshal
+import multiprocessing
+import os
+import select
+import socket
+import sys
+import time
+import types
+from multiprocessing import shared_memory
+
+logger = logging.getLogger()
+
+RING_SIZE = 1 << 22
+# datagrams taken per receive round
+BATCH = 256
+IDLE_S = 0.001
+
+
+class SpscRing:
+    """Byte messages in a shared memory ring, one producer and one consumer
+    process. The producer publishes the tail after the message bytes, the
+    consumer the head after reading them. Both indexes are read and written
+    under a lock of the ring: its acquire and release are the barriers that
+    keep the bytes ahead of the index on weakly ordered cpus (ARM, Apple
+    Silicon), taken once per message, which is a batch. Counters sit on
+    their own cache lines next to the index of their writer."""
+
+    HEADER = 192
+    TAIL, ITEMS_IN, FULL = 0, 1, 2
+    HEAD, ITEMS_OUT = 8, 9
+    SIZE = 16
+
+    def __init__(self, size=RING_SIZE):
+        self.shm = shared_memory.SharedMemory(create=True, size=self.HEADER + size)
+        self.owner = True
+        self.shm.buf[:self.HEADER].cast('Q')[self.SIZE] = size
+        self.lock = multiprocessing.get_context().Lock()
+        self.attach()
+
+    def attach(self):
+        self.idx = self.shm.buf[:self.HEADER].cast('Q')
+        self.size = self.idx[self.SIZE]
+        self.data = self.shm.buf[self.HEADER:self.HEADER + self.size]
+
+    def __getstate__(self):
+        return (self.shm.name, self.lock)
+
+    # spawned workers attach by name, the creator unlinks
+    def __setstate__(self, state):
+        name, self.lock = state
+        self.shm = shared_memory.SharedMemory(name=name)
+        self.owner = False
+        self.attach()
+
+    def load(self, i):
+        """An index written by the other side"""
+        with self.lock:
+            return self.idx[i]
+
+    def publish(self, i, value):
+        with self.lock:
+            self.idx[i] = value
+
+    def push(self, msg, items=1):
+        """False when full, the producer retries"""
+        n = len(msg)
+        need = (4 + n + 3) & ~3
+        if need > self.size:
+            raise ValueError(f"Message of {n} bytes does not fit")
+        tail = self.idx[self.TAIL]
+        head = self.load(self.HEAD)
+        pos = tail % self.size
+        skip = self.size - pos if self.size - pos < need else 0
+        if tail + skip + need - head > self.size:
+            self.idx[self.FULL] += 1
+            return False
+        if skip:
+            # wrap marker, the message starts the next lap
+            self.data[pos:pos + 4] = b"\xff\xff\xff\xff"
+            pos = 0
+        self.data[pos:pos + 4] = n.to_bytes(4, 'little')
+        self.data[pos + 4:pos + 4 + n] = msg
+        self.idx[self.ITEMS_IN] += items
+        self.publish(self.TAIL, tail + skip + need)
+        return True
+
+    def pop(self):
+        head = self.idx[self.HEAD]
+        if head == self.load(self.TAIL):
+            return None
+        pos = head % self.size
+        n = int.from_bytes(self.data[pos:pos + 4], 'little')
+        if n == 0xFFFFFFFF:
+            head += self.size - pos
+            pos = 0
+            n = int.from_bytes(self.data[0:4], 'little')
+        msg = bytes(self.data[pos + 4:pos + 4 + n])
+        self.publish(self.HEAD, head + ((4 + n + 3) & ~3))
+        return msg
+
+    def done(self, items):
+        """Items of popped messages, for the depth and throughput"""
+        self.idx[self.ITEMS_OUT] += items
+
+    def counters(self):
+        """(items in, items out, bytes queued, full retries)"""
+        return (self.idx[self.ITEMS_IN], self.idx[self.ITEMS_OUT],
+                self.idx[self.TAIL] - self.idx[self.HEAD], self.idx[self.FULL])
+
+    def close(self):
+        # views into the mapping go first, or it can not be closed
+        self.data.release()
+        self.idx.release()
+        self.shm.close()
+        if self.owner:
+            self.shm.unlink()
+
+
+def pushWait(ring, msg, items, stop):
+    while not ring.push(msg, items):
+        if stop.is_set():
+            return
+        time.sleep(IDLE_S)
+
+
+def hostName(ip, port, default_port):
+    return ip if port == default_port else f"{ip}:{port}"
+
+
+def receiver(ctl, out, stop):
+    """Receive stage: START and STATS from the control ring, datagrams in
+    batches of (ip, port, arrival, data) to the decoder. A START may carry
+    the command to send, a signed one."""
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 << 20)
+    sock.bind(("", 0))
+    sock.setblocking(False)
+    devices = []
+    while not stop.is_set():
+        while (cmd := ctl.pop()) is not None:
+            ctl.done(1)
+            words = cmd.split(maxsplit=3)
+            if words[0] == b"START":
+                addr = (words[1].decode(), int(words[2]))
+                devices.append(addr)
+                sock.sendto(words[3] if len(words) > 3 else b"UUL START", addr)
+            elif words[0] == b"STATS":
+                for addr in devices:
+                    sock.sendto(b"UUL STATS", addr)
+        r, _, _ = select.select([sock], [], [], 0.05)
+        if not r:
+            continue
+        now = time.monotonic()
+        batch = []
+        while len(batch) < BATCH:
+            try:
+                data, addr = sock.recvfrom(2048)
+            except BlockingIOError:
+                break
+            batch.append((addr[0], addr[1], now, data))
+        pushWait(out, marshal.dumps(batch), len(batch), stop)
+
+
+def decoder(inp, out, stop, cfg):
+    """Decode stage: records to (host, source, ms, payload, arrival),
+    "UUL STATS" to (host, "UUL", 0, text, arrival), captures and INA
+    readings written here; their devices only ever come to this shard"""
+    import inacap
+    import inastore
+    import replay
+    import session
+    import udpmon
+    assembler = inacap.Assembler()
+    store = inastore.Store(cfg['ina_store']) if cfg['ina_store'] else None
+    # a file per shard, replay.py merges them
+    recorder = replay.Recorder(f"{cfg['record']}.{cfg['shard']}") if cfg['record'] else None
+    opener = session.Opener(cfg['key']) if cfg['key'] else None
+    devices = {}
+    opts = types.SimpleNamespace(captures=cfg['captures'])
+    try:
+        while not stop.is_set():
+            msg = inp.pop()
+            if msg is None:
+                time.sleep(IDLE_S)
+                continue
+            batch = marshal.loads(msg)
+            inp.done(len(batch))
+            ret = []
+            if recorder:
+                for ip, port, now, data in batch:
+                    recorder.add(now, (ip, port), data)
+            if opener:
+                # sealed datagrams to the records they carry
+                batch = [(ip, port, now, d) for ip, port, now, data in batch for d in opener.datagrams(data)]
+            for ip, port, now, data in batch:
+                host = hostName(ip, port, cfg['port'])
+                if data.startswith(b"UUL STATS "):
+                    ret.append((host, "UUL", 0, data.decode("ascii", errors='ignore'), now))
+                elif data.startswith(b"UUL"):
+                    continue
+                elif (c := udpmon.CAPTURE_RE.match(data)):
+                    udpmon.saveCapture(opts, assembler, host, c.group(2))
+                else:
+                    text = data.decode("utf-8", errors='ignore')
+                    m = udpmon.RECORD_RE.match(text)
+                    if not m:
+                        ret.append((host, "?", 0, text, now))
+                        continue
+                    payload = f"[{m.group(3)}] {m.group(4)}" if m.group(3) else m.group(4)
+                    ret.append((host, m.group(1), int(m.group(2)), payload, now))
+                    if store and m.group(1) == "INA":
+                        dev = devices.get(host)
+                        if not dev:
+                            dev = devices[host] = udpmon.Device(host)
+                        dev.align(int(m.group(2)), now)
+                        udpmon.storeIna(store, dev, payload)
+            if ret:
+                pushWait(out, marshal.dumps(ret), len(ret), stop)
+    finally:
+        if store:
+            store.close()
+        if recorder:
+            recorder.close()
+
+
+class Shard:
+    def __init__(self, index, cfg, stop, ring_size):
+        self.index = index
+        self.ctl = SpscRing(1 << 16)
+        self.raw = SpscRing(ring_size)
+        self.out = SpscRing(ring_size)
+        self.devices = 0
+        ctx = multiprocessing.get_context()
+        self.procs = [
+            ctx.Process(target=receiver, args=(self.ctl, self.raw, stop), daemon=True,
+                        name=f"recv{index}"),
+            ctx.Process(target=decoder, args=(self.raw, self.out, stop, dict(cfg, shard=index)), daemon=True,
+                        name=f"decode{index}"),
+        ]
+        for p in self.procs:
+            p.start()
+
+    def rings(self):
+        return (self.raw, self.out)
+
+
+class Pipeline:
+    """Shards and their rings as seen from the main process"""
+
+    def __init__(self, workers, port, captures=".", ina_store=None, ring_size=RING_SIZE, record=None, key=None):
+        self.port = port
+        self.stop = multiprocessing.get_context().Event()
+        cfg = {'port': port, 'captures': captures, 'ina_store': ina_store, 'record': record, 'key': key}
+        self.shards = [Shard(i, cfg, self.stop, ring_size) for i in range(workers)]
+        self.last = (time.monotonic(), [[r.counters() for r in s.rings()] for s in self.shards])
+
+    def add(self, ip, port=None, command=b"UUL START"):
+        """The device goes to the shard with the fewest, which sends START"""
+        shard = min(self.shards, key=lambda s: s.devices)
+        shard.devices += 1
+        pushWait(shard.ctl, f"START {ip} {port or self.port} ".encode() + command, 1, self.stop)
+
+    def requestStats(self):
+        for s in self.shards:
+            pushWait(s.ctl, b"STATS", 1, self.stop)
+
+    def poll(self):
+        """Decoded records of every shard, a batch at most from each"""
+        ret = []
+        for s in self.shards:
+            msg = s.out.pop()
+            if msg is not None:
+                batch = marshal.loads(msg)
+                s.out.done(len(batch))
+                ret += batch
+        return ret
+
+    def report(self, now):
+        """Per shard and stage: records/s and what waits in the ring"""
+        cur = [[r.counters() for r in s.rings()] for s in self.shards]
+        dt = max(now - self.last[0], 1e-3)
+        for s, c, p in zip(self.shards, cur, self.last[1]):
+            (rin, rout, rbytes, rfull), (din, dout, dbytes, dfull) = c
+            logger.info(f"Ingest shard {s.index}: {s.devices} devices, "
+                        f"recv {(rin - p[0][0]) / dt:.0f}/s, decode {(rout - p[0][1]) / dt:.0f}/s "
+                        f"(queued {rin - rout} / {rbytes // 1024} KB), "
+                        f"out {(dout - p[1][1]) / dt:.0f}/s (queued {din - dout} / {dbytes // 1024} KB), "
+                        f"full {rfull + dfull}")
+        self.last = (now, cur)
+
+    def close(self):
+        self.stop.set()
+        for s in self.shards:
+            for p in s.procs:
+                p.join(2)
+            for r in (s.ctl, s.raw, s.out):
+                r.close()
+
+
+def syntheticDevices(count, size, stop, ports):
+    """Devices answering START by sending records flat out"""
+    socks = []
+    for _ in range(count):
+        s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+        s.bind(("127.0.0.1", 0))
+        s.setblocking(False)
+        socks.append(s)
+    ports.send([s.getsockname()[1] for s in socks])
+    targets = {}
+    payload = ("x" * (size - 1) + "\n").encode()
+    ms = 0
+    while not stop.is_set():
+        for s in socks:
+            try:
+                data, addr = s.recvfrom(512)
+                if data == b"UUL START":
+                    targets[s] = addr
+            except BlockingIOError:
+                pass
+        ms += 1
+        rec = f"1 {ms}: ".encode() + payload
+        for s, addr in targets.items():
+            for _ in range(16):
+                try:
+                    s.sendto(rec, addr)
+                except (BlockingIOError, ConnectionRefusedError):
+                    break
+        if not targets:
+            time.sleep(0.01)
+
+
+def bench(workers, devices, seconds, size, senders):
+    """Records/s through the whole pipeline with `workers` shards"""
+    ctx = multiprocessing.get_context()
+    stop = ctx.Event()
+    pipe = Pipeline(workers, 0)
+    procs, ports = [], []
+    for i in range(senders):
+        a, b = ctx.Pipe()
+        p = ctx.Process(target=syntheticDevices, args=(devices // senders, size, stop, b), daemon=True)
+        p.start()
+        procs.append(p)
+        ports += a.recv()
+    for port in ports:
+        pipe.add("127.0.0.1", port)
+    # warm up, then count
+    end = time.monotonic() + 1
+    while time.monotonic() < end:
+        pipe.poll()
+    count = 0
+    start = time.monotonic()
+    end = start + seconds
+    while time.monotonic() < end:
+        got = pipe.poll()
+        if not got:
+            time.sleep(IDLE_S)
+        count += len(got)
+    rate = count / (time.monotonic() - start)
+    pipe.report(time.monotonic())
+    stop.set()
+    for p in procs:
+        p.join(2)
+    pipe.close()
+    return rate
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--workers", "-w", type=int, nargs='+', default=[1, 2, 4])
+    parser.add_argument("--devices", "-n", type=int, default=32)
+    parser.add_argument("--senders", type=int, default=os.cpu_count() or 1,
+                        help="processes sending for the synthetic devices")
+    parser.add_argument("--seconds", "-t", type=float, default=5.0)
+    parser.add_argument("--size", type=int, default=100, help="record payload bytes")
+    opts = parser.parse_args()
+    logging.basicConfig(level=logging.INFO, stream=sys.stderr)
+    print(f"{os.cpu_count()} cores, {opts.devices} devices, {opts.size} byte records")
+    base = None
+    for w in opts.workers:
+        rate = bench(w, opts.devices, opts.seconds, opts.size, min(opts.senders, opts.devices))
+        base = base or rate / w
+        print(f"workers {w}: {rate:.0f} records/s, {rate / base / w:.2f} of linear")
+
+
+if __name__ == "__main__":
+    main()
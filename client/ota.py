@@ -0,0 +1,145 @@
+#!/usr/bin/env python3
+"""Firmware update over the control port, e.g.
+
+    ota.py -H 192.168.1.50 .pio/build/esp32dev/firmware.bin
+
+The signed "UUL OTA <nonce> <size> <sha256> <mac>" starts it, the device
+acks and erases the inactive app slot sector by sector as it writes.
+Chunks go out as "UUL OTAD" <seq> <data> within the window the acks
+allow; a chunk not acked in --rto is sent again. The device checks the
+SHA-256, switches the boot slot and restarts.
+"""
+
+import argparse
+import getpass
+import hashlib
+import logging
+import os
+import select
+import socket
+import struct
+import sys
+import time
+
+from control import sign
+
+logger = logging.getLogger()
+
+CHUNK = 1024
+DATA = struct.Struct("<8sI")
+
+
+class Transfer:
+    def __init__(self, sock, image, rto):
+        self.sock = sock
+        self.image = image
+        self.rto = rto
+        self.chunks = (len(image) + CHUNK - 1) // CHUNK
+        self.next = 0
+        self.limit = 0
+        self.acked = set()
+        self.sent = {}
+        # send time of the latest chunk known to have arrived
+        self.newest = 0.0
+        self.packets = 0
+        self.retransmits = 0
+
+    def ack(self, words):
+        """UUL OTA ACK <next> <limit> <bitmap>"""
+        self.next, self.limit, bitmap = int(words[3]), int(words[4]), int(words[5], 16)
+        self.acked = {self.next + i for i in range(bitmap.bit_length()) if bitmap >> i & 1}
+        for seq in self.acked | {self.next - 1}:
+            self.newest = max(self.newest, self.sent.get(seq, 0.0))
+
+    def send(self):
+        now = time.monotonic()
+        for seq in range(self.next, self.limit):
+            if seq in self.acked:
+                continue
+            t = self.sent.get(seq)
+            # one sent before a chunk that arrived is lost, the timeout
+            # is for when no ack tells
+            if t is not None and now - t < self.rto and t >= self.newest:
+                continue
+            self.sock.send(DATA.pack(b"UUL OTAD", seq) + self.image[seq * CHUNK:(seq + 1) * CHUNK])
+            self.sent[seq] = now
+            self.packets += 1
+            self.retransmits += t is not None
+
+
+def receive(sock, timeout):
+    """Responses that came within timeout, at least one unless it ran out"""
+    ret = []
+    end = time.monotonic() + timeout
+    while True:
+        r, _, _ = select.select([sock], [], [], 0 if ret else max(0, end - time.monotonic()))
+        if not r:
+            return ret
+        data = sock.recv(512).decode('ascii', errors='replace')
+        logger.debug(f"> {data}")
+        ret.append(data.split())
+
+
+def update(sock, key, image, rto=0.2, timeout=10.0):
+    """sock is connected to the device, chunks are taken from its address only"""
+    body = f"UUL OTA {int(time.time() * 1000)} {len(image)} {hashlib.sha256(image).hexdigest()}"
+    logger.info(f"Sending {len(image)} bytes")
+    sock.send(f"{body} {sign(key, body)}".encode('ascii'))
+    t = Transfer(sock, image, rto)
+    start = None
+    last = time.monotonic()
+    progress = 0
+    while True:
+        resp = receive(sock, timeout if start is None else rto / 2)
+        now = time.monotonic()
+        if resp:
+            last = now
+        elif now - last > timeout:
+            raise RuntimeError("No answer")
+        for words in resp:
+            if words[:3] == ["UUL", "OTA", "ACK"]:
+                if start is None:
+                    start = now
+                t.ack(words)
+            elif words[:3] == ["UUL", "OTA", "DONE"]:
+                elapsed = now - (start or now)
+                print(f"{len(image)} bytes in {elapsed:.2f}s, {len(image) / max(elapsed, 1e-9) / 1024:.0f} KB/s, "
+                      f"{t.packets} packets, {t.retransmits} retransmitted; the device restarts")
+                return True
+            elif words[:2] == ["UUL", "ERR"] or words[:3] == ["UUL", "OTA", "ERR"]:
+                raise RuntimeError(" ".join(words))
+        if start is not None:
+            t.send()
+            if t.next * 10 // t.chunks > progress:
+                progress = t.next * 10 // t.chunks
+                logger.info(f"{progress * 10}%")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--verbose", "-v", action="store_true")
+    parser.add_argument("--host", "-H", required=True)
+    parser.add_argument("--port", "-p", default=60606, type=int)
+    parser.add_argument("--key", "-k", default=os.environ.get("UUL_KEY"),
+                        help="control key, UUL_KEY or a prompt by default")
+    parser.add_argument("--rto", type=float, default=0.2, help="retransmit timeout, seconds")
+    parser.add_argument("image", help="app image, firmware.bin")
+    opts = parser.parse_args()
+    logging.basicConfig(level=logging.DEBUG if opts.verbose else logging.INFO, stream=sys.stderr)
+    key = opts.key if opts.key is not None else getpass.getpass("Control key: ")
+    with open(opts.image, "rb") as f:
+        image = f.read()
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.connect((opts.host, opts.port))
+    try:
+        update(sock, key, image, opts.rto)
+    except KeyboardInterrupt:
+        sock.send(b"UUL OTA ABORT")
+        sys.exit(1)
+    except RuntimeError as e:
+        logger.error(e)
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
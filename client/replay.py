@@ -0,0 +1,213 @@
+#!/usr/bin/env python3
+"""Replays recorded device streams over UDP, see udpmon.py --record.
+
+Every recorded device becomes one or more simulated devices, each a socket
+speaking the device side of UUL: PING, START, STOP and STATS are answered,
+records go to the receiver of the last START. Inter-arrival times are kept,
+divided by --speed, or it runs flat out with --speed 0.
+
+    replay.py rec.uul                           # first device on 60606, waits for START
+    replay.py rec.uul --speed 10 --copies 20    # 20 copies of every device at 10x
+    replay.py rec.uul rec.uul.1 --to 127.0.0.1:60000 --speed 0
+"""
+
+import argparse
+import heapq
+import logging
+import select
+import socket
+import struct
+import sys
+import time
+
+logger = logging.getLogger()
+
+MAGIC = b"UULREC1\n"
+# arrival time, source ip and port, datagram length
+RECORD = struct.Struct("<d4sHH")
+
+
+class Recorder:
+    """Appends received datagrams with their arrival time"""
+
+    def __init__(self, path):
+        self.f = open(path, "ab")
+        if self.f.tell() == 0:
+            self.f.write(MAGIC)
+
+    def add(self, t, addr, data):
+        self.f.write(RECORD.pack(t, socket.inet_aton(addr[0]), addr[1], len(data)) + data)
+
+    def close(self):
+        self.f.close()
+
+
+def readRecording(path):
+    """(time, (ip, port), data) in the order recorded"""
+    with open(path, "rb") as f:
+        if f.read(len(MAGIC)) != MAGIC:
+            raise RuntimeError(f"{path}: not a recording")
+        while True:
+            hdr = f.read(RECORD.size)
+            if len(hdr) < RECORD.size:
+                return
+            t, ip, port, n = RECORD.unpack(hdr)
+            data = f.read(n)
+            if len(data) < n:
+                return
+            yield t, (socket.inet_ntoa(ip), port), data
+
+
+class SimDevice:
+    def __init__(self, name, bind, port):
+        self.name = name
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_SNDBUF, 1 << 20)
+        self.sock.bind((bind, port))
+        self.sock.setblocking(False)
+        self.port = self.sock.getsockname()[1]
+        self.receiver = None
+        self.sent = 0
+        self.failed = 0
+
+    def control(self):
+        """Answers what the collector asked"""
+        while True:
+            try:
+                data, addr = self.sock.recvfrom(512)
+            except (BlockingIOError, ConnectionRefusedError):
+                return
+            cmd = data.split()
+            if len(cmd) < 2 or cmd[0] != b"UUL":
+                continue
+            if cmd[1] == b"PING":
+                self.sock.sendto(b"UUL PONG", addr)
+            elif cmd[1] == b"START":
+                self.receiver = addr
+                logger.info(f"{self.name} on {self.port}: streaming to {addr[0]}:{addr[1]}")
+                self.sock.sendto(b"UUL OK", addr)
+            elif cmd[1] == b"STOP":
+                self.receiver = None
+                self.sock.sendto(b"UUL OK", addr)
+            elif cmd[1] == b"STATS":
+                self.sock.sendto(f"UUL STATS replay=1 udp.sent={self.sent} udp.fail={self.failed}".encode(), addr)
+            else:
+                self.sock.sendto(b"UUL ERR UNSUPPORTED COMMAND", addr)
+
+    def send(self, data):
+        if not self.receiver:
+            return False
+        try:
+            self.sock.sendto(data, self.receiver)
+            self.sent += 1
+            return True
+        except (BlockingIOError, ConnectionRefusedError):
+            self.failed += 1
+            return False
+
+
+def merged(paths):
+    """Datagrams of all recordings in time order, device responses left out"""
+    streams = [readRecording(p) for p in paths]
+    for t, addr, data in heapq.merge(*streams, key=lambda x: x[0]):
+        if not data.startswith(b"UUL "):
+            yield t, addr, data
+
+
+def waitStart(devices, timeout):
+    end = time.monotonic() + timeout
+    while any(not d.receiver for d in devices) and time.monotonic() < end:
+        select.select([d.sock for d in devices], [], [], 0.1)
+        for d in devices:
+            d.control()
+    return sum(1 for d in devices if d.receiver)
+
+
+def replay(opts):
+    sources = {}
+    for _, addr, _ in merged(opts.files):
+        sources.setdefault(addr[0], None)
+    if not sources:
+        raise RuntimeError("Nothing to replay")
+    devices = []
+    port = opts.port
+    for src in sources:
+        copies = []
+        for i in range(opts.copies):
+            d = SimDevice(f"{src}#{i}", opts.bind, port)
+            port = port + 1 if port else 0
+            if opts.to:
+                d.receiver = opts.to
+            copies.append(d)
+            devices.append(d)
+        sources[src] = copies
+    logger.info(f"{len(sources)} recorded devices, {len(devices)} simulated on ports "
+                f"{', '.join(str(d.port) for d in devices[:8])}{'...' if len(devices) > 8 else ''}")
+    if not opts.to:
+        logger.info(f"Waiting {opts.wait:.0f}s for START")
+        logger.info(f"{waitStart(devices, opts.wait)} of {len(devices)} devices started")
+
+    errors = []
+    packets = 0
+    first = None
+    start = time.monotonic()
+    next_control = start
+    socks = [d.sock for d in devices]
+    for t, addr, data in merged(opts.files):
+        if first is None:
+            first = t
+        due = start + (t - first) / opts.speed if opts.speed else None
+        while due is not None:
+            now = time.monotonic()
+            if now >= due:
+                break
+            r, _, _ = select.select(socks, [], [], due - now)
+            for d in devices:
+                if d.sock in r:
+                    d.control()
+        now = time.monotonic()
+        if now >= next_control:
+            for d in devices:
+                d.control()
+            next_control = now + 0.1
+        for d in sources[addr[0]]:
+            packets += d.send(data)
+        if due is not None:
+            errors.append(time.monotonic() - due)
+    elapsed = time.monotonic() - start
+    report(packets, elapsed, errors, sum(d.failed for d in devices))
+
+
+def report(packets, elapsed, errors, failed):
+    print(f"{packets} packets in {elapsed:.2f}s, {packets / max(elapsed, 1e-9):.0f} packets/s, {failed} failed")
+    if errors:
+        errors.sort()
+        ms = [x * 1000 for x in errors]
+        print(f"timing error ms: mean {sum(ms) / len(ms):.3f} p50 {ms[len(ms) // 2]:.3f} "
+              f"p99 {ms[min(len(ms) - 1, len(ms) * 99 // 100)]:.3f} max {ms[-1]:.3f}")
+
+
+def parseAddr(s):
+    host, _, port = s.rpartition(':')
+    return (host, int(port))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--verbose", "-v", action="store_true")
+    parser.add_argument("files", nargs='+', help="recordings, shards of one run are merged")
+    parser.add_argument("--speed", "-s", type=float, default=1.0, help="time scale, 0 - flat out")
+    parser.add_argument("--copies", "-n", type=int, default=1, help="simulated devices per recorded one")
+    parser.add_argument("--bind", default="127.0.0.1")
+    parser.add_argument("--port", "-p", type=int, default=60606,
+                        help="port of the first simulated device, the next ones count up; 0 - any")
+    parser.add_argument("--to", type=parseAddr, default=None,
+                        help="HOST:PORT to stream to without waiting for START")
+    parser.add_argument("--wait", type=float, default=30.0, help="seconds to wait for START")
+    opts = parser.parse_args()
+    logging.basicConfig(level=logging.DEBUG if opts.verbose else logging.INFO, stream=sys.stderr)
+    replay(opts)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,97 @@
+"""Encrypted sessions, see include/session.hpp.
+
+A signed "UUL AUTH <nonce> START" starts one: the key is derived from the
+control key, the nonce and the device's boot count, the first 4 bytes of
+every IV; data comes as AES-128-GCM datagrams of batched records. Opener
+turns them back into the plain datagrams and drops replayed ones.
+"""
+
+import hashlib
+import hmac
+import struct
+import time
+
+from control import sign
+
+MAGIC = b"UULE"
+# magic, session nonce, IV
+HEADER = struct.Struct("<4sQ12s")
+# boot, counter
+IV = struct.Struct("<IQ")
+TAG_LEN = 16
+# counters this far behind the newest are still taken once, UDP reorders
+REPLAY_WINDOW = 64
+
+_last_nonce = 0
+
+
+def nextNonce():
+    """ms time, growing within the process even for several devices at once"""
+    global _last_nonce
+    _last_nonce = max(int(time.time() * 1000), _last_nonce + 1)
+    return _last_nonce
+
+
+def buildAuth(key, command, nonce=None):
+    """UUL AUTH <nonce> <command> <mac>, the signed form of any command"""
+    if nonce is None:
+        nonce = nextNonce()
+    body = f"UUL AUTH {nonce} {command}"
+    return f"{body} {sign(key, body)}"
+
+
+def deriveKey(key, nonce, boot):
+    return hmac.new(key.encode(), f"UUL SESSION {nonce} {boot}".encode(), hashlib.sha256).digest()[:16]
+
+
+class Opener:
+    """Keys by session nonce and boot, so any datagram can be opened without
+    knowing which START it belongs to. A counter seen before under its key,
+    or older than the replay window, is dropped."""
+
+    def __init__(self, key):
+        from cryptography.hazmat.primitives.ciphers.aead import AESGCM
+        self.aesgcm = AESGCM
+        self.key = key
+        # (nonce, boot) -> [cipher, newest counter, bitmap of it and the
+        # counters before it]
+        self.sessions = {}
+        self.failed = 0
+        self.replayed = 0
+
+    def open(self, data):
+        """Records of a sealed datagram, [] when it does not authenticate
+        or is a replay"""
+        if len(data) < HEADER.size + TAG_LEN:
+            self.failed += 1
+            return []
+        _, nonce, iv = HEADER.unpack_from(data)
+        boot, counter = IV.unpack(iv)
+        s = self.sessions.get((nonce, boot))
+        if not s:
+            s = self.sessions[nonce, boot] = [self.aesgcm(deriveKey(self.key, nonce, boot)), -1, 0]
+        _, newest, seen = s
+        if counter <= newest and (newest - counter >= REPLAY_WINDOW or seen >> (newest - counter) & 1):
+            self.replayed += 1
+            return []
+        try:
+            plain = s[0].decrypt(iv, data[HEADER.size:], data[:12])
+        except Exception:
+            self.failed += 1
+            return []
+        # only an authentic counter moves the window
+        if counter > newest:
+            s[1] = counter
+            s[2] = (seen << min(counter - newest, REPLAY_WINDOW) | 1) & ((1 << REPLAY_WINDOW) - 1)
+        else:
+            s[2] = seen | 1 << (newest - counter)
+        ret = []
+        pos = 0
+        while pos + 2 <= len(plain):
+            n = plain[pos] | plain[pos + 1] << 8
+            ret.append(plain[pos + 2:pos + 2 + n])
+            pos += 2 + n
+        return ret
+
+    def datagrams(self, data):
+        return self.open(data) if data.startswith(MAGIC) else [data]
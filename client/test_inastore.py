@@ -0,0 +1,112 @@
+"""INA store: the time and Gorilla value columns round trip bit for bit,
+through blocks of a file as well.
+
+    python3 -m unittest discover -s client
+"""
+
+import math
+import os
+import random
+import tempfile
+import unittest
+
+import inastore
+from inastore import decodeTimes, decodeValues, encodeTimes, encodeValues, floatBits
+
+
+class CodecTest(unittest.TestCase):
+    def assertValues(self, values):
+        """Bit for bit, so NaN and -0.0 compare too"""
+        data = encodeValues(values)
+        self.assertEqual([floatBits(x) for x in decodeValues(len(values), data)], [floatBits(x) for x in values])
+        return data
+
+    def assertTimes(self, times):
+        data = encodeTimes(times)
+        self.assertEqual(decodeTimes(times[0] if times else 0, len(times), data), times)
+        return data
+
+    def testConstant(self):
+        # a bit a sample after the first; a byte a time after the first
+        # delta, 200 zigzagged in two
+        self.assertEqual(len(self.assertValues([4.096] * 1024)), (64 + 1023 + 7) // 8)
+        self.assertEqual(len(self.assertTimes([1700000000000 + 100 * i for i in range(1024)])), 2 + 1022)
+
+    def testOne(self):
+        self.assertValues([-1.5])
+        self.assertTimes([1700000000000])
+
+    def testEmpty(self):
+        self.assertEqual(self.assertValues([]), b"")
+        self.assertEqual(self.assertTimes([]), b"")
+
+    def testSpecial(self):
+        self.assertValues([0.0, -0.0, math.nan, 1.0, math.nan, -math.nan, math.inf, -math.inf, 5e-324, 1.7e308])
+
+    def testNegative(self):
+        self.assertValues([-0.001 * i * i for i in range(500)])
+        self.assertValues([(-1) ** i * 12.5 for i in range(500)])
+
+    def testFullWidth(self):
+        # the sign and the last mantissa bit differ: all 64 bits are
+        # meaningful, stored as size 0
+        self.assertValues([1.0, -math.nextafter(1.0, 2.0), 1.0])
+
+    def testLargeDeltas(self):
+        # jumps, a clock going back, a second and a day between samples
+        self.assertTimes([0, 1 << 40, 5, 1700000000000, 1699999999000, 1700000001000, 1700086401000, 1700086401001])
+        self.assertValues([1e-300, 1e300, -1e300, 3.3, 1e-300])
+
+    def testRandom(self):
+        rnd = random.Random(7)
+        times, t = [], 1700000000000
+        for _ in range(2500):
+            t += rnd.choice([100, 100, 100, 99, 101, 0, 5000, -3])
+            times.append(t)
+        self.assertTimes(times)
+        self.assertValues([rnd.uniform(-500, 500) for _ in range(2500)])
+        # readings near each other, as a bus voltage
+        self.assertValues([round(3.3 + rnd.gauss(0, 0.004), 3) for _ in range(2500)])
+
+
+class StoreTest(unittest.TestCase):
+    def setUp(self):
+        self.dir = tempfile.TemporaryDirectory()
+        self.path = os.path.join(self.dir.name, "ina-test.ina")
+
+    def tearDown(self):
+        self.dir.cleanup()
+
+    def testBlocks(self):
+        rnd = random.Random(3)
+        rows = []
+        w = inastore.Writer(self.path)
+        for i in range(2500):
+            readings = [x for ch in range(3) for x in (5.0 - ch + rnd.gauss(0, 0.01), rnd.uniform(-200, 200))]
+            readings[5] = math.nan if i % 97 == 0 else readings[5]
+            rows.append((1700000000000 + 100 * i, readings))
+            w.add(*rows[-1])
+        w.close()
+        r = inastore.Reader(self.path)
+        # full blocks as they fill, the partial ones on close
+        self.assertEqual([(b.channel, b.count) for b in r.blocks],
+                         [(c, 1024) for c in (1, 2, 3)] * 2 + [(c, 452) for c in (1, 2, 3)])
+        for ch in (1, 2, 3):
+            got = [(t, floatBits(v), floatBits(ma)) for t, _, v, ma in r.samples(0, 1 << 62, ch)]
+            want = [(t, floatBits(x[ch * 2 - 2]), floatBits(x[ch * 2 - 1])) for t, x in rows]
+            self.assertEqual(got, want)
+        # a range inside one block
+        self.assertEqual([t for t, *_ in r.samples(1700000102400, 1700000102600, 2)],
+                         [1700000102400, 1700000102500, 1700000102600])
+        r.f.close()
+
+    def testNothingWritten(self):
+        inastore.Writer(self.path).close()
+        r = inastore.Reader(self.path)
+        self.assertEqual(r.blocks, [])
+        self.assertEqual(list(r.samples(0, 1 << 62, 0)), [])
+        r.f.close()
+
+
+if __name__ == "__main__":
+    unittest.main()
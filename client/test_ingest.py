@@ -0,0 +1,106 @@
+"""SpscRing: wraparound, a full ring, a message not fitting before the end
+and a producer in another process.
+
+    python3 -m unittest discover -s client
+"""
+
+import multiprocessing
+import unittest
+
+from ingest import SpscRing
+
+
+def message(i):
+    """Length varies so that the ring wraps at every offset"""
+    return i.to_bytes(4, 'little') * (1 + i % 13)
+
+
+def produce(ring, count):
+    for i in range(count):
+        while not ring.push(message(i)):
+            pass
+
+
+class SpscRingTest(unittest.TestCase):
+    def setUp(self):
+        self.ring = SpscRing(64)
+
+    def tearDown(self):
+        self.ring.close()
+
+    def testOrder(self):
+        for m in (b"a", b"", b"bcd"):
+            self.assertTrue(self.ring.push(m))
+        self.assertEqual([self.ring.pop() for _ in range(3)], [b"a", b"", b"bcd"])
+        self.assertIsNone(self.ring.pop())
+
+    def testFull(self):
+        pushed = 0
+        while self.ring.push(b"x" * 12):
+            pushed += 1
+        # 4 length bytes, 12 of data, 16 a message
+        self.assertEqual(pushed, 4)
+        self.assertEqual(self.ring.counters()[3], 1)
+        self.assertEqual(self.ring.pop(), b"x" * 12)
+        self.assertTrue(self.ring.push(b"y" * 12))
+        self.assertFalse(self.ring.push(b"z"))
+        self.assertEqual(self.ring.counters()[3], 2)
+
+    def testWrap(self):
+        # 24 bytes each: the third does not fit in the 16 left at the end
+        # and goes to the start after a wrap marker
+        self.assertTrue(self.ring.push(b"a" * 20))
+        self.assertTrue(self.ring.push(b"b" * 20))
+        self.assertEqual(self.ring.pop(), b"a" * 20)
+        self.assertTrue(self.ring.push(b"c" * 20))
+        # the skipped end counts as queued until the consumer passes it
+        self.assertEqual(self.ring.counters()[2], 24 + 16 + 24)
+        self.assertEqual(self.ring.pop(), b"b" * 20)
+        self.assertEqual(self.ring.pop(), b"c" * 20)
+        self.assertIsNone(self.ring.pop())
+        self.assertEqual(self.ring.counters()[2], 0)
+
+    def testWrapNeedsRoom(self):
+        # the skip counts against the free space: with the head at 24 a
+        # message of 24 at 48 would need 16 + 24 past the 40 free
+        self.assertTrue(self.ring.push(b"a" * 20))
+        self.assertTrue(self.ring.push(b"b" * 20))
+        self.assertFalse(self.ring.push(b"c" * 28))
+        self.assertEqual(self.ring.pop(), b"a" * 20)
+        self.assertFalse(self.ring.push(b"c" * 28))
+        self.assertEqual(self.ring.pop(), b"b" * 20)
+        self.assertTrue(self.ring.push(b"c" * 28))
+        self.assertEqual(self.ring.pop(), b"c" * 28)
+
+    def testExactEnd(self):
+        for m in (b"a" * 28, b"b" * 28):
+            self.assertTrue(self.ring.push(m))
+        self.assertEqual(self.ring.pop(), b"a" * 28)
+        self.assertEqual(self.ring.pop(), b"b" * 28)
+        # no marker at the end, the next one starts the lap at 0
+        self.assertTrue(self.ring.push(b"c" * 28))
+        self.assertEqual(self.ring.pop(), b"c" * 28)
+
+    def testTooLarge(self):
+        with self.assertRaises(ValueError):
+            self.ring.push(b"x" * 61)
+
+    def testOtherProcess(self):
+        count = 5000
+        ring = SpscRing(4096)
+        try:
+            p = multiprocessing.get_context().Process(target=produce, args=(ring, count), daemon=True)
+            p.start()
+            for i in range(count):
+                while (m := ring.pop()) is None:
+                    pass
+                self.assertEqual(m, message(i))
+            p.join(10)
+            self.assertEqual(p.exitcode, 0)
+            self.assertIsNone(ring.pop())
+        finally:
+            ring.close()
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,163 @@
+"""OTA window and selective ack against the simulator: a scripted sender
+asserting every ack, and ota.update over a link that drops and reorders.
+UUL_SIM names the simulator binary, ctest sets it.
+
+    UUL_SIM=sim/build/udplogger_sim python3 -m unittest test_ota
+"""
+
+import contextlib
+import hashlib
+import io
+import os
+import re
+import select
+import socket
+import subprocess
+import time
+import unittest
+
+import ota
+from control import sign
+
+SIM = os.environ.get("UUL_SIM")
+KEY = "test"
+# 61 chunks, the last of 100 bytes: batches 0-15, 16-31, 32-47 and 48-60
+IMAGE = bytes([0xE9]) + bytes(i * 7 % 251 for i in range(60 * ota.CHUNK + 99))
+# a chunk this far ahead is never in the window and always acked
+FAR = 1 << 20
+
+
+def freePort():
+    with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+class Lossy:
+    """Socket losing every 7th chunk sent and swapping the order of the two
+    after it"""
+
+    def __init__(self, sock):
+        self.sock = sock
+        self.count = 0
+        self.held = None
+
+    def send(self, data):
+        if not data.startswith(b"UUL OTAD"):
+            return self.sock.send(data)
+        self.count += 1
+        if self.count % 7 == 0:
+            return len(data)
+        if self.count % 7 == 1:
+            self.held = data
+            return len(data)
+        self.sock.send(data)
+        if self.held is not None:
+            self.sock.send(self.held)
+            self.held = None
+        return len(data)
+
+    def recv(self, size):
+        return self.sock.recv(size)
+
+    def fileno(self):
+        return self.sock.fileno()
+
+
+@unittest.skipUnless(SIM, "UUL_SIM names no simulator binary")
+class OtaTest(unittest.TestCase):
+    def setUp(self):
+        port = freePort()
+        self.sim = subprocess.Popen([SIM, "-q", "-p", str(port), "-k", KEY],
+                                    stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.connect(("127.0.0.1", port))
+        end = time.monotonic() + 10
+        while time.monotonic() < end:
+            self.sock.send(b"UUL OTA")
+            if self.replies(0.5) == ["IDLE"]:
+                return
+        self.fail("the simulator does not answer")
+
+    def tearDown(self):
+        self.sock.close()
+        self.sim.kill()
+        self.sim.wait()
+
+    def replies(self, quiet):
+        """"UUL OTA" replies without the prefix until none came for quiet s"""
+        ret = []
+        while select.select([self.sock], [], [], quiet)[0]:
+            try:
+                ret.append(self.sock.recv(512).decode("ascii").removeprefix("UUL OTA "))
+            except ConnectionRefusedError:
+                break
+        return ret
+
+    def begin(self, image, sha=None):
+        body = f"UUL OTA {int(time.time() * 1000)} {len(image)} {sha or hashlib.sha256(image).hexdigest()}"
+        self.sock.send(f"{body} {sign(KEY, body)}".encode("ascii"))
+        self.assertEqual(self.replies(0.5), ["ACK 0 32 0"])
+
+    def send(self, *seqs, image=IMAGE):
+        for seq in seqs:
+            self.sock.send(ota.DATA.pack(b"UUL OTAD", seq) + image[seq * ota.CHUNK:(seq + 1) * ota.CHUNK])
+
+    def acks(self):
+        """Acks of what was sent, the last one is to a chunk out of the window"""
+        self.send(FAR)
+        return self.replies(0.3)
+
+    def testSelectiveAck(self):
+        self.begin(IMAGE)
+        # an ack every 8 new chunks, the bitmap is of those after the
+        # first missing one
+        self.send(2, 3, 5)
+        self.assertEqual(self.acks(), ["ACK 0 32 2c"])
+        # a duplicate and one past the window are acked at once
+        self.send(3, 32)
+        self.assertEqual(self.acks(), ["ACK 0 32 2c"] * 3)
+        self.send(1, 0)
+        self.assertEqual(self.acks(), ["ACK 4 32 2"])
+        self.send(15, 14, 13)
+        self.assertEqual(self.acks(), ["ACK 4 32 e02"] * 2)
+        # 4 was lost: the first batch is written when it comes, the
+        # window moves on
+        self.send(12, 11, 10, 9, 8, 7, 6, 4)
+        self.assertEqual(self.acks(), ["ACK 16 48 0"] * 2)
+        # behind the window
+        self.send(4)
+        self.assertEqual(self.acks(), ["ACK 16 48 0"] * 2)
+        # all of the window but its first chunk, the top bit is the last
+        self.send(*range(17, 48))
+        self.assertEqual(self.acks(), ["ACK 16 48 1fe", "ACK 16 48 1fffe", "ACK 16 48 1fffffe", "ACK 16 48 fffffffe"])
+        # both batches go out
+        self.send(16)
+        self.assertEqual(self.acks(), ["ACK 48 61 0"] * 2)
+        # the last chunk padded to a full one is refused
+        self.sock.send(ota.DATA.pack(b"UUL OTAD", 60) + bytes(ota.CHUNK))
+        self.assertEqual(self.acks(), ["ACK 48 61 0"] * 2)
+        # the final batch is short, its last chunk partial
+        self.send(*range(48, 61))
+        self.assertEqual(self.acks(), ["ACK 56 61 0", "DONE", "DONE"])
+        # restarts into the new image
+        self.assertEqual(self.sim.wait(5), 0)
+
+    def testHashMismatch(self):
+        self.begin(IMAGE, hashlib.sha256(IMAGE[1:]).hexdigest())
+        self.send(*range(61))
+        self.assertEqual(self.acks()[-2:], ["ERR HASH"] * 2)
+        self.sock.send(b"UUL OTA")
+        self.assertEqual(self.replies(0.5), ["ERR HASH"])
+        self.assertIsNone(self.sim.poll())
+
+    def testLossyLink(self):
+        with contextlib.redirect_stdout(io.StringIO()) as out:
+            self.assertTrue(ota.update(Lossy(self.sock), KEY, IMAGE, rto=0.1, timeout=5))
+        retransmits = re.search(r"(\d+) retransmitted", out.getvalue())
+        self.assertGreater(int(retransmits[1]), 0)
+        self.assertEqual(self.sim.wait(5), 0)
+
+
+if __name__ == "__main__":
+    unittest.main()
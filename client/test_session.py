@@ -0,0 +1,147 @@
+"""Encrypted sessions: datagrams sealed by the simulator opened by Opener,
+tampered, replayed and under another boot count. Needs cryptography and
+UUL_SIM, the simulator binary, which ctest sets.
+
+    UUL_SIM=sim/build/udplogger_sim python3 -m unittest test_session
+"""
+
+import importlib.util
+import os
+import select
+import socket
+import subprocess
+import tempfile
+import time
+import unittest
+
+import session
+from test_ota import SIM, freePort
+
+KEY = "test"
+LINES = [f"line {i}\n".encode() for i in range(3)]
+
+
+def seal(nonce, boot, counter, records):
+    """A datagram as the device seals it"""
+    from cryptography.hazmat.primitives.ciphers.aead import AESGCM
+    header = session.HEADER.pack(session.MAGIC, nonce, session.IV.pack(boot, counter))
+    plain = b"".join(len(r).to_bytes(2, "little") + r for r in records)
+    return header + AESGCM(session.deriveKey(KEY, nonce, boot)).encrypt(header[12:], plain, header[:12])
+
+
+def records(opener, data):
+    """Records of a datagram without the "<source> <ms>: " headers"""
+    return [r.partition(b": ")[2] for r in opener.open(data)]
+
+
+@unittest.skipUnless(SIM and importlib.util.find_spec("cryptography"), "no UUL_SIM or no cryptography")
+class SessionTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        """A line a datagram from uart 1 of a simulator in session mode"""
+        port = freePort()
+        with tempfile.TemporaryDirectory() as tmp:
+            sim = subprocess.Popen([SIM, "-q", "-s", "-k", KEY, "-p", str(port), "-l", f"{tmp}/uart"],
+                                   stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+            sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+            try:
+                sock.connect(("127.0.0.1", port))
+                end = time.monotonic() + 10
+                while True:
+                    if time.monotonic() > end:
+                        raise AssertionError("the simulator does not answer")
+                    sock.send(session.buildAuth(KEY, "START").encode("ascii"))
+                    time.sleep(0.2)
+                    try:
+                        if select.select([sock], [], [], 0.5)[0] and sock.recv(512) == b"UUL OK":
+                            break
+                    except ConnectionRefusedError:
+                        pass
+                uart = os.open(f"{tmp}/uart1", os.O_RDWR | os.O_NOCTTY)
+                cls.sealed = []
+                for line in LINES:
+                    os.write(uart, line)
+                    while select.select([sock], [], [], 2)[0]:
+                        data = sock.recv(2048)
+                        if data.startswith(session.MAGIC):
+                            cls.sealed.append(data)
+                            break
+                os.close(uart)
+            finally:
+                sock.close()
+                sim.kill()
+                sim.wait()
+        _, cls.nonce, iv = session.HEADER.unpack_from(cls.sealed[0])
+        cls.boot, _ = session.IV.unpack(iv)
+
+    def setUp(self):
+        self.assertEqual(len(self.sealed), len(LINES))
+        self.opener = session.Opener(KEY)
+
+    def testRoundtrip(self):
+        opened = [records(self.opener, d) for d in self.sealed]
+        # the boot event comes with the first line
+        self.assertEqual([r for r in opened[0] if r.startswith(b"line")], LINES[:1])
+        self.assertEqual(opened[1:], [[x] for x in LINES[1:]])
+        self.assertEqual([session.IV.unpack_from(d, 12)[1] for d in self.sealed], [0, 1, 2])
+        self.assertEqual(self.opener.datagrams(b"UUL OK"), [b"UUL OK"])
+        self.assertEqual((self.opener.failed, self.opener.replayed), (0, 0))
+
+    def testTampered(self):
+        d = self.sealed[1]
+        # tag, ciphertext, nonce
+        for at in (len(d) - 1, session.HEADER.size, 4):
+            self.assertEqual(self.opener.open(d[:at] + bytes([d[at] ^ 1]) + d[at + 1:]), [])
+        self.assertEqual(self.opener.open(d[:session.HEADER.size + session.TAG_LEN - 1]), [])
+        forged = d[:16] + (1000).to_bytes(8, "little") + d[24:]
+        self.assertEqual(self.opener.open(forged), [])
+        self.assertEqual(self.opener.failed, 5)
+        # the forged counter did not move the window
+        self.assertEqual(records(self.opener, d), LINES[1:2])
+        self.assertEqual(self.opener.replayed, 0)
+
+    def testReplay(self):
+        first, second, third = self.sealed
+        self.assertEqual(records(self.opener, third), LINES[2:])
+        # reordered, each once
+        self.assertEqual(records(self.opener, second), LINES[1:2])
+        self.assertEqual(self.opener.open(second), [])
+        self.assertEqual(self.opener.open(third), [])
+        self.assertTrue(self.opener.open(first))
+        self.assertEqual(self.opener.replayed, 2)
+        self.assertEqual(self.opener.failed, 0)
+
+    def testWindow(self):
+        newest = session.REPLAY_WINDOW + 10
+        self.assertEqual(records(self.opener, seal(self.nonce, self.boot, newest, [b"1 0: new"])), [b"new"])
+        # just too old, the oldest one taken
+        old = seal(self.nonce, self.boot, newest - session.REPLAY_WINDOW, [b"1 0: old"])
+        self.assertEqual(self.opener.open(old), [])
+        self.assertEqual(self.opener.replayed, 1)
+        late = seal(self.nonce, self.boot, newest - session.REPLAY_WINDOW + 1, [b"1 0: late"])
+        self.assertEqual(records(self.opener, late), [b"late"])
+        # a jump past the window forgets all before it
+        self.assertTrue(self.opener.open(seal(self.nonce, self.boot, newest * 10, [b"1 0: far"])))
+        self.assertEqual(self.opener.open(late), [])
+        self.assertEqual(self.opener.replayed, 2)
+
+    def testBootChange(self):
+        d = self.sealed[2]
+        self.assertEqual(records(self.opener, d), LINES[2:])
+        # the boot is part of the key and of the IV
+        moved = d[:12] + (self.boot + 1).to_bytes(4, "little") + d[16:]
+        self.assertEqual(self.opener.open(moved), [])
+        self.assertEqual(self.opener.failed, 1)
+        # after a reset the counter starts again under the new key
+        restored = seal(self.nonce, self.boot + 1, 0, [b"1 0: again"])
+        self.assertEqual(records(self.opener, restored), [b"again"])
+        self.assertEqual(self.opener.open(restored), [])
+        self.assertEqual(self.opener.replayed, 1)
+        # the old boot's window is its own
+        self.assertEqual(self.opener.open(d), [])
+        self.assertEqual(records(self.opener, self.sealed[1]), LINES[1:2])
+        self.assertEqual(self.opener.replayed, 2)
+
+
+if __name__ == "__main__":
+    unittest.main()
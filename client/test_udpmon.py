@@ -0,0 +1,94 @@
+"""Merger: records of two devices interleaved, delayed, late and duplicated,
+aligned by Device and released in time order.
+
+    python3 -m unittest discover -s client
+"""
+
+import unittest
+
+from udpmon import Device, Merger
+
+
+class MergerTest(unittest.TestCase):
+    def setUp(self):
+        self.merger = Merger(0.5, 100)
+        self.a = Device("a")
+        self.b = Device("b")
+        self.out = []
+
+    def push(self, dev, ts, payload, now):
+        self.out += self.merger.push(dev, "1", ts, payload, now)
+
+    def pop(self, now, flush=False):
+        self.out += self.merger.pop(now, flush)
+
+    def released(self):
+        """Payloads in output order, a late one marked"""
+        ret = [("LATE " if late else "") + payload for _, _, _, payload, late in self.out]
+        self.out = []
+        return ret
+
+    def testInterleaved(self):
+        # each device's offset is its least delayed record: a at 100.0,
+        # b at 100.02; b1 comes 80 ms late, after a1
+        self.push(self.a, 0, "a0", 100.0)
+        self.push(self.b, 0, "b0", 100.02)
+        self.push(self.a, 100, "a1", 100.11)
+        self.push(self.b, 50, "b1", 100.2)
+        self.push(self.a, 200, "a2", 100.2)
+        self.assertEqual(self.released(), [])
+        self.pop(100.58)
+        self.assertEqual(self.released(), ["a0", "b0", "b1"])
+        self.pop(101, flush=True)
+        self.assertEqual(self.released(), ["a1", "a2"])
+        self.assertEqual(self.merger.reordered, 1)
+        self.assertEqual(self.merger.late, 0)
+        self.assertEqual((self.a.records, self.b.records), (3, 2))
+
+    def testLate(self):
+        self.push(self.a, 0, "a0", 100.0)
+        self.push(self.b, 0, "b0", 100.02)
+        self.pop(100.6)
+        self.assertEqual(self.released(), ["a0", "b0"])
+        # older than b0, out at once and counted; a newer one waits
+        self.push(self.a, 10, "a1", 100.6)
+        self.push(self.b, 600, "b1", 100.61)
+        self.assertEqual(self.released(), ["LATE a1"])
+        self.pop(101, flush=True)
+        self.assertEqual(self.released(), ["b1"])
+        self.assertEqual(self.merger.late, 1)
+        self.assertEqual((self.a.late, self.b.late), (1, 0))
+
+    def testDuplicate(self):
+        # equal records are not merged, a target may well print a line twice
+        self.push(self.a, 0, "a0", 100.0)
+        self.push(self.b, 0, "b0", 100.01)
+        self.push(self.a, 0, "a0", 100.03)
+        self.push(self.b, 30, "b1", 100.05)
+        self.pop(101)
+        self.assertEqual(self.released(), ["a0", "a0", "b0", "b1"])
+        # once released, a repeat is late
+        self.push(self.a, 0, "a0", 101.0)
+        self.assertEqual(self.released(), ["LATE a0"])
+        self.assertEqual(self.merger.late, 1)
+
+    def testDepth(self):
+        # over depth the oldest goes out whatever the window
+        merger = Merger(10, 2)
+        out = []
+        for i, dev in enumerate([self.a, self.b, self.a, self.b]):
+            out += merger.push(dev, "1", i * 10, f"r{i}", 100.0 + i * 0.01)
+        self.assertEqual([x[3] for x in out], ["r0", "r1"])
+        self.assertEqual(merger.max_depth, 3)
+
+    def testReboot(self):
+        # a device clock going back starts a new offset
+        self.push(self.a, 50000, "a0", 100.0)
+        self.push(self.a, 10, "a1", 100.1)
+        self.pop(101, flush=True)
+        self.assertEqual(self.released(), ["a0", "a1"])
+        self.assertAlmostEqual(self.a.offset, 100.09)
+
+
+if __name__ == "__main__":
+    unittest.main()
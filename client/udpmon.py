@@ -1,15 +1,40 @@
 #!/usr/bin/env python3
 
 import argparse
+import atexit
+import getpass
+import heapq
+import json
 import logging
+import os
+import re
+import select
+import struct
 import sys
 import socket
-import psutil
+import time
+import inacap
+import inastore
+import ingest
+import replay
+import session
 
 logger = logging.getLogger()
 
+# "<source> <device ms>: <payload>", UART records may carry the target
+# power after the time: "<source> <device ms> <V>V <mA>mA: <payload>"
+RECORD_RE = re.compile(r"^(\S+) (\d+)(?: ([^:]*))?: ?(.*)$", re.S)
+# binary INA capture chunks
+CAPTURE_RE = re.compile(rb"^CAP (\d+): (.*)$", re.S)
+
+# devices multicast "UUL ANNOUNCE key=value ..." to this group on port + 1
+ANNOUNCE_GROUP = "239.255.60.60"
+PROTOCOL_VERSION = 1
+
 
 def getNetsBroadcast():
+    # only discovery needs it, the shards and the tests import this module
+    import psutil
     ret = []
     for x, y in psutil.net_if_addrs().items():
         ips = [z.broadcast for z in y if z.family ==
@@ -27,60 +52,410 @@ def broadcastPing(opts):
     sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
     sock.setsockopt(socket.SOL_SOCKET, socket.SO_BROADCAST, 1)
     sock.settimeout(1.0)
+    found = []
     for x in hosts:
         logger.debug(f"Send ping broadcast to {x}:{opts.port}")
         try:
             sock.sendto(b"UUL PING", (x, opts.port))
-            data, server = sock.recvfrom(512)
-            logger.debug(f"Got response from {server}: {data}")
-            if data == b"UUL PONG":
-                logger.debug(f"Server discovered at {server}")
-                return server[0]
+            # collect every device answering on this network
+            while True:
+                data, server = sock.recvfrom(512)
+                logger.debug(f"Got response from {server}: {data}")
+                if data == b"UUL PONG" and server[0] not in found:
+                    logger.debug(f"Server discovered at {server}")
+                    found.append(server[0])
         except socket.timeout:
-            logger.debug(f"No answer from {x}")
+            logger.debug(f"No more answers from {x}")
     sock.close()
-    return None
+    return found
+
+
+def openAnnounce(opts):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind(("", opts.port + 1))
+    mreq = struct.pack("4s4s", socket.inet_aton(ANNOUNCE_GROUP), socket.inet_aton("0.0.0.0"))
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, mreq)
+    sock.setblocking(False)
+    return sock
+
+
+def parseAnnounce(data):
+    """UUL ANNOUNCE key=value ... -> dict, None if not a beacon"""
+    if not data.startswith(b"UUL ANNOUNCE "):
+        return None
+    ret = {}
+    for x in data.decode("ascii", errors='ignore').split()[2:]:
+        k, _, v = x.partition('=')
+        ret[k] = v
+    ret['ch'] = ret.get('ch', "").split(',') if ret.get('ch') else []
+    return ret
+
+
+class DeviceTable:
+    """Devices known from their beacons, by address"""
+
+    def __init__(self):
+        self.devices = {}
+
+    def update(self, info, server, now):
+        """Returns the device address when it is new"""
+        host = info.get('ip') or server[0]
+        new = host not in self.devices
+        if new:
+            logger.info(f"Device {info.get('name')} at {host}: fw {info.get('fw')} "
+                        f"proto {info.get('proto')} channels {','.join(info['ch'])}")
+            if info.get('proto') != str(PROTOCOL_VERSION):
+                logger.warning(f"{host} speaks protocol {info.get('proto')}, "
+                               f"this client {PROTOCOL_VERSION}")
+        self.devices[host] = dict(info, seen=now)
+        return host if new else None
+
+    def report(self, now):
+        for host, d in self.devices.items():
+            logger.info(f"  {d.get('name')} {host}: fw {d.get('fw')} "
+                        f"channels {','.join(d['ch'])} seen {now - d['seen']:.1f}s ago")
+
+
+def listenAnnounce(asock, table, timeout):
+    """Waits up to `timeout` seconds for the first beacon, returns new hosts"""
+    found = []
+    deadline = time.monotonic() + timeout
+    while not found and time.monotonic() < deadline:
+        r, _, _ = select.select([asock], [], [], max(0, deadline - time.monotonic()))
+        if r:
+            found += readAnnounce(asock, table)
+    return found
+
+
+def readAnnounce(asock, table):
+    found = []
+    while True:
+        try:
+            data, server = asock.recvfrom(512)
+        except BlockingIOError:
+            return found
+        info = parseAnnounce(data)
+        if info is None:
+            continue
+        host = table.update(info, server, time.monotonic())
+        if host:
+            found.append(host)
+
+
+class Device:
+    def __init__(self, host):
+        self.host = host
+        self.offset = None
+        self.last_ts = None
+        self.last_time = None
+        self.records = 0
+        self.late = 0
+
+    def align(self, ts, now):
+        """Map device milliseconds to host time. The offset is the smallest
+        seen (arrival - device time), i.e. the least delayed record."""
+        dev_time = ts / 1000.0
+        if self.last_ts is not None and ts + 1000 < self.last_ts:
+            logger.info(f"{self.host}: device clock went back, rebooted?")
+            self.offset = None
+        if self.offset is None or now - dev_time < self.offset:
+            self.offset = now - dev_time
+        self.last_ts = ts
+        self.last_time = dev_time + self.offset
+        self.records += 1
+        return self.last_time
+
+    def lag(self, now):
+        return now - self.last_time if self.last_time is not None else None
+
+
+class Merger:
+    """Bounded reorder window over records of several devices.
+
+    A record is released when its aligned time is older than `window`
+    seconds or when `depth` records are pending. Records older than the last
+    released one are late: they are printed at once and counted."""
+
+    def __init__(self, window, depth):
+        self.window = window
+        self.depth = depth
+        self.heap = []
+        self.seq = 0
+        self.last = 0.0
+        self.max_depth = 0
+        self.reordered = 0
+        self.late = 0
+
+    def push(self, dev, source, ts, payload, now):
+        t = dev.align(ts, now)
+        if t < self.last:
+            self.late += 1
+            dev.late += 1
+            return [(t, dev, source, payload, True)]
+        heapq.heappush(self.heap, (t, self.seq, dev, source, payload))
+        self.seq += 1
+        self.max_depth = max(self.max_depth, len(self.heap))
+        return self.pop(now)
+
+    def pop(self, now, flush=False):
+        ret = []
+        while self.heap and (flush or len(self.heap) > self.depth or
+                             self.heap[0][0] <= now - self.window):
+            t, seq, dev, source, payload = heapq.heappop(self.heap)
+            if self.heap and self.heap[0][1] < seq:
+                self.reordered += 1
+            self.last = t
+            ret.append((t, dev, source, payload, False))
+        return ret
+
+    def report(self, devices, now):
+        logger.info(f"Merge: pending {len(self.heap)} max depth {self.max_depth} "
+                    f"reordered {self.reordered} late {self.late}")
+        for d in devices.values():
+            lag = d.lag(now)
+            lag = f"{lag * 1000:.0f}ms" if lag is not None else "-"
+            logger.info(f"  {d.host}: records {d.records} late {d.late} lag {lag}")
+
+
+class Printer:
+    def __init__(self, multi):
+        self.multi = multi
+        self.mlen = 0
+        self.inastr = ""
+
+    def print(self, t, dev, source, payload, late):
+        prefix = f"{dev.host} " if self.multi else ""
+        if late:
+            prefix += "LATE "
+        s = payload.strip()
+        if source == "INA":
+            s = f"{prefix}INA: {s}"
+            self.inastr = s
+            if (len(s) > self.mlen):
+                self.mlen = len(s)
+            print(s, end='\r')
+        else:
+            s = f"{prefix}{source}: {s}"
+            if (len(s) < self.mlen):
+                s += ' ' * (self.mlen - len(s))
+            print(s)
+            print(self.inastr, end='\r')
+
+
+def parseStats(data):
+    """UUL STATS key=value ... -> dict"""
+    ret = {}
+    for x in data.split()[2:]:
+        k, _, v = x.partition('=')
+        ret[k] = int(v) if v.isdigit() else v
+    return ret
+
+
+def logHealth(opts, host, data):
+    stats = parseStats(data.decode("ascii", errors='ignore'))
+    logger.info(f"{host} health: {' '.join(f'{k}={v}' for k, v in stats.items())}")
+    if opts.health:
+        with open(opts.health, "a") as f:
+            f.write(json.dumps({"time": time.time(), "host": host, "stats": stats}) + "\n")
+
+
+def saveCapture(opts, assembler, host, payload):
+    data = assembler.add(host, payload)
+    if data is None:
+        return
+    block = inacap.parseBlock(data)
+    name = os.path.join(opts.captures, f"ina-{host}-{block['trigger_ms']}.bin")
+    with open(name, "wb") as f:
+        f.write(data)
+    logger.info(f"{host}: INA {block['reason']} capture on ch{block['channel']}, "
+                f"{block['pre']}+{block['post']} samples every {block['period_us']} us saved to {name}")
+
+
+def storeIna(store, dev, payload):
+    try:
+        readings = [float(x) for x in payload.split()]
+    except ValueError:
+        return
+    # aligned device times are monotonic, the store keeps wall clock ms
+    if len(readings) == 6:
+        store.add(dev.host, int((dev.last_time + time.time() - time.monotonic()) * 1000), readings)
+
+
+def startCommand(opts):
+    """A plain START, or a signed one starting an encrypted session"""
+    if opts.session:
+        return session.buildAuth(opts.key, "START").encode('ascii')
+    return b"UUL START"
+
+
+def runSharded(opts, table, asock, hosts):
+    """The receive loop spread over opts.workers shards, see ingest.py.
+    Shards decode and write captures and INA readings, merging and
+    printing stay here."""
+    pipe = ingest.Pipeline(opts.workers, opts.port, opts.captures, opts.ina_store, record=opts.record,
+                           key=opts.key if opts.session else None)
+    atexit.register(pipe.close)
+    devices = {}
+    for x in hosts:
+        devices[x] = Device(x)
+        pipe.add(x, command=startCommand(opts))
+    merger = Merger(opts.window, opts.depth)
+    printer = Printer(len(hosts) > 1)
+    next_report = time.monotonic() + opts.stats if opts.stats else None
+    while True:
+        r = []
+        got = pipe.poll()
+        if asock:
+            r, _, _ = select.select([asock], [], [], 0 if got else 0.005)
+        elif not got:
+            time.sleep(0.005)
+        if asock in r:
+            for x in readAnnounce(asock, table):
+                if x not in devices:
+                    logger.info(f"Subscribing to {x}")
+                    devices[x] = Device(x)
+                    pipe.add(x, command=startCommand(opts))
+                    printer.multi = len(devices) > 1
+        now = time.monotonic()
+        out = []
+        for host, source, ts, payload, arrival in got:
+            dev = devices.get(host)
+            if not dev:
+                dev = devices[host] = Device(host)
+            if source == "UUL":
+                logHealth(opts, host, payload.encode())
+            elif source == "?":
+                out.append((arrival, dev, source, payload, False))
+            else:
+                out += merger.push(dev, source, ts, payload, arrival)
+        out += merger.pop(now)
+        for x in out:
+            printer.print(*x)
+        if next_report and now >= next_report:
+            merger.report(devices, now)
+            table.report(now)
+            pipe.report(now)
+            pipe.requestStats()
+            next_report = now + opts.stats
 
 
 def run(opts, args):
     level = logging.INFO if opts.verbose < 1 else logging.DEBUG
     logging.basicConfig(
         level=level, format='%(asctime)s.%(msecs)03d %(levelname)s %(message)s', stream=sys.stderr)
-    host = None
-    while not host:
-        host = broadcastPing(opts)
-    logger.info(f"Found logger server at {host}")
+    table = DeviceTable()
+    asock = openAnnounce(opts) if not opts.host else None
+    hosts = listenAnnounce(asock, table, opts.discover) if asock else []
+    # devices not announcing, e.g. an older firmware or no multicast route
+    while not hosts:
+        hosts = broadcastPing(opts)
+    logger.info(f"Found logger servers at {', '.join(hosts)}")
+    if opts.workers:
+        return runSharded(opts, table, asock, hosts)
     sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
-    sock.sendto(b"UUL START", (host, opts.port))
-    mlen = 0
-    inastr = ""
+    devices = {x: Device(x) for x in hosts}
+    opener = session.Opener(opts.key) if opts.session else None
+    for x in hosts:
+        sock.sendto(startCommand(opts), (x, opts.port))
+    merger = Merger(opts.window, opts.depth)
+    assembler = inacap.Assembler()
+    store = inastore.Store(opts.ina_store) if opts.ina_store else None
+    if store:
+        # partial blocks are written on the way out, ^C included
+        atexit.register(store.close)
+    recorder = replay.Recorder(opts.record) if opts.record else None
+    if recorder:
+        atexit.register(recorder.close)
+    printer = Printer(len(hosts) > 1)
+    next_report = time.monotonic() + opts.stats if opts.stats else None
+    inputs = [sock, asock] if asock else [sock]
     while True:
+        out = []
+        now = time.monotonic()
+        r, _, _ = select.select(inputs, [], [], opts.window / 2)
+        if asock in r:
+            # devices appearing later are subscribed at once
+            for x in readAnnounce(asock, table):
+                if x not in devices:
+                    logger.info(f"Subscribing to {x}")
+                    devices[x] = Device(x)
+                    sock.sendto(startCommand(opts), (x, opts.port))
+                    printer.multi = len(devices) > 1
         try:
-            data, server = sock.recvfrom(512)
-            if data.startswith(b"UUL"):
+            if sock not in r:
+                raise socket.timeout()
+            data, server = sock.recvfrom(2048)
+            now = time.monotonic()
+            if recorder:
+                recorder.add(now, server, data)
+            if data.startswith(b"UUL STATS "):
+                logHealth(opts, server[0], data)
+            elif data.startswith(b"UUL") and not data.startswith(session.MAGIC):
                 logger.debug(f"Got response from {server}: {data}")
-            else:
-                str = data.decode("utf-8", errors='ignore').strip()
-                if (str.startswith("INA:")):
-                    inastr = str
-                    if (len(str) > mlen):
-                        mlen = len(str)
-                    print(str, end='\r')
+            # a sealed datagram carries a batch of records
+            for data in opener.datagrams(data) if opener else [data]:
+                if data.startswith(b"UUL"):
+                    continue
+                if CAPTURE_RE.match(data):
+                    saveCapture(opts, assembler, server[0], CAPTURE_RE.match(data).group(2))
+                    continue
+                dev = devices.get(server[0])
+                if not dev:
+                    dev = devices[server[0]] = Device(server[0])
+                m = RECORD_RE.match(data.decode("utf-8", errors='ignore'))
+                if m:
+                    payload = f"[{m.group(3)}] {m.group(4)}" if m.group(3) else m.group(4)
+                    out += merger.push(dev, m.group(1), int(m.group(2)), payload, now)
+                    if store and m.group(1) == "INA":
+                        storeIna(store, dev, payload)
                 else:
-                    if (len(str) < mlen):
-                        str += ' ' * (mlen - len(str))
-                    print(str)
-                    print(inastr, end='\r')
+                    out.append((now, dev, "?", data.decode("utf-8", errors='ignore'), False))
         except socket.timeout:
             logger.debug("Timeout")
+        out += merger.pop(now)
+        for x in out:
+            printer.print(*x)
+        if next_report and now >= next_report:
+            merger.report(devices, now)
+            table.report(now)
+            for x in devices:
+                sock.sendto(b"UUL STATS", (x, opts.port))
+            next_report = now + opts.stats
 
 
 def main():
     parser = argparse.ArgumentParser()
     parser.add_argument("--verbose", "-v", action="count", default=0)
     parser.add_argument("--host", "-H", default=None)
-    parser.add_argument("--port", "-p", default=60606)
-    run(*parser.parse_known_args())
+    parser.add_argument("--port", "-p", type=int, default=60606)
+    parser.add_argument("--window", "-w", type=float, default=0.2,
+                        help="reorder window, seconds")
+    parser.add_argument("--depth", "-d", type=int, default=1000,
+                        help="max records held in the reorder window")
+    parser.add_argument("--stats", "-s", type=float, default=10.0,
+                        help="merge and device health report period, seconds (0 - off)")
+    parser.add_argument("--discover", type=float, default=3.0,
+                        help="wait for device beacons this long before a broadcast ping, seconds")
+    parser.add_argument("--captures", default=".",
+                        help="directory for INA capture blocks, see inacap.py")
+    parser.add_argument("--ina-store", default=None,
+                        help="directory for columnar INA telemetry, see inastore.py")
+    parser.add_argument("--workers", type=int, default=0,
+                        help="shards of receive and decode processes for large fleets, see ingest.py")
+    parser.add_argument("--health", default=None,
+                        help="append device health snapshots to this JSON lines file")
+    parser.add_argument("--record", default=None,
+                        help="append every datagram with its arrival time to this file, see replay.py;"
+                        " with --workers a file per shard")
+    parser.add_argument("--session", action="store_true",
+                        help="signed START, the stream encrypted, see session.py")
+    parser.add_argument("--key", "-k", default=os.environ.get("UUL_KEY"),
+                        help="control key for --session, UUL_KEY or a prompt by default")
+    opts, args = parser.parse_known_args()
+    if opts.session and opts.key is None:
+        opts.key = getpass.getpass("Control key: ")
+    run(opts, args)
 
 
 if __name__ == "__main__":
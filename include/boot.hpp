@@ -0,0 +1,50 @@
+#pragma once
+
+#include "common.h"
+#include <esp_timer.h>
+
+// Boot timeline: the time every stage was first reached, ms since reset
+class Boot{
+public:
+    enum Stage {
+        APP_MAIN,
+        CONFIG,         // NVS read
+        CAPTURE,        // uart tasks started
+        WIFI_START,
+        ASSOC,          // associated with the AP
+        GOT_IP,
+        SOCKET,
+        FIRST_SEND,     // first data record left
+        SCREEN,
+        INA,
+        STAGES
+    };
+
+    // True the first time the stage is reached
+    static bool mark(Stage stage){
+        uint32_t ms = esp_timer_get_time() / 1000;
+        uint32_t unset = 0;
+        // 0 means not reached
+        return marks[stage].compare_exchange_strong(unset, ms ? ms : 1, std::memory_order_relaxed);
+    }
+
+    static inline uint32_t get(Stage stage){
+        return marks[stage].load(std::memory_order_relaxed);
+    }
+
+    // "app_main=312 config=340 ... ina=-"
+    static std::string snapshot(){
+        static const char* names[] = {"app_main", "config", "capture", "wifi", "assoc", "ip",
+            "socket", "first_tx", "screen", "ina"};
+        std::string ret;
+        for (int i = 0; i < STAGES; i++){
+            uint32_t ms = get(static_cast<Stage>(i));
+            if (i) ret += " ";
+            ret += std::string(names[i]) + "=" + (ms ? std::to_string(ms) : "-");
+        }
+        return ret;
+    }
+
+private:
+    static std::atomic<uint32_t> marks[STAGES];
+};
@@ -26,6 +26,14 @@ public:
         return gpio_get_level(pin);
     }
 
+    // True once per press, for polling every 100 ms or so
+    bool pressed(){
+        bool down = !level();
+        bool ret = down && !was_down;
+        was_down = down;
+        return ret;
+    }
+
     bool is_long_pressed(){
         for (int i=0; i<4; i++){
             if (level()) return false;
@@ -36,4 +44,5 @@ public:
 
 private:
     gpio_num_t pin;
+    bool was_down = false;
 };
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <esp_system.h>
 #include <esp_log.h>
 
+#include <atomic>
 #include <string>
 #include <vector>
 #include <freertos/FreeRTOS.h>
@@ -10,8 +11,10 @@
 
 
 #define TAG (name.c_str())
+#define MAX_THREADS 16
 
 typedef std::vector<uint8_t> byte_array;
+typedef std::vector<std::string> strings;
 
 class Base{
 public:
@@ -24,22 +27,127 @@ protected:
     std::string name;
 };
 
+// Stack budgets of the normal mode tasks, bytes: the peak measured in the
+// host simulator plus half, at least 2 KB, rounded up to 1 KB. Screen,
+// WiFi and the soft UART do not run there; Screen and WiFi keep their
+// old heap sizes, the soft UART takes the UARTs' budget.
+//   UDP   6007 (OTA and a sealed session active)
+//   UART  4279
+//   INA   4535 (trigger capture armed)
+#define STACK_UDP (1024 * 9)
+#define STACK_UART (1024 * 7)
+#define STACK_INA (1024 * 7)
+#define STACK_SCREEN (1024 * 8)
+#define STACK_WIFI (1024 * 4)
+#define STACK_SOFT_UART STACK_UART
+// a task using more than this share of its budget is warned about, percent
+#define STACK_WARN_PERCENT 75
+
+// Stack and TCB of a statically allocated task, STACK in bytes
+template<uint32_t STACK>
+struct TaskMemory{
+    StackType_t stack[STACK];
+    StaticTask_t tcb;
+};
+
 class Thread: public Base{
+public:
+    // Priority classes, highest first
+    enum Priority: UBaseType_t {
+        PRIO_CAPTURE = configMAX_PRIORITIES - 1,
+        PRIO_NET = configMAX_PRIORITIES - 2,
+        PRIO_TELEMETRY = configMAX_PRIORITIES - 3,
+        PRIO_UI = 1,
+    };
+
+    // WiFi and lwIP run on the PRO cpu, capture owns the APP cpu unless
+    // CONFIG_PIN_TASKS is off
+    enum Core: BaseType_t {
+        CORE_ANY = tskNO_AFFINITY,
+#if !CONFIG_PIN_TASKS
+        CORE_NET = tskNO_AFFINITY,
+        CORE_CAPTURE = tskNO_AFFINITY,
+#elif CONFIG_FREERTOS_UNICORE
+        CORE_NET = PRO_CPU_NUM,
+        CORE_CAPTURE = PRO_CPU_NUM,
+#else
+        CORE_NET = PRO_CPU_NUM,
+        CORE_CAPTURE = APP_CPU_NUM,
+#endif
+    };
+
 public:
     Thread(std::string name): Base(name){}
     virtual ~Thread(){}
 
-    void start(uint32_t stack, UBaseType_t priority){
-        xTaskCreate(&Thread::_run, name.c_str(), stack, this, priority, NULL);
+    void start(uint32_t stack, UBaseType_t priority, Core core = CORE_ANY){
+        stack_size = stack;
+        xTaskCreatePinnedToCore(&Thread::_run, name.c_str(), stack, this, priority, &handle, core);
+        add_started();
+    }
+
+    // Stack and TCB from memory reserved at build time instead of the heap
+    template<uint32_t STACK>
+    void start(TaskMemory<STACK>& mem, UBaseType_t priority, Core core = CORE_ANY){
+        stack_size = STACK;
+        handle = xTaskCreateStaticPinnedToCore(&Thread::_run, name.c_str(), STACK, this, priority,
+                                               mem.stack, &mem.tcb, core);
+        add_started();
+    }
+
+    inline const std::string& get_name() {return name;}
+
+    // Minimum free stack since start, bytes
+    uint32_t stack_high_water(){
+        return handle ? uxTaskGetStackHighWaterMark(handle) : 0;
+    }
+
+    // Started threads in start order, nullptr past the last one
+    static Thread* started(int i){
+        Registry& r = registry();
+        return i < r.count ? r.list[i] : nullptr;
+    }
+
+    static void report_stacks(){
+        Thread* t;
+        for (int i = 0; (t = started(i)) != nullptr; i++){
+            uint32_t used = t->stack_size - t->stack_high_water();
+            if (used * 100 > t->stack_size * STACK_WARN_PERCENT){
+                ESP_LOGW("Thread", "%s stack: %d of %d bytes used, over %d%%", t->name.c_str(), (int)used,
+                         (int)t->stack_size, STACK_WARN_PERCENT);
+            }else{
+                ESP_LOGI("Thread", "%s stack: %d of %d bytes used", t->name.c_str(), (int)used, (int)t->stack_size);
+            }
+        }
     }
 
 protected:
     virtual void run() = 0;
 
 private:
+    struct Registry{
+        Thread* list[MAX_THREADS];
+        std::atomic<int> count{0};
+    };
+
+    static Registry& registry(){
+        static Registry r;
+        return r;
+    }
+
+    void add_started(){
+        Registry& r = registry();
+        if (r.count < MAX_THREADS){
+            r.list[r.count] = this;
+            r.count++;
+        }
+    }
+
     static void _run(void* thiz){
         ((Thread*)thiz)->run();
     }
 
+    TaskHandle_t handle = nullptr;
+    uint32_t stack_size = 0;
 };
 
@@ -5,12 +5,22 @@
 #include <nvs_flash.h>
 #include <nvs_handle.hpp>
 #include <freertos/task.h>
+#include <freertos/semphr.h>
 #include <string>
 
+// uart word length, parity and stop bits packed as in uart_config_t:
+// bits 0-1 data bits, 2-3 parity, 4-5 stop bits
+#define UART_FRAME_8N1 (3 | 0 << 2 | 1 << 4)
+// INA3221 channels 1-3 on, 16 averaged, 1.1 ms bus and shunt conversions
+#define INA_CONFIG_DEFAULT 0x7520
+// trigger patterns until configured, '|' separated
+#define TRIGGERS_DEFAULT "Guru Meditation|assert failed|WDT"
+
 class Config:public Base{
 public:
     Config(Led led): Base("Config"), _led(led) {
         ESP_LOGD(TAG, "Init config");
+        lock = xSemaphoreCreateMutex();
         esp_err_t err = nvs_flash_init();
             if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
             ESP_ERROR_CHECK(nvs_flash_erase());
@@ -20,6 +30,7 @@ public:
             halt("init failed", err);
         }
         read_config();
+        count_boot();
         ESP_LOGI(TAG, "Config inited");
     }
 
@@ -53,6 +64,65 @@ public:
         check(handle->get_item<uint32_t>("uart", uart), "read uart pins");
         check(handle->get_item<uint16_t>("screen", screen), "read screen pins");
         check(handle->get_item<uint16_t>("ina", ina), "read INA pins");
+        // not there on devices configured before soft UART existed
+        handle->get_item<uint64_t>("suart", suart);
+        handle->get_item<uint32_t>("sbaud", sbaud);
+        // not there before auto baud is first set
+        handle->get_item<uint8_t>("abaud", abaud);
+        handle->get_item<uint16_t>("aberr", aberr);
+        // not there before the first connection
+        handle->get_item<uint64_t>("bssid", bssid);
+        handle->get_item<uint8_t>("chan", channel);
+        handle->get_item<uint64_t>("rcv", rcv);
+        handle->get_item<uint64_t>("rcvses", rcvses);
+        // DHCP devices never have them
+        handle->get_item<uint32_t>("sip", sip);
+        handle->get_item<uint32_t>("sgw", sgw);
+        handle->get_item<uint32_t>("smask", smask);
+        for (int port = 1; port < 3; port++){
+            std::string key = std::to_string(port);
+            handle->get_item<uint32_t>(("baud" + key).c_str(), ubaud[port]);
+            handle->get_item<uint8_t>(("frame" + key).c_str(), uframe[port]);
+        }
+        handle->get_item<uint16_t>("inaper", inaper);
+        handle->get_item<uint64_t>("icap", icap);
+        handle->get_item<uint16_t>("inacfg", inacfg);
+        handle->get_item<uint64_t>("shunt", shunt);
+        handle->get_item<uint8_t>("inapwr", inapwr);
+        handle->get_item<uint8_t>("session", session);
+        handle->get_item<uint64_t>("nonce", nonce);
+        psk = read_string(handle.get(), "psk");
+        size_t len;
+        if (handle->get_item_size(nvs::ItemType::SZ, "trig", len) == ESP_OK){
+            trig = read_string(handle.get(), "trig");
+        }
+    }
+
+    // Data receiver, ip << 16 | port, 0 - none, and the nonce of its
+    // encrypted session, 0 - plain. Saved by save_if_requested().
+    void save_receiver(uint64_t receiver, uint64_t session_nonce = 0){
+        xSemaphoreTake(lock, portMAX_DELAY);
+        bool changed = receiver != rcv || session_nonce != rcvses;
+        rcv = receiver;
+        rcvses = session_nonce;
+        xSemaphoreGive(lock);
+        if (changed) request_save();
+    }
+
+    // Access point of the last connection, for a directed reconnect
+    void save_ap(uint64_t ap_bssid, uint8_t ap_channel){
+        if (ap_bssid == bssid && ap_channel == channel) return;
+        bssid = ap_bssid;
+        channel = ap_channel;
+        esp_err_t err;
+        std::unique_ptr<nvs::NVSHandle> handle = nvs::open_nvs_handle("config", NVS_READWRITE, &err);
+        if (err != ESP_OK){
+            ESP_LOGE(TAG, "Open config failed: %d", err);
+            return;
+        }
+        check(handle->set_item<uint64_t>("bssid", bssid), "write bssid");
+        check(handle->set_item<uint8_t>("chan", channel), "write channel");
+        check(handle->commit(), "write commit");
     }
 
     void save_config(){
@@ -61,15 +131,51 @@ public:
         if (err != ESP_OK){
             halt("open config failed", err);
         }
+        xSemaphoreTake(lock, portMAX_DELAY);
         check(handle->set_string("ssid", _ssid.c_str()), "write ssid");
         check(handle->set_string("pswd", _pswd.c_str()), "write pswd");
         check(handle->set_item<uint16_t>("port", _port), "write port");
         check(handle->set_item<uint32_t>("uart", uart), "write uart pins");
         check(handle->set_item<uint16_t>("screen", screen), "write screen pins");
         check(handle->set_item<uint16_t>("ina", ina), "write INA pins");
+        check(handle->set_item<uint64_t>("suart", suart), "write soft uart pins");
+        check(handle->set_item<uint32_t>("sbaud", sbaud), "write soft uart baud");
+        check(handle->set_item<uint8_t>("abaud", abaud), "write auto baud ports");
+        check(handle->set_item<uint16_t>("aberr", aberr), "write auto baud errors");
+        check(handle->set_item<uint32_t>("sip", sip), "write static ip");
+        check(handle->set_item<uint32_t>("sgw", sgw), "write gateway");
+        check(handle->set_item<uint32_t>("smask", smask), "write netmask");
+        for (int port = 1; port < 3; port++){
+            std::string key = std::to_string(port);
+            check(handle->set_item<uint32_t>(("baud" + key).c_str(), ubaud[port]), "write uart baud");
+            check(handle->set_item<uint8_t>(("frame" + key).c_str(), uframe[port]), "write uart frame");
+        }
+        check(handle->set_item<uint16_t>("inaper", inaper), "write INA period");
+        check(handle->set_item<uint64_t>("icap", icap), "write INA capture");
+        check(handle->set_item<uint16_t>("inacfg", inacfg), "write INA config");
+        check(handle->set_item<uint64_t>("shunt", shunt), "write shunts");
+        check(handle->set_item<uint8_t>("inapwr", inapwr), "write INA annotation");
+        check(handle->set_item<uint8_t>("session", session), "write session mode");
+        check(handle->set_item<uint64_t>("rcv", rcv), "write receiver");
+        check(handle->set_item<uint64_t>("rcvses", rcvses), "write receiver session");
+        check(handle->set_item<uint64_t>("nonce", nonce), "write nonce");
+        check(handle->set_string("psk", psk.c_str()), "write psk");
+        check(handle->set_string("trig", trig.c_str()), "write triggers");
+        xSemaphoreGive(lock);
         check(handle->commit(), "write commit");
     }
 
+    // Runtime changes are written by the idle main task, not by the
+    // capture or network tasks making them
+    inline void request_save() {save_requested.store(true);}
+
+    void save_if_requested(){
+        if (save_requested.exchange(false)){
+            ESP_LOGI(TAG, "Save runtime changes");
+            save_config();
+        }
+    }
+
     std::string read_string(nvs::NVSHandle* handle, const char* name){
         std::string ret;
         size_t len = 0;
@@ -97,11 +203,63 @@ public:
     inline uint16_t screen_i2c() {return screen;}
     inline uint16_t ina_i2c() {return ina;}
     inline uint32_t get_uart() {return uart;}
+    inline uint64_t ap_bssid() {return bssid;}
+    inline uint8_t ap_channel() {return channel;}
+    inline uint64_t receiver() {return rcv;}
+    inline uint64_t receiver_session() {return rcvses;}
+    inline const std::string& control_key() {return psk;}
+    inline uint64_t control_nonce() {return nonce;}
+    inline uint32_t boot_count() {return boots;}
+    inline bool boot_counted() {return boot_stored;}
+    // START, STOP and LATENCY only signed, the stream encrypted
+    inline bool session_required() {return session != 0;}
+    inline const std::string& triggers() {return trig;}
+    // 0 - 115200
+    inline uint32_t uart_baud(int port) {return ubaud[port] ? ubaud[port] : 115200;}
+    inline uint8_t uart_frame(int port) {return uframe[port] ? uframe[port] : UART_FRAME_8N1;}
+    // 0 - 5s
+    inline uint16_t ina_period() {return inaper ? inaper : 5000;}
+    // INA3221 configuration register bits 14-3: channel enable, averaging,
+    // bus and shunt conversion time; 0 - all channels, 16 x 1.1 ms
+    inline uint16_t ina_config() {return inacfg ? inacfg & 0x7FF8 : INA_CONFIG_DEFAULT;}
+    // Shunt of channel 1..3, mOhm; 0 - 200
+    inline uint16_t ina_shunt(int channel) {
+        uint16_t v = (shunt >> ((channel - 1) * 16)) & 0xFFFF;
+        return v ? v : 200;
+    }
+    // INA channel 1..3 annotating UART records, 0 - off
+    inline uint8_t ina_annotate() {return inapwr <= 3 ? inapwr : 0;}
+    // INA capture trigger, current above mA or bus below mV; 0 - off
+    inline uint16_t ina_trigger_ma() {return icap & 0xFFFF;}
+    inline uint16_t ina_trigger_mv() {return (icap >> 16) & 0xFFFF;}
+    // 1..3
+    inline uint8_t ina_trigger_channel() {return (icap >> 32) & 0x3 ? (icap >> 32) & 0x3 : 1;}
+    // samples before and after the trigger, 0 - 128 and 384
+    inline uint16_t ina_pre() {return (icap >> 34) & 0x3FF ? (icap >> 34) & 0x3FF : 128;}
+    inline uint16_t ina_post() {return (icap >> 44) & 0x3FF ? (icap >> 44) & 0x3FF : 384;}
+    // Static address, in esp_ip4_addr_t layout; 0 - DHCP
+    inline uint32_t static_ip() {return sip;}
+    inline uint32_t static_gw() {return sgw;}
+    inline uint32_t static_mask() {return smask;}
 
     int get_uart_io(int port){
         return (int)(uart >> (port * 8)) & 0xFF;
     } 
 
+    // Software sampled channels: 8 pins of 8 bits, 0 - channel off
+    inline uint64_t get_soft_uart() {return suart;}
+    inline uint32_t soft_uart_baud() {return sbaud ? sbaud : 115200;}
+
+    // Ports detecting their rate, bit per port
+    inline uint8_t get_auto_baud() {return abaud;}
+    inline bool auto_baud(int port) {return (abaud >> port) & 1;}
+    // Framing errors within 10s which restart the detection
+    inline uint16_t auto_baud_errors() {return aberr ? aberr : 8;}
+
+    int get_soft_uart_io(int channel){
+        return (int)(suart >> (channel * 8)) & 0xFF;
+    }
+
     void set_config_wifi(std::string ssid, std::string pswd, int udp_port){
         _ssid = ssid;
         _pswd = pswd;
@@ -112,6 +270,106 @@ public:
         screen = static_cast<uint16_t>(scrp);
         ina = static_cast<uint16_t>(inap);
     }
+    void set_config_soft_uart(uint64_t pins, uint32_t baud){
+        suart = pins;
+        sbaud = baud;
+    }
+    void set_config_control_key(const std::string& key){
+        psk = key;
+    }
+    void set_config_triggers(const std::string& patterns){
+        trig = patterns;
+    }
+    void set_config_ina(uint16_t cfg, uint64_t shunts, uint16_t period){
+        inacfg = cfg;
+        shunt = shunts;
+        inaper = period;
+    }
+    void set_config_ina_annotate(uint8_t channel){
+        inapwr = channel;
+    }
+    void set_config_session(bool required){
+        session = required;
+    }
+
+    // Runtime changes, saved by save_if_requested() unless said otherwise
+    void set_uart(int port, int pin, uint32_t baud, uint8_t frame, bool auto_baud){
+        xSemaphoreTake(lock, portMAX_DELAY);
+        uart = (uart & ~(0xFFu << (port * 8))) | ((uint32_t)(pin & 0xFF) << (port * 8));
+        ubaud[port] = baud;
+        uframe[port] = frame;
+        abaud = auto_baud ? abaud | (1 << port) : abaud & ~(1 << port);
+        xSemaphoreGive(lock);
+        request_save();
+    }
+    void set_ina_period(uint16_t ms){
+        xSemaphoreTake(lock, portMAX_DELAY);
+        inaper = ms;
+        xSemaphoreGive(lock);
+        request_save();
+    }
+    void set_ina_annotate(uint8_t channel){
+        xSemaphoreTake(lock, portMAX_DELAY);
+        inapwr = channel;
+        xSemaphoreGive(lock);
+        request_save();
+    }
+    void set_ina_capture(uint16_t ma, uint16_t mv, uint8_t channel, uint16_t pre, uint16_t post){
+        xSemaphoreTake(lock, portMAX_DELAY);
+        icap = ma | (uint64_t)mv << 16 | (uint64_t)(channel & 0x3) << 32
+            | (uint64_t)(pre & 0x3FF) << 34 | (uint64_t)(post & 0x3FF) << 44;
+        xSemaphoreGive(lock);
+        request_save();
+    }
+    // Counted at once on every boot, a part of session keys: a session
+    // restored after a reset never reuses the key and IVs of the last boot
+    void count_boot(){
+        esp_err_t err;
+        std::unique_ptr<nvs::NVSHandle> handle = nvs::open_nvs_handle("config", NVS_READWRITE, &err);
+        if (err == ESP_OK){
+            handle->get_item<uint32_t>("boots", boots);
+            boots++;
+            err = handle->set_item<uint32_t>("boots", boots);
+        }
+        if (err == ESP_OK){
+            err = handle->commit();
+        }
+        boot_stored = err == ESP_OK;
+        if (!boot_stored){
+            ESP_LOGE(TAG, "Write boot count failed: %d", err);
+        }
+    }
+
+    // Written at once, before the command is acted on: after a reset a
+    // used command must stay used. False when it could not be stored.
+    bool set_control_nonce(uint64_t n){
+        xSemaphoreTake(lock, portMAX_DELAY);
+        nonce = n;
+        xSemaphoreGive(lock);
+        esp_err_t err;
+        std::unique_ptr<nvs::NVSHandle> handle = nvs::open_nvs_handle("config", NVS_READWRITE, &err);
+        if (err == ESP_OK){
+            err = handle->set_item<uint64_t>("nonce", n);
+        }
+        if (err == ESP_OK){
+            err = handle->commit();
+        }
+        if (err != ESP_OK){
+            ESP_LOGE(TAG, "Write nonce failed: %d", err);
+            return false;
+        }
+        return true;
+    }
+
+    void set_config_static_ip(uint32_t ip, uint32_t gw, uint32_t mask){
+        sip = ip;
+        sgw = gw;
+        smask = mask;
+    }
+    void set_config_auto_baud(uint8_t ports, uint16_t errors){
+        abaud = ports;
+        aberr = errors;
+    }
 
 private:
     Led _led;
@@ -121,4 +379,32 @@ private:
     uint32_t uart = 0;
     uint16_t screen = 0;
     uint16_t ina = 0;
+    uint64_t suart = 0;
+    uint32_t sbaud = 0;
+    uint8_t abaud = 0;
+    uint16_t aberr = 0;
+    uint64_t bssid = 0;
+    uint8_t channel = 0;
+    uint64_t rcv = 0;
+    uint64_t rcvses = 0;
+    uint32_t boots = 0;
+    bool boot_stored = false;
+    uint32_t sip = 0;
+    uint32_t sgw = 0;
+    uint32_t smask = 0;
+    uint32_t ubaud[3] = {0};
+    uint8_t uframe[3] = {0};
+    uint16_t inaper = 0;
+    // trigger mA 0-15, mV 16-31, channel 32-33, pre 34-43, post 44-53
+    uint64_t icap = 0;
+    uint16_t inacfg = 0;
+    // mOhm of channel 1..3 in 16 bits each
+    uint64_t shunt = 0;
+    uint8_t inapwr = 0;
+    uint8_t session = 0;
+    uint64_t nonce = 0;
+    std::string psk;
+    std::string trig = TRIGGERS_DEFAULT;
+    std::atomic<bool> save_requested{false};
+    SemaphoreHandle_t lock;
 };
\ No newline at end of file
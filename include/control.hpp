@@ -0,0 +1,92 @@
+#pragma once
+
+#include "common.h"
+#include <mbedtls/md.h>
+#include <functional>
+
+#define CONTROL_TARGETS 8
+#define CONTROL_MAC_LEN 16
+
+// Runtime control commands for tasks. Tasks register a handler per target
+// ("UART1", "INA"); the UDP task checks the command signature and calls it.
+// A handler only validates and hands the change to its task, so it is
+// cheap, and returns an error text, "" when done or PENDING when the task
+// takes it later and reports the outcome as an event.
+class Control{
+public:
+    typedef std::function<std::string(const strings& args)> Handler;
+
+    static constexpr const char* PENDING = "pending";
+
+    static void add(const std::string& target, Handler handler){
+        Registry& r = registry();
+        if (r.count.load(std::memory_order_relaxed) >= CONTROL_TARGETS){
+            ESP_LOGE("Control", "No room for %s", target.c_str());
+            return;
+        }
+        int i = r.count.load(std::memory_order_relaxed);
+        r.targets[i] = target;
+        r.handlers[i] = handler;
+        r.count.store(i + 1, std::memory_order_release);
+    }
+
+    static std::string call(const std::string& target, const strings& args){
+        Registry& r = registry();
+        int count = r.count.load(std::memory_order_acquire);
+        for (int i = 0; i < count; i++){
+            if (r.targets[i] == target){
+                return r.handlers[i](args);
+            }
+        }
+        return "UNKNOWN TARGET " + target;
+    }
+
+    // "key=value" argument, false when it is not one
+    static bool arg(const std::string& a, std::string& key, std::string& value){
+        size_t pos = a.find('=');
+        if (pos == std::string::npos) return false;
+        key = a.substr(0, pos);
+        value = a.substr(pos + 1);
+        return true;
+    }
+
+    // Hex of the first CONTROL_MAC_LEN bytes of HMAC-SHA256(key, text)
+    static std::string sign(const std::string& key, const std::string& text){
+        uint8_t mac[32];
+        mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                        (const unsigned char*)key.data(), key.length(),
+                        (const unsigned char*)text.data(), text.length(), mac);
+        static const char hex[] = "0123456789abcdef";
+        std::string ret;
+        for (int i = 0; i < CONTROL_MAC_LEN; i++){
+            ret += hex[mac[i] >> 4];
+            ret += hex[mac[i] & 0xF];
+        }
+        return ret;
+    }
+
+    // Constant time, a mismatch position must not leak through timing
+    static bool verify(const std::string& key, const std::string& text, const std::string& mac){
+        std::string want = sign(key, text);
+        if (mac.length() != want.length()) return false;
+        uint8_t diff = 0;
+        for (size_t i = 0; i < want.length(); i++){
+            diff |= want[i] ^ mac[i];
+        }
+        return diff == 0;
+    }
+
+private:
+    struct Registry{
+        std::string targets[CONTROL_TARGETS];
+        Handler handlers[CONTROL_TARGETS];
+        std::atomic<int> count{0};
+    };
+
+    // added to by the main task while the UDP task may already read it;
+    // entries are never changed once published
+    static Registry& registry(){
+        static Registry r;
+        return r;
+    }
+};
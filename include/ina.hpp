@@ -3,15 +3,38 @@
 #include "common.h"
 #include "i2c.hpp"
 #include "config.hpp"
+#include "control.hpp"
+#include "ina_capture.hpp"
+#include "power.hpp"
 #include "udp.hpp"
 #include <math.h>
 #include <iomanip>
 #include <sstream>
 
+#define INA_READ_MS 100
+#define INA_BUS_V_LSB 0.008
+// shunt voltage LSB, mV
+#define INA_SHUNT_MV_LSB 0.04
+// configuration register: continuous shunt and bus conversions
+#define INA_MODE_CONTINUOUS 0x0007
+#define INA_CHANNELS_MASK 0x7000
+
 class INA: public I2C{
+    // host benchmarks of the conversions, sim/bench.cpp
+    friend class Bench;
 public:
-    INA(Config& config, int avg=50): I2C("INA", 1), avg(avg)
+    INA(Config& config): I2C("INA", 1), config(config), period_ms(config.ina_period()),
+        cfg(config.ina_config())
     {
+        for (int i = 0; i < 3; i++){
+            enabled[i] = cfg & (0x4000 >> i);
+            shunt_ma_lsb[i] = INA_SHUNT_MV_LSB / config.ina_shunt(i + 1) * 1000;
+        }
+        round_us = conversion_us(cfg);
+        Power::init(shunt_ma_lsb, INA_BUS_V_LSB);
+        Power::set_channel(config.ina_annotate());
+        capture_settings = xQueueCreate(1, sizeof(InaCapture::Settings));
+        Control::add("INA", [this](const strings& args) { return request(args); });
         if (!config.ready()){
             return;
         }
@@ -21,38 +44,143 @@ public:
             ESP_LOGE(TAG, "INA init failed");
             return;
         }
-        uint8_t cfg[3] = {0, 0x75, 0x27};
-        write_bytes(cfg, 3);
-        ESP_LOGI(TAG, "INA inited");
+        InaCapture::Settings cs = {config.ina_trigger_ma(), config.ina_trigger_mv(), config.ina_trigger_channel(),
+            config.ina_pre(), config.ina_post()};
+        set_capture(cs);
+        ESP_LOGI(TAG, "INA inited, config 0x%04x, %d us a round", cfg | INA_MODE_CONTINUOUS, round_us);
+    }
+
+    // One round of conversions over the enabled channels
+    static uint32_t conversion_us(uint16_t cfg){
+        static const uint16_t ct[] = {140, 204, 332, 588, 1100, 2116, 4156, 8244};
+        static const uint16_t avg[] = {1, 4, 16, 64, 128, 256, 512, 1024};
+        int channels = __builtin_popcount(cfg & INA_CHANNELS_MASK);
+        return channels * avg[(cfg >> 9) & 7] * (ct[(cfg >> 6) & 7] + ct[(cfg >> 3) & 7]);
     }
 
+    // Averaged reports every period. Reads follow the chip: one per round
+    // of conversions, at least a tick apart. In capture mode it reads as
+    // fast as the bus allows, the i2c transfers are where it sleeps.
     void run(){
+        uint32_t wait_ms = std::max<uint32_t>((round_us + 999) / 1000, portTICK_PERIOD_MS);
+        int64_t next_show = 0;
+        int64_t next_report = esp_timer_get_time() + period_ms * 1000;
+        InaSample s;
+        InaCapture::Settings cs;
         while(true){
-            update();
-            if (++count >= avg){
+            if (xQueueReceive(capture_settings, &cs, 0) == pdTRUE){
+                set_capture(cs);
+            }
+            read_sample(s);
+            Power::publish(s.v);
+            int64_t now = esp_timer_get_time();
+            if (!count) first_us = now;
+            add(s);
+            if (capture.enabled()){
+                capture.add(s, now);
+            }
+            if (now >= next_show){
+                show(s);
+                next_show = now + INA_READ_MS * 1000;
+            }
+            if (now >= next_report){
                 send();
-                count = 0;
+                next_report = now + period_ms * 1000;
+            }
+            if (!capture.enabled()){
+                delay(wait_ms);
             }
-            delay(100);
         }
     }
 
 private:
+    // INA period=<ms> - the reporting period, takes effect with the next report
+    // INA annotate=0..3 - the channel added to UART records, 0 - none
+    // INA trig_ma=<mA> trig_v=<V> ch=1..3 pre=<n> post=<n> | capture=off
+    std::string request(const strings& args){
+        InaCapture::Settings cs = {config.ina_trigger_ma(), config.ina_trigger_mv(), config.ina_trigger_channel(),
+            config.ina_pre(), config.ina_post()};
+        bool capture_args = false;
+        int ms = 0;
+        std::string key, val;
+        for (auto& a : args){
+            if (!Control::arg(a, key, val)){
+                return "BAD ARG " + a;
+            }
+            int n = atoi(val.c_str());
+            if (key == "period"){
+                if (n < INA_READ_MS || n > 60000) return "BAD PERIOD";
+                ms = n;
+                continue;
+            }
+            if (key == "annotate"){
+                if (n < 0 || n > 3 || (n && !enabled[n - 1])) return "BAD CHANNEL";
+                Power::set_channel(n);
+                config.set_ina_annotate(n);
+                continue;
+            }
+            capture_args = true;
+            if (key == "trig_ma"){
+                if (n < 0 || n > 0xFFFF) return "BAD CURRENT";
+                cs.ma = n;
+            }else if (key == "trig_v"){
+                double v = atof(val.c_str());
+                if (v < 0 || v > 32) return "BAD VOLTAGE";
+                cs.mv = lround(v * 1000);
+            }else if (key == "ch"){
+                if (n < 1 || n > 3 || !enabled[n - 1]) return "BAD CHANNEL";
+                cs.channel = n;
+            }else if (key == "pre"){
+                cs.pre = n;
+            }else if (key == "post"){
+                cs.post = n;
+            }else if (key == "capture" && val == "off"){
+                cs.ma = 0;
+                cs.mv = 0;
+            }else{
+                return "UNKNOWN " + key;
+            }
+        }
+        if (cs.pre < 1 || cs.post < 1 || cs.pre + cs.post > INA_CAPTURE_MAX){
+            return "BAD SAMPLES, pre + post up to " + std::to_string(INA_CAPTURE_MAX);
+        }
+        if (ms){
+            period_ms = ms;
+            config.set_ina_period(ms);
+            UDP::event("ina period " + std::to_string(ms) + " ms");
+        }
+        if (capture_args){
+            xQueueOverwrite(capture_settings, &cs);
+            config.set_ina_capture(cs.ma, cs.mv, cs.channel, cs.pre, cs.post);
+        }
+        return "";
+    }
+
+    // Capture takes single 140 us conversions of the enabled channels
+    void set_capture(const InaCapture::Settings& cs){
+        capture.configure(cs, shunt_ma_lsb, INA_BUS_V_LSB);
+        uint16_t reg = (capture.enabled() ? cfg & INA_CHANNELS_MASK : cfg) | INA_MODE_CONTINUOUS;
+        uint8_t cfg[3] = {0, (uint8_t)(reg >> 8), (uint8_t)(reg & 0xFF)};
+        write_bytes(cfg, 3);
+        if (capture.enabled()){
+            ESP_LOGI(TAG, "Capture on ch %d above %d mA or below %d mV, %d+%d samples",
+                cs.channel, cs.ma, cs.mv, cs.pre, cs.post);
+        }
+    }
 
-    inline double conv_val(uint16_t val){
+    // Register as read, big endian, to LSBs
+    static inline int16_t conv_val(uint16_t val){
         uint16_t nval = (val & 0xFF) << 8 | (val >> 8);
         int16_t ival = reinterpret_cast<int16_t&>(nval);
-        double minus = ival < 0 ? -1.0 : 1.0;
-        if (ival < 0) ival = -ival;
-        return (ival >> 3) * minus;
+        return ival < 0 ? -(-ival >> 3) : ival >> 3;
     }
 
     inline double conv_bus(int16_t val){
-        return conv_val(val) * 0.008;
+        return val * INA_BUS_V_LSB;
     }
 
-    inline double conv_shunt(int16_t val){
-        return conv_val(val) * 0.004 * 50;
+    inline double conv_shunt(int16_t val, int channel){
+        return val * shunt_ma_lsb[channel];
     }
 
     inline std::string format(double val){
@@ -64,40 +192,64 @@ private:
         return s;
     }
 
-    void update() {
+    // Shunt and bus registers of the enabled channels, each one pointer
+    // write and read
+    void read_sample(InaSample& s) {
+        uint16_t val;
         for (uint8_t i=1; i<=6; i++){
-            write_bytes(&i, 1);
-            read_bytes((uint8_t*)&buf[i-1], 2);
+            if (!enabled[(i-1) / 2]){
+                s.v[i-1] = 0;
+                continue;
+            }
+            read_bytes((uint8_t*)&val, 2, &i, 1);
+            s.v[i-1] = conv_val(val);
         }
+    }
+
+    void add(const InaSample& s) {
+        for (int i=0; i<3; i++){
+            shunt_ma[i] += conv_shunt(s.v[i * 2], i);
+            bus_v[i] += conv_bus(s.v[i * 2 + 1]);
+        }
+        count++;
+    }
+
+    void show(const InaSample& s) {
         for (int i=0; i<3; i++){
-            double shunt = conv_shunt(buf[i * 2]);
-            double bus = conv_bus(buf[i * 2 + 1]); 
-            shunt_ma[i] += shunt;
-            bus_v[i] += bus;
-            Screen::update_label(i*2, format(bus) + "V");
-            Screen::update_label(i*2+1, format(shunt) + "mA");
+            if (!enabled[i]) continue;
+            Screen::update_label(i*2, format(conv_bus(s.v[i * 2 + 1])) + "V");
+            Screen::update_label(i*2+1, format(conv_shunt(s.v[i * 2], i)) + "mA");
         }
     }
 
     void send() {
+        if (!count) return;
         std::stringstream ss;
-        ss << "INA:";
         for (int i=0; i<3; i++){
             shunt_ma[i] /= count;
             bus_v[i] /= count;
-            ss << " " << std::fixed << std::setprecision(6) << bus_v[i] << " " << shunt_ma[i];
+            ss << (i ? " " : "") << std::fixed << std::setprecision(6) << bus_v[i] << " " << shunt_ma[i];
             shunt_ma[i] = .0;
             bus_v[i] = .0;
         }
-        ESP_LOGI(TAG, "%s", ss.str().c_str());
-        UDP::send(ss.str() + "\n");
+        ESP_LOGI(TAG, "INA: %s", ss.str().c_str());
+        // stamped with the first sample of the average
+        UDP::send(Messages::LANE_INA, ss.str() + "\n", first_us);
+        count = 0;
     }
 
 private:
-    int avg;
-    uint8_t reg = 0;
-    uint16_t buf[6];
+    Config& config;
+    std::atomic<int> period_ms;
+    // configuration register without the mode bits
+    uint16_t cfg;
+    bool enabled[3];
+    double shunt_ma_lsb[3];
+    uint32_t round_us;
+    InaCapture capture;
+    QueueHandle_t capture_settings;
     double shunt_ma[3] = {.0};
     double bus_v[3] = {.0};
     int count = 0;
+    int64_t first_us = 0;
 };
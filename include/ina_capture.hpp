@@ -0,0 +1,188 @@
+#pragma once
+
+#include "common.h"
+#include "udp.hpp"
+#include <math.h>
+#include <vector>
+
+// pre + post samples, 12 bytes each
+#define INA_CAPTURE_MAX 512
+#define INA_CAPTURE_VERSION 2
+
+// One INA3221 conversion round in LSBs: shunt and bus of channel 1..3
+struct InaSample{
+    int16_t v[6];
+};
+
+// Triggered waveform capture. Raw samples go round a ring until the
+// trigger channel crosses a threshold, then the post-trigger samples are
+// taken and the ring is sent as one binary block, split into "CAP"
+// records of
+//   uint16 seq, uint16 index, uint16 count, block bytes...
+// The block is a Header followed by pre + post InaSample, little endian.
+class InaCapture: public Base{
+public:
+    enum Reason {
+        NONE = 0,
+        CURRENT,        // shunt current above the limit
+        VOLTAGE         // bus voltage below the limit
+    };
+
+    struct Settings{
+        uint16_t ma;        // 0 - off
+        uint16_t mv;        // 0 - off
+        uint8_t channel;    // 1..3
+        uint16_t pre;
+        uint16_t post;
+    };
+
+    struct __attribute__((packed)) Header{
+        uint8_t version;
+        uint8_t channels;
+        uint8_t reason;
+        uint8_t channel;
+        uint16_t pre;
+        uint16_t post;
+        uint32_t period_us; // mean sample period
+        uint32_t trigger_ms;
+        float shunt_ma_lsb[3];
+        float bus_v_lsb;
+    };
+
+    struct __attribute__((packed)) ChunkHeader{
+        uint16_t seq;
+        uint16_t index;
+        uint16_t count;
+    };
+
+    InaCapture(): Base("InaCapture") {}
+
+    // LSBs in mA of every channel and V
+    void configure(const Settings& s, const double* shunt_lsb, double bus_lsb){
+        settings = s;
+        for (int i = 0; i < 3; i++){
+            shunt_ma_lsb[i] = shunt_lsb[i];
+        }
+        bus_v_lsb = bus_lsb;
+        size_t size = enabled() ? s.pre + s.post : 0;
+        ring.assign(size, InaSample());
+        times.assign(size, 0);
+        limit_shunt = lround(s.ma / shunt_ma_lsb[s.channel - 1]);
+        limit_bus = lround(s.mv / 1000.0 / bus_v_lsb);
+        head = 0;
+        filled = 0;
+        remaining = 0;
+        // a level already past the limit does not trigger
+        active = true;
+    }
+
+    inline bool enabled() const {return settings.ma || settings.mv;}
+
+    void add(const InaSample& s, int64_t now_us){
+        size_t size = ring.size();
+        ring[head] = s;
+        times[head] = (uint32_t)now_us;
+        head = (head + 1) % size;
+        if (filled < size) filled++;
+        if (remaining){
+            if (--remaining == 0) send_block();
+            return;
+        }
+        Reason r = check(s);
+        if (r != NONE && !active){
+            reason = r;
+            trigger_us = now_us;
+            // the trigger sample is the first post-trigger one
+            remaining = settings.post - 1;
+            if (!remaining) send_block();
+        }
+        active = r != NONE;
+    }
+
+private:
+    Reason check(const InaSample& s){
+        int ch = settings.channel - 1;
+        if (settings.ma && s.v[ch * 2] > limit_shunt) return CURRENT;
+        if (settings.mv && s.v[ch * 2 + 1] < limit_bus) return VOLTAGE;
+        return NONE;
+    }
+
+    // Block bytes from off, the ring read oldest first
+    void copy_block(uint8_t* out, size_t off, size_t len, const Header& hdr, size_t first){
+        while (len){
+            size_t n;
+            if (off < sizeof(Header)){
+                n = std::min(len, sizeof(Header) - off);
+                memcpy(out, (const uint8_t*)&hdr + off, n);
+            }else{
+                size_t i = (off - sizeof(Header)) / sizeof(InaSample);
+                size_t b = (off - sizeof(Header)) % sizeof(InaSample);
+                n = std::min(len, sizeof(InaSample) - b);
+                memcpy(out, (const uint8_t*)&ring[(first + i) % ring.size()] + b, n);
+            }
+            out += n;
+            off += n;
+            len -= n;
+        }
+    }
+
+    void send_block(){
+        size_t n = filled;
+        size_t first = (head + ring.size() - n) % ring.size();
+        size_t last = (head + ring.size() - 1) % ring.size();
+        Header hdr;
+        hdr.version = INA_CAPTURE_VERSION;
+        hdr.channels = 3;
+        hdr.reason = reason;
+        hdr.channel = settings.channel;
+        hdr.pre = n - settings.post;
+        hdr.post = settings.post;
+        hdr.period_us = n > 1 ? (uint32_t)(times[last] - times[first]) / (n - 1) : 0;
+        hdr.trigger_ms = trigger_us / 1000;
+        for (int i = 0; i < 3; i++){
+            hdr.shunt_ma_lsb[i] = shunt_ma_lsb[i];
+        }
+        hdr.bus_v_lsb = bus_v_lsb;
+
+        Pool& pool = UDP::pool();
+        size_t total = sizeof(Header) + n * sizeof(InaSample);
+        size_t room = pool[0].capacity() - sizeof(ChunkHeader);
+        ChunkHeader chunk = {seq, 0, (uint16_t)((total + room - 1) / room)};
+        for (size_t off = 0; off < total; off += room, chunk.index++){
+            uint16_t h = pool.alloc();
+            if (h == Pool::NONE){
+                ESP_LOGE(TAG, "No free buffers");
+                Stats::add(Stats::MSG_DROPPED);
+                break;
+            }
+            Buffer& b = pool[h];
+            size_t len = std::min(room, total - off);
+            memcpy(b.payload(), &chunk, sizeof(chunk));
+            copy_block(b.payload() + sizeof(chunk), off, len, hdr, first);
+            b.len = sizeof(chunk) + len;
+            b.rx_us = trigger_us;
+            UDP::send(Messages::LANE_CAPTURE, h);
+        }
+        UDP::event("ina capture " + std::to_string(seq) + ": " + (reason == CURRENT ? "current" : "voltage")
+            + " ch " + std::to_string(settings.channel) + ", " + std::to_string(hdr.pre) + "+"
+            + std::to_string(hdr.post) + " samples every " + std::to_string(hdr.period_us) + " us");
+        seq++;
+        filled = 0;
+    }
+
+private:
+    double shunt_ma_lsb[3] = {};
+    double bus_v_lsb = 0;
+    Settings settings = {};
+    std::vector<InaSample> ring;
+    std::vector<uint32_t> times;
+    long limit_shunt = 0;
+    long limit_bus = 0;
+    size_t head = 0;
+    size_t filled = 0;
+    size_t remaining = 0;
+    bool active = true;
+    Reason reason = NONE;
+    int64_t trigger_us = 0;
+    uint16_t seq = 0;
+};
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "common.h"
+#include <esp_timer.h>
+
+// Log-linear histogram of microseconds: every power of two is split into
+// 4 buckets, so a reported percentile is within 25% of the real value.
+class Histogram{
+public:
+    static const int SUB_BITS = 2;
+    static const int BUCKETS = 32 << SUB_BITS;
+
+    void add(uint32_t us){
+        buckets[index(us)].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        uint32_t cur = max.load(std::memory_order_relaxed);
+        while (us > cur && !max.compare_exchange_weak(cur, us, std::memory_order_relaxed));
+    }
+
+    // Upper bound of the bucket holding the given permille of samples
+    uint32_t percentile(uint32_t permille){
+        uint32_t total = count.load(std::memory_order_relaxed);
+        if (!total) return 0;
+        uint64_t want = ((uint64_t)total * permille + 999) / 1000;
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++){
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen >= want){
+                uint32_t top = upper(i);
+                uint32_t m = max.load(std::memory_order_relaxed);
+                return top < m ? top : m;
+            }
+        }
+        return max.load(std::memory_order_relaxed);
+    }
+
+    std::string summary(){
+        return "n=" + std::to_string(count.load(std::memory_order_relaxed))
+            + " p50=" + std::to_string(percentile(500))
+            + " p99=" + std::to_string(percentile(990))
+            + " max=" + std::to_string(max.load(std::memory_order_relaxed));
+    }
+
+    void reset(){
+        for (auto& b: buckets) b.store(0, std::memory_order_relaxed);
+        count.store(0, std::memory_order_relaxed);
+        max.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    static int index(uint32_t us){
+        if (us < (1u << SUB_BITS)) return us;
+        int msb = 31 - __builtin_clz(us);
+        return ((msb - SUB_BITS + 1) << SUB_BITS) + ((us >> (msb - SUB_BITS)) & ((1 << SUB_BITS) - 1));
+    }
+
+    static uint32_t upper(int i){
+        if (i < (1 << SUB_BITS)) return i;
+        int msb = (i >> SUB_BITS) + SUB_BITS - 1;
+        uint32_t lower = (1u << msb) | ((uint32_t)(i & ((1 << SUB_BITS) - 1)) << (msb - SUB_BITS));
+        return lower + ((1u << (msb - SUB_BITS)) - 1);
+    }
+
+    std::atomic<uint32_t> buckets[BUCKETS] = {};
+    std::atomic<uint32_t> count{0};
+    std::atomic<uint32_t> max{0};
+};
+
+// Time a record spends on the device: UART read -> Messages queue -> sendto
+class Latency{
+public:
+    enum Stage {
+        RX_ENQUEUE,
+        ENQUEUE_SEND,
+        RX_SEND,
+        STAGES
+    };
+
+    static void add(Stage stage, int64_t from_us, int64_t to_us){
+        if (!from_us || to_us < from_us) return;
+        int64_t d = to_us - from_us;
+        stages[stage].add(d > UINT32_MAX ? UINT32_MAX : (uint32_t)d);
+    }
+
+    // Record left through sendto now; rx_us is 0 for records without a capture time
+    static void sent(int64_t rx_us, int64_t enqueue_us){
+        int64_t now = esp_timer_get_time();
+        add(ENQUEUE_SEND, enqueue_us, now);
+        add(RX_SEND, rx_us, now);
+    }
+
+    static std::string snapshot(){
+        static const char* names[] = {"rx_enq", "enq_send", "rx_send"};
+        std::string ret;
+        for (int i = 0; i < STAGES; i++){
+            if (i) ret += " ";
+            ret += std::string(names[i]) + " " + stages[i].summary();
+        }
+        return ret;
+    }
+
+    static void reset(){
+        for (auto& h: stages) h.reset();
+    }
+
+private:
+    static Histogram stages[STAGES];
+};
@@ -1,54 +1,266 @@
 #pragma once
 
 #include "common.h"
+#include "pool.hpp"
+#include "stats.hpp"
+#include "latency.hpp"
 #include <esp_event.h>
 
 
-#define QSIZE 100
-
 class Messages:public Base{
 public:
-    Messages(): Base("Messages"){
-        queue = xQueueCreate(QSIZE, sizeof(int));
-        for (int i=0; i < QSIZE; i++){
-            mutexes[i] = xSemaphoreCreateMutex();
-            if (!mutexes[i]) {
-                ESP_LOGE(TAG, "Mutex for message %d not created!!!", i);
-            }
+    // One lane per source, every lane has its own queue
+    enum Lane {
+        LANE_EVENTS = 0,
+        LANE_TRIGGERS,  // pattern matches on the capture channels
+        LANE_INA,
+        LANE_CAPTURE,   // binary INA capture blocks
+        LANE_UART1,
+        LANE_UART2,
+        LANE_SOFT0,     // software sampled channels, LANE_SOFT0 + 0..7
+        LANES = LANE_SOFT0 + STATS_SOFT_UARTS
+    };
+
+    enum DropPolicy {
+        DROP_NEWEST = 0,
+        DROP_OLDEST,
+        SUMMARISE       // drop newest, count it into a summary record sent
+                        // ahead of the lane's next record
+    };
+
+    struct LaneConfig{
+        const char* source;
+        uint8_t priority;   // records taken per sender round, 0 - lane off
+        uint8_t depth;      // queue length
+        DropPolicy policy;
+        uint32_t rate;      // bytes/s, 0 - unlimited
+        uint32_t burst;     // bytes
+    };
+
+    Messages(): Base("Messages"), pool(pool_size()){
+        for (int i = 0; i < LANES; i++){
+            LaneState& l = lanes[i];
+            l.cfg = default_config(static_cast<Lane>(i));
+            l.queue = xQueueCreate(l.cfg.depth, sizeof(uint16_t));
+            l.tokens = l.cfg.burst;
         }
+        credit = settings(lanes[0]).priority;
+    }
+
+    inline Pool& buffers() {return pool;}
+
+    static inline Lane uart_lane(int port){
+        return static_cast<Lane>(LANE_UART1 + port - 1);
+    }
+
+    static inline Lane soft_lane(int channel){
+        return static_cast<Lane>(LANE_SOFT0 + channel);
     }
 
-    void add_message(const std::string& str){
-        int id = currentMessage++;
-        xSemaphoreTake(mutexes[id], portMAX_DELAY);
-        msgs[id] = str;
-        xSemaphoreGive(mutexes[id]);
-        if (xQueueSendToBack(queue, &id, ( TickType_t ) 100) != pdTRUE){
-            ESP_LOGE(TAG, "Send queue full");
+    inline const char* source(Lane lane) {return lanes[lane].cfg.source;}
+
+    // Priority, policy and rate can be changed at any time, depth is fixed.
+    // Producers and the sender work on a copy taken under the lane lock.
+    void configure(Lane lane, const LaneConfig& cfg){
+        LaneState& l = lanes[lane];
+        portENTER_CRITICAL(&l.lock);
+        l.cfg.priority = cfg.priority;
+        l.cfg.policy = cfg.policy;
+        l.cfg.rate = cfg.rate;
+        l.cfg.burst = cfg.burst;
+        portEXIT_CRITICAL(&l.lock);
+    }
+
+    // "<source> <device ms>: " record header, in the buffer headroom, or
+    // "<source> <device ms> <V>V <mA>mA: " with the target power
+    static void stamp(Buffer& b, const char* source){
+        char hdr[POOL_HEADROOM];
+        int64_t ts = b.rx_us ? b.rx_us : esp_timer_get_time();
+        int len = b.power
+            ? snprintf(hdr, sizeof(hdr), "%s %lld %.3fV %.1fmA: ", source, (long long)(ts / 1000), b.power_v, b.power_ma)
+            : snprintf(hdr, sizeof(hdr), "%s %lld: ", source, (long long)(ts / 1000));
+        b.prepend(hdr, std::min(len, (int)sizeof(hdr) - 1));
+    }
+
+    // Takes over the reference to the buffer. Never blocks: a record over
+    // the lane rate or not fitting the queue is handled by the drop policy,
+    // except that a record over the rate is always the one dropped.
+    void add_message(Lane lane, uint16_t h){
+        LaneState& l = lanes[lane];
+        LaneConfig cfg = settings(l);
+        Buffer& b = pool[h];
+        if (!take_tokens(l, cfg, b.len)){
+            drop(l, cfg, h);
+            return;
         }
-        if (currentMessage >= QSIZE){
-            currentMessage = 0;
+        b.enqueue_us = esp_timer_get_time();
+        if (xQueueSendToBack(l.queue, &h, 0) != pdTRUE){
+            uint16_t old;
+            if (cfg.policy != DROP_OLDEST || xQueueReceive(l.queue, &old, 0) != pdTRUE){
+                drop(l, cfg, h);
+                return;
+            }
+            drop(l, cfg, old);
+            if (xQueueSendToBack(l.queue, &h, 0) != pdTRUE){
+                drop(l, cfg, h);
+                return;
+            }
         }
+        l.enqueued++;
+        Stats::add(Stats::MSG_ENQUEUED);
+        Stats::high_water(Stats::MSG_QUEUE_HW, uxQueueMessagesWaiting(l.queue));
+        Latency::add(Latency::RX_ENQUEUE, b.rx_us, esp_timer_get_time());
     }
 
-    bool get_message(std::string& message){
-        int id;
-        if (xQueueReceive(queue, &id, 0) != pdTRUE) return false;
-        xSemaphoreTake(mutexes[id], portMAX_DELAY);
-        message = msgs[id];
-        xSemaphoreGive(mutexes[id]);
-        return true;
+    // Copying path for low rate text sources, rx_us is when the data was
+    // captured, 0 for the time of the call
+    void add_message(Lane lane, const std::string& str, int64_t rx_us = 0){
+        uint16_t h = pool.alloc();
+        if (h == Pool::NONE){
+            ESP_LOGE(TAG, "No free buffers");
+            lanes[lane].dropped++;
+            Stats::add(Stats::MSG_DROPPED);
+            return;
+        }
+        Buffer& b = pool[h];
+        b.len = std::min(str.length(), b.capacity());
+        memcpy(b.payload(), str.data(), b.len);
+        b.rx_us = rx_us;
+        stamp(b, lanes[lane].cfg.source);
+        add_message(lane, h);
+    }
+
+    // Weighted round robin over the lanes. The caller releases the buffer.
+    bool get_message(uint16_t& h){
+        for (int i = 0; i <= LANES; i++){
+            LaneState& l = lanes[current];
+            if (credit > 0 && (get_summary(l, h) || xQueueReceive(l.queue, &h, 0) == pdTRUE)){
+                credit--;
+                return true;
+            }
+            current = (current + 1) % LANES;
+            credit = settings(lanes[current]).priority;
+        }
+        return false;
     }
 
+    // Drops everything queued, counted as drops of the lanes
     void clear(){
-        int id;
-        while(xQueueReceive(queue, &id, 0) == pdTRUE);
+        uint16_t h;
+        for (auto& l: lanes){
+            while(xQueueReceive(l.queue, &h, 0) == pdTRUE){
+                l.dropped++;
+                Stats::add(Stats::MSG_DROPPED);
+                pool.release(h);
+            }
+        }
+    }
+
+    // " lane.<source>=enqueued/dropped/waiting ..." for UUL STATS
+    std::string snapshot(){
+        std::string ret;
+        for (int i = 0; i < LANES; i++){
+            LaneState& l = lanes[i];
+            if (i >= LANE_SOFT0 && !l.enqueued.load() && !l.dropped.load()) continue;
+            ret += std::string(" lane.") + l.cfg.source + "=" + std::to_string(l.enqueued.load())
+                + "/" + std::to_string(l.dropped.load())
+                + "/" + std::to_string(uxQueueMessagesWaiting(l.queue));
+        }
+        return ret;
+    }
+
+private:
+    struct LaneState{
+        LaneConfig cfg;
+        portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+        QueueHandle_t queue;
+        // token bucket under lock, LANE_EVENTS has several producers
+        uint32_t tokens;
+        int64_t refill_us = 0;
+        std::atomic<uint32_t> enqueued{0};
+        std::atomic<uint32_t> dropped{0};
+        std::atomic<uint32_t> summary_records{0};
+        std::atomic<uint32_t> summary_bytes{0};
+    };
+
+    static LaneConfig default_config(Lane lane){
+        switch (lane){
+        case LANE_EVENTS:
+            return {"EVT", 4, 8, DROP_OLDEST, 0, 0};
+        case LANE_TRIGGERS:
+            return {"TRG", 8, 8, DROP_OLDEST, 0, 0};
+        case LANE_INA:
+            return {"INA", 4, 8, DROP_OLDEST, 0, 0};
+        case LANE_CAPTURE:
+            return {"CAP", 2, 16, DROP_NEWEST, 0, 0};
+        case LANE_UART1:
+            return {"1", 2, 40, SUMMARISE, 0, 0};
+        case LANE_UART2:
+            return {"2", 2, 40, SUMMARISE, 0, 0};
+        default:
+            static const char* soft[] = {"S0", "S1", "S2", "S3", "S4", "S5", "S6", "S7"};
+            return {soft[lane - LANE_SOFT0], 1, 4, SUMMARISE, 0, 0};
+        }
     }
 
+    // Every queued record owns a buffer, plus one being filled per lane,
+    // up to POOL_MAX: soft channels are rarely all busy at once
+    static uint16_t pool_size(){
+        uint16_t ret = 0;
+        for (int i = 0; i < LANES; i++){
+            ret += default_config(static_cast<Lane>(i)).depth + 1;
+        }
+        return std::min<uint16_t>(ret, POOL_MAX);
+    }
+
+    static LaneConfig settings(LaneState& l){
+        portENTER_CRITICAL(&l.lock);
+        LaneConfig ret = l.cfg;
+        portEXIT_CRITICAL(&l.lock);
+        return ret;
+    }
+
+    bool take_tokens(LaneState& l, const LaneConfig& cfg, uint32_t len){
+        if (!cfg.rate) return true;
+        int64_t now = esp_timer_get_time();
+        portENTER_CRITICAL(&l.lock);
+        // another producer may have refilled after this one read the time
+        uint64_t add = now > l.refill_us ? (uint64_t)(now - l.refill_us) * cfg.rate / 1000000 : 0;
+        if (add){
+            l.tokens = std::min<uint64_t>(cfg.burst, l.tokens + add);
+            l.refill_us = now;
+        }
+        bool ok = l.tokens >= len;
+        if (ok) l.tokens -= len;
+        portEXIT_CRITICAL(&l.lock);
+        return ok;
+    }
+
+    void drop(LaneState& l, const LaneConfig& cfg, uint16_t h){
+        if (cfg.policy == SUMMARISE){
+            l.summary_records++;
+            l.summary_bytes += pool[h].len;
+        }
+        l.dropped++;
+        Stats::add(Stats::MSG_DROPPED);
+        pool.release(h);
+    }
+
+    bool get_summary(LaneState& l, uint16_t& h){
+        if (!l.summary_records.load()) return false;
+        h = pool.alloc();
+        if (h == Pool::NONE) return false;
+        uint32_t records = l.summary_records.exchange(0);
+        uint32_t bytes = l.summary_bytes.exchange(0);
+        Buffer& b = pool[h];
+        b.len = snprintf((char*)b.payload(), b.capacity(), "[dropped %u records, %u bytes]\n", records, bytes);
+        stamp(b, l.cfg.source);
+        return true;
+    }
 
 private:
-    int currentMessage = 0;
-    std::string msgs[QSIZE];
-    QueueHandle_t queue;
-    SemaphoreHandle_t mutexes[QSIZE];
-};
\ No newline at end of file
+    Pool pool;
+    LaneState lanes[LANES];
+    int current = 0;
+    int credit = 0;
+};
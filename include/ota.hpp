@@ -0,0 +1,244 @@
+#pragma once
+
+#include "common.h"
+#include <esp_ota_ops.h>
+#include <esp_timer.h>
+#include <mbedtls/sha256.h>
+#include <algorithm>
+
+// Data datagram: "UUL OTAD", chunk number (u32 LE), OTA_CHUNK bytes of the
+// image, the last chunk is shorter
+#define OTA_DATA_PREFIX "UUL OTAD"
+#define OTA_DATA_HEADER 12
+#define OTA_CHUNK 1024
+// chunks per flash write, the window holds two batches: one is written
+// while the next one arrives
+#define OTA_BATCH 16
+#define OTA_WINDOW (OTA_BATCH * 2)
+#define OTA_ACK_EVERY 8
+#define OTA_TIMEOUT_US 10000000
+#define OTA_RESTART_DELAY_US 1000000
+
+// Image receiver for an update over the control port. Chunks come in any
+// order within a window of OTA_WINDOW chunks; each completed batch is
+// written to the inactive app partition with one flash write and hashed.
+// Acks are "UUL OTA ACK <next> <limit> <bitmap>": the first missing chunk,
+// the end of the window and, as hex, which chunks after the first missing
+// one are already here. The image is checked against the SHA-256 given at
+// the start and booted on success.
+class Ota: public Base{
+public:
+    enum State{
+        IDLE,
+        RECEIVING,
+        DONE,
+        FAILED,
+    };
+
+    Ota(): Base("OTA"){}
+
+    ~Ota(){
+        abort();
+    }
+
+    // Nothing is erased up front, which takes seconds for a whole slot:
+    // each write erases the sectors it reaches
+    std::string begin(uint32_t size, const std::string& sha_hex){
+        abort();
+        if (!parse_hash(sha_hex)) return "USAGE";
+        part = esp_ota_get_next_update_partition(nullptr);
+        if (!part) return "NO PARTITION";
+        if (size == 0 || size > part->size) return "SIZE";
+        buf = (uint8_t*)malloc(OTA_WINDOW * OTA_CHUNK);
+        if (!buf) return "NO MEMORY";
+        esp_err_t err = esp_ota_begin(part, OTA_WITH_SEQUENTIAL_WRITES, &handle);
+        if (err != ESP_OK){
+            ESP_LOGE(TAG, "OTA begin failed: %d", err);
+            release();
+            return "BEGIN " + std::to_string(err);
+        }
+        mbedtls_sha256_init(&sha);
+        mbedtls_sha256_starts_ret(&sha, 0);
+        total = size;
+        chunks = (size + OTA_CHUNK - 1) / OTA_CHUNK;
+        base = 0;
+        got = 0;
+        since_ack = 0;
+        last_us = esp_timer_get_time();
+        state = RECEIVING;
+        ESP_LOGI(TAG, "Receiving %u bytes to %s", size, part->label);
+        return "";
+    }
+
+    // True when an ack is due
+    bool chunk(uint32_t seq, const uint8_t* data, size_t len){
+        if (state != RECEIVING) return true;
+        last_us = esp_timer_get_time();
+        // behind the window it is a retransmit of a lost ack's chunks,
+        // ahead of it the sender has not seen the last one yet
+        if (seq < base || seq >= limit()) return true;
+        uint32_t bit = 1u << (seq % OTA_WINDOW);
+        if (got & bit) return true;
+        if (len != chunk_len(seq)) return true;
+        memcpy(buf + (seq % OTA_WINDOW) * OTA_CHUNK, data, len);
+        got |= bit;
+        bool wrote = false;
+        while (state == RECEIVING && batch_complete()){
+            write_batch();
+            wrote = true;
+        }
+        if (wrote || ++since_ack >= OTA_ACK_EVERY || state != RECEIVING){
+            since_ack = 0;
+            return true;
+        }
+        return false;
+    }
+
+    std::string status(){
+        switch (state){
+        case RECEIVING:{
+            uint32_t next = base;
+            while (next < limit() && (got & (1u << (next % OTA_WINDOW)))) next++;
+            uint32_t ahead = 0;
+            for (uint32_t s = next; s < limit(); s++){
+                if (got & (1u << (s % OTA_WINDOW))) ahead |= 1u << (s - next);
+            }
+            char hex[9];
+            snprintf(hex, sizeof(hex), "%x", ahead);
+            return "UUL OTA ACK " + std::to_string(next) + " " + std::to_string(limit()) + " " + hex;
+        }
+        case DONE:
+            return "UUL OTA DONE";
+        case FAILED:
+            return "UUL OTA ERR " + error;
+        default:
+            return "UUL OTA IDLE";
+        }
+    }
+
+    inline bool active(){
+        return state == RECEIVING;
+    }
+
+    void abort(){
+        if (state != RECEIVING) return;
+        esp_ota_abort(handle);
+        fail("ABORTED");
+    }
+
+    // Every loop: a stalled transfer is dropped, a finished one restarts
+    // into the new image once the last ack had time to go out
+    void poll(){
+        int64_t now = esp_timer_get_time();
+        if (state == RECEIVING && now - last_us > OTA_TIMEOUT_US){
+            esp_ota_abort(handle);
+            fail("TIMEOUT");
+        }else if (state == DONE && now >= restart_us){
+            ESP_LOGI(TAG, "Restarting into the new image");
+            esp_restart();
+        }
+    }
+
+private:
+    inline uint32_t limit(){
+        return std::min(base + OTA_WINDOW, chunks);
+    }
+
+    inline size_t chunk_len(uint32_t seq){
+        return seq + 1 < chunks ? OTA_CHUNK : total - seq * OTA_CHUNK;
+    }
+
+    bool batch_complete(){
+        uint32_t end = std::min(base + OTA_BATCH, chunks);
+        for (uint32_t s = base; s < end; s++){
+            if (!(got & (1u << (s % OTA_WINDOW)))) return false;
+        }
+        return true;
+    }
+
+    void write_batch(){
+        uint32_t end = std::min(base + OTA_BATCH, chunks);
+        const uint8_t* p = buf + (base % OTA_WINDOW) * OTA_CHUNK;
+        size_t len = (end - base - 1) * OTA_CHUNK + chunk_len(end - 1);
+        esp_err_t err = esp_ota_write(handle, p, len);
+        if (err != ESP_OK){
+            ESP_LOGE(TAG, "OTA write at %u failed: %d", base * OTA_CHUNK, err);
+            esp_ota_abort(handle);
+            fail("WRITE " + std::to_string(err));
+            return;
+        }
+        mbedtls_sha256_update_ret(&sha, p, len);
+        for (uint32_t s = base; s < end; s++){
+            got &= ~(1u << (s % OTA_WINDOW));
+        }
+        base = end;
+        if (base == chunks) finish();
+    }
+
+    void finish(){
+        uint8_t hash[32];
+        mbedtls_sha256_finish_ret(&sha, hash);
+        if (memcmp(hash, want, sizeof(hash)) != 0){
+            esp_ota_abort(handle);
+            fail("HASH");
+            return;
+        }
+        esp_err_t err = esp_ota_end(handle);
+        if (err == ESP_OK){
+            err = esp_ota_set_boot_partition(part);
+        }
+        if (err != ESP_OK){
+            ESP_LOGE(TAG, "OTA image rejected: %d", err);
+            fail("IMAGE " + std::to_string(err));
+            return;
+        }
+        ESP_LOGI(TAG, "Image of %u bytes verified, boot partition %s", total, part->label);
+        release();
+        restart_us = esp_timer_get_time() + OTA_RESTART_DELAY_US;
+        state = DONE;
+    }
+
+    void fail(const std::string& why){
+        ESP_LOGE(TAG, "OTA failed: %s", why.c_str());
+        release();
+        error = why;
+        state = FAILED;
+    }
+
+    void release(){
+        if (state == RECEIVING){
+            mbedtls_sha256_free(&sha);
+        }
+        free(buf);
+        buf = nullptr;
+    }
+
+    bool parse_hash(const std::string& hex){
+        if (hex.length() != 64) return false;
+        for (int i = 0; i < 32; i++){
+            char* end;
+            std::string byte = hex.substr(i * 2, 2);
+            want[i] = (uint8_t)strtoul(byte.c_str(), &end, 16);
+            if (*end) return false;
+        }
+        return true;
+    }
+
+private:
+    State state = IDLE;
+    std::string error;
+    const esp_partition_t* part = nullptr;
+    esp_ota_handle_t handle = 0;
+    mbedtls_sha256_context sha;
+    uint8_t want[32];
+    uint8_t* buf = nullptr;
+    uint32_t total = 0;
+    uint32_t chunks = 0;
+    // first chunk of the batch being collected, a multiple of OTA_BATCH
+    uint32_t base = 0;
+    // received chunks of the window by chunk % OTA_WINDOW
+    uint32_t got = 0;
+    int since_ack = 0;
+    int64_t last_us = 0;
+    int64_t restart_us = 0;
+};
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "common.h"
+#include <freertos/queue.h>
+#include <string.h>
+
+#define POOL_BUF_SIZE 560
+#define POOL_HEADROOM 48
+#define POOL_MAX 128
+
+// Record buffer. Payload is written at data + POOL_HEADROOM, the record
+// header is prepended into the headroom, so the datagram is one block.
+struct Buffer{
+    uint8_t data[POOL_BUF_SIZE];
+    uint16_t start;
+    uint16_t len;
+    int64_t rx_us;
+    int64_t enqueue_us;
+    // target power at rx_us, see Power
+    bool power;
+    float power_v;
+    float power_ma;
+    std::atomic<uint8_t> refs;
+
+    inline uint8_t* payload() {return data + POOL_HEADROOM;}
+    inline size_t capacity() {return POOL_BUF_SIZE - POOL_HEADROOM;}
+    inline const uint8_t* begin() {return data + start;}
+
+    bool prepend(const char* hdr, size_t hlen){
+        if (hlen > start) return false;
+        start -= hlen;
+        len += hlen;
+        memcpy(data + start, hdr, hlen);
+        return true;
+    }
+};
+
+// Fixed slab of buffers allocated once at startup. Buffers are passed
+// around by handle and go back to the free list when the last reference
+// is released.
+class Pool: public Base{
+public:
+    static const uint16_t NONE = 0xFFFF;
+
+    Pool(uint16_t count): Base("Pool"), count(count){
+        buffers = new Buffer[count];
+        free_list = xQueueCreate(count, sizeof(uint16_t));
+        for (uint16_t h = 0; h < count; h++){
+            xQueueSendToBack(free_list, &h, 0);
+        }
+        ESP_LOGI(TAG, "%d buffers of %d bytes", count, POOL_BUF_SIZE);
+    }
+
+    // Never blocks, NONE when the pool is exhausted
+    uint16_t alloc(){
+        uint16_t h;
+        if (xQueueReceive(free_list, &h, 0) != pdTRUE) return NONE;
+        Buffer& b = buffers[h];
+        b.start = POOL_HEADROOM;
+        b.len = 0;
+        b.rx_us = 0;
+        b.enqueue_us = 0;
+        b.power = false;
+        b.refs.store(1);
+        return h;
+    }
+
+    inline void ref(uint16_t h){
+        buffers[h].refs.fetch_add(1);
+    }
+
+    void release(uint16_t h){
+        if (buffers[h].refs.fetch_sub(1) == 1){
+            xQueueSendToBack(free_list, &h, 0);
+        }
+    }
+
+    inline Buffer& operator[](uint16_t h) {return buffers[h];}
+    inline uint16_t size() {return count;}
+    inline uint16_t available() {return uxQueueMessagesWaiting(free_list);}
+
+private:
+    uint16_t count;
+    Buffer* buffers;
+    QueueHandle_t free_list;
+};
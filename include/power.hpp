@@ -0,0 +1,53 @@
+#pragma once
+
+#include "common.h"
+#include "pool.hpp"
+
+// Latest INA reading of every channel, for annotating UART records with
+// the power of the target. The INA task is the only writer; a channel is
+// one 32-bit word, shunt and bus LSBs, so the capture tasks read a
+// consistent pair without locks and never touch I2C.
+class Power{
+public:
+    // LSBs of every channel, set once before the capture tasks start
+    static void init(const double* shunt_ma_lsb, double bus_v_lsb){
+        for (int i = 0; i < 3; i++){
+            ma_lsb[i] = shunt_ma_lsb[i];
+        }
+        v_lsb = bus_v_lsb;
+    }
+
+    // 1..3, 0 - records are not annotated
+    static inline void set_channel(int ch){
+        channel.store(ch, std::memory_order_relaxed);
+    }
+
+    static inline int get_channel(){
+        return channel.load(std::memory_order_relaxed);
+    }
+
+    // Shunt and bus of channel 1..3 in LSBs
+    static inline void publish(const int16_t* v){
+        for (int i = 0; i < 3; i++){
+            slots[i].store((uint32_t)(uint16_t)v[i * 2] << 16 | (uint16_t)v[i * 2 + 1], std::memory_order_relaxed);
+        }
+        valid.store(true, std::memory_order_release);
+    }
+
+    // The reading of the configured channel at the buffer's read time
+    static inline void annotate(Buffer& b){
+        int ch = get_channel();
+        if (!ch || !valid.load(std::memory_order_acquire)) return;
+        uint32_t s = slots[ch - 1].load(std::memory_order_relaxed);
+        b.power = true;
+        b.power_ma = (int16_t)(s >> 16) * ma_lsb[ch - 1];
+        b.power_v = (int16_t)(s & 0xFFFF) * v_lsb;
+    }
+
+private:
+    static std::atomic<uint32_t> slots[3];
+    static std::atomic<bool> valid;
+    static std::atomic<int> channel;
+    static float ma_lsb[3];
+    static float v_lsb;
+};
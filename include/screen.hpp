@@ -1,14 +1,24 @@
 #pragma once
 
 #include "common.h"
+#include "button.hpp"
 #include "i2c.hpp"
 #include "config.hpp"
+#include "stats.hpp"
 #include <fonts.h>
+#include <deque>
 #include <map>
 
 #define BUF_SIZE 128 * 8 + 1
+// log page: one 8 pixel RAM page per line, 7 pixel wide glyphs
+#define LOG_LINES 8
+#define LOG_COLS 18
+#define LOG_CHUNK 32
+#define LOG_QSIZE 16
 
 class Screen: public I2C{
+    // host benchmarks of the rendering, sim/bench.cpp
+    friend class Bench;
 public:
     Screen(Config& config, bool updown=false): I2C("Screen", 0), updown(updown),
         fonts{&Font_7x10, &Font_11x18, &Font_16x26}
@@ -23,9 +33,7 @@ public:
             return;
         }
         delay(100);
-        if (!queue){
-            queue = xQueueCreate(10, sizeof(ScreenUpdate));
-        }
+        init_queue();
         buf = &buf_data[1];
         buf_data[0] = 0x40;
         inited = true;
@@ -34,6 +42,18 @@ public:
     }
 
 
+    // Pages are the labels and a log tail of every capture channel with a
+    // pin, the button steps through them
+    void add_log_pages(Config& config, Button* btn){
+        button = btn;
+        for (int port = 1; port < STATS_UARTS; port++){
+            if (config.get_uart_io(port)) channels.push_back(port);
+        }
+        for (int i = 0; i < STATS_SOFT_UARTS; i++){
+            if (config.get_soft_uart_io(i)) channels.push_back(Stats::soft_channel(i));
+        }
+    }
+
     int add_label(int x, int y, int w, int font_id, std::string text){
         Label l{x, y, w, fonts[font_id], text};
         labels.push_back(l);
@@ -53,22 +73,57 @@ private:
         int id;
         char text[20];
     };
+    struct LogChunk{
+        int8_t channel;
+        uint8_t len;
+        char text[LOG_CHUNK];
+    };
 
 public:
 
+    // Updates sent before the screen is up wait here; labels have to be
+    // added before start()
+    static void init_queue(){
+        if (!queue){
+            queue = xQueueCreate(10, sizeof(ScreenUpdate));
+            log_queue = xQueueCreate(LOG_QSIZE, sizeof(LogChunk));
+        }
+    }
+
+    // Capture tasks pass what they read, kept only while the channel is on
+    // screen. Never blocks, a full queue loses the rest.
+    static void log(int channel, const char* data, size_t len){
+        if (channel != log_channel.load(std::memory_order_relaxed)) return;
+        LogChunk c;
+        c.channel = channel;
+        while (len){
+            c.len = std::min<size_t>(len, LOG_CHUNK);
+            memcpy(c.text, data, c.len);
+            data += c.len;
+            len -= c.len;
+            if (xQueueSend(log_queue, &c, 0) != pdTRUE){
+                Stats::add(Stats::SCREEN_DROPPED);
+                return;
+            }
+        }
+    }
+
     static void update_label(int id, std::string text){
-        if (!queue) return;
-        text.resize(19);
-        ScreenUpdate upd;
-        upd.id = id;
-        memcpy(upd.text, text.c_str(), 20);
-        if (!xQueueSend(queue, &upd, 10)){
+        if (!post_label(id, text, 10)){
             ESP_LOGE("Screen", "Queue full");
         }
     }
 
+    // For the capture tasks: never blocks, a full queue drops the update
+    static void update_label_nowait(int id, std::string text){
+        post_label(id, text, 0);
+    }
+
     void run(){
         while(true){
+            if (button && button->pressed()){
+                next_page();
+            }
             ScreenUpdate upd;
             std::map<int, std::string> texts;
             while(xQueueReceive(queue, &upd, 1) == pdTRUE && texts.size() < 10){
@@ -77,11 +132,27 @@ public:
             if (texts.size() > 0){
                 update_labels(texts);
             }
+            if (page){
+                update_log();
+            }
             delay(100);
         }
     }
 
 private:
+    static bool post_label(int id, std::string& text, TickType_t wait){
+        if (!queue) return true;
+        text.resize(19);
+        ScreenUpdate upd;
+        upd.id = id;
+        memcpy(upd.text, text.c_str(), 20);
+        if (xQueueSend(queue, &upd, wait) != pdTRUE){
+            Stats::add(Stats::SCREEN_DROPPED);
+            return false;
+        }
+        Stats::high_water(Stats::SCREEN_QUEUE_HW, uxQueueMessagesWaiting(queue));
+        return true;
+    }
 
     void init_cmds(){
         send_cmd(0xAE);
@@ -107,13 +178,110 @@ private:
         write_bytes((uint8_t*)&_cmd, 2);
     }
 
+    // Horizontal addressing of columns 0-127 and pages first..last
+    void set_window(int first, int last){
+        send_cmd(0x21);
+        send_cmd(0);
+        send_cmd(127);
+        send_cmd(0x22);
+        send_cmd(first);
+        send_cmd(last);
+    }
+
     void send_screen(){
         if (!inited){
             return;
         }
+        set_window(0, 7);
         write_bytes(buf_data, BUF_SIZE);
     }
 
+    void next_page(){
+        page = (page + 1) % (channels.size() + 1);
+        log_channel.store(page ? channels[page - 1] : -1, std::memory_order_relaxed);
+        if (!page){
+            // back to the labels, kept up to date in buf meanwhile
+            send_cmd(0x40);
+            send_screen();
+            return;
+        }
+        int ch = channels[page - 1];
+        LogChunk c;
+        while (xQueueReceive(log_queue, &c, 0) == pdTRUE);
+        for (int i = 0; i < LOG_LINES; i++){
+            send_line(i, "");
+        }
+        top = 0;
+        send_cmd(0x40);
+        line.clear();
+        send_line(bottom_page(), "-- log " + (ch < STATS_UARTS ? std::to_string(ch) : "S" + std::to_string(ch - STATS_UARTS)) + " --");
+        scroll();
+    }
+
+    // The bottom line is the one still being received. Every finished line
+    // moves the display start line up one page and only the page coming in
+    // at the bottom is sent, not the whole screen.
+    void update_log(){
+        LogChunk c;
+        std::deque<std::string> done;
+        bool changed = false;
+        while (xQueueReceive(log_queue, &c, 0) == pdTRUE){
+            if (c.channel != channels[page - 1]) continue;
+            for (int i = 0; i < c.len; i++){
+                char ch = c.text[i];
+                if (ch == '\r') continue;
+                if (ch == '\n' || line.length() == LOG_COLS){
+                    done.push_back(line);
+                    if (done.size() > LOG_LINES) done.pop_front();
+                    line.clear();
+                }
+                if (ch != '\n'){
+                    line += ch >= 0x20 && ch < 0x7F ? ch : '.';
+                }
+                changed = true;
+            }
+        }
+        if (!changed) return;
+        for (auto& l : done){
+            send_line(bottom_page(), l);
+            scroll();
+        }
+        send_line(bottom_page(), line);
+    }
+
+    // With the rows flipped the start line shows at the bottom
+    inline int bottom_page(){
+        return updown ? top : (top + LOG_LINES - 1) % LOG_LINES;
+    }
+
+    void scroll(){
+        top = updown ? (top + LOG_LINES - 1) % LOG_LINES : (top + 1) % LOG_LINES;
+        send_cmd(0x40 | (top * 8));
+    }
+
+    // Top 8 rows of Font_7x10, descenders are cut
+    void send_line(int ram_page, const std::string& text){
+        uint8_t data[129] = {0x40};
+        const FontDef_t* f = fonts[0];
+        for (size_t i = 0; i < text.length() && i < LOG_COLS; i++){
+            const uint16_t* letter = &f->data[((int)text[i] - 0x20) * f->FontHeight];
+            for (int x = 0; x < f->FontWidth; x++){
+                uint8_t col = 0;
+                for (int row = 0; row < 8; row++){
+                    if ((letter[row] >> (15 - x)) & 1){
+                        col |= 1 << (updown ? 7 - row : row);
+                    }
+                }
+                data[1 + i * f->FontWidth + x] = col;
+            }
+        }
+        if (!inited){
+            return;
+        }
+        set_window(ram_page, ram_page);
+        write_bytes(data, sizeof(data));
+    }
+
     const uint16_t* get_letter(Label& l, int pos){
         if (l.text.length() <= pos){
             return l.font->data;
@@ -167,10 +335,14 @@ private:
 
     void update_labels(std::map<int, std::string> texts){
         for (auto& val: texts){
+            if (val.first >= (int)labels.size()) continue;
             labels[val.first].text = val.second;
             draw_label(val.first);
         }
-        send_screen();
+        // a log page owns the display
+        if (!page){
+            send_screen();
+        }
     }
 
 private:
@@ -180,5 +352,15 @@ private:
     bool inited = false;
     std::vector<Screen::Label> labels;
     FontDef_t* fonts[3];
+    Button* button = nullptr;
+    // stats channel ids of the log pages
+    std::vector<int> channels;
+    // 0 - labels, 1.. - log of channels[page - 1]
+    int page = 0;
+    // RAM page at the display start line
+    int top = 0;
+    std::string line;
     static QueueHandle_t queue;
+    static QueueHandle_t log_queue;
+    static std::atomic<int> log_channel;
 };
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "common.h"
+#include "pool.hpp"
+#include <mbedtls/gcm.h>
+#include <mbedtls/md.h>
+
+#define SESSION_MAGIC "UULE"
+#define SESSION_IV_LEN 12
+#define SESSION_TAG_LEN 16
+// magic, session nonce, IV
+#define SESSION_HEADER (4 + 8 + SESSION_IV_LEN)
+// plain text of a datagram, records with their length
+#define SESSION_BATCH 1400
+
+static_assert(POOL_BUF_SIZE + 2 <= SESSION_BATCH, "a record must fit a batch");
+
+// Encrypted data stream of a session started by a signed "UUL AUTH <nonce>
+// START". The key is the first 16 bytes of HMAC-SHA256(control key,
+// "UUL SESSION <nonce> <boot>"), boot being the count of the device's
+// boots kept in NVS. Records go out in batches as AES-128-GCM datagrams:
+// "UULE", nonce (u64 LE), IV, ciphertext, tag; the magic and the nonce are
+// authenticated too. The IV is the boot (u32 LE) and a counter (u64 LE)
+// from 0: a session restored after a reset goes on under a new key, so
+// no IV repeats under one. The plain text is the records, each after its
+// u16 LE length. AES and SHA run on the ESP32 accelerators through mbedtls.
+class Session{
+public:
+    Session(){
+        mbedtls_gcm_init(&gcm);
+    }
+
+    ~Session(){
+        mbedtls_gcm_free(&gcm);
+    }
+
+    static void derive(const std::string& psk, uint64_t nonce, uint32_t boot, uint8_t* key){
+        std::string label = "UUL SESSION " + std::to_string(nonce) + " " + std::to_string(boot);
+        uint8_t mac[32];
+        mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                        (const unsigned char*)psk.data(), psk.length(),
+                        (const unsigned char*)label.data(), label.length(), mac);
+        memcpy(key, mac, 16);
+    }
+
+    void start(const std::string& psk, uint64_t session_nonce, uint32_t boot_count){
+        uint8_t key[16];
+        derive(psk, session_nonce, boot_count, key);
+        mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key, 128);
+        memset(key, 0, sizeof(key));
+        nonce = session_nonce;
+        boot = boot_count;
+        counter = 0;
+        used = 0;
+        on = true;
+    }
+
+    void stop(){
+        on = false;
+        used = 0;
+    }
+
+    inline bool active(){
+        return on;
+    }
+
+    // False when the record does not fit the batch, seal() it first
+    bool add(const uint8_t* data, size_t len){
+        if (used + 2 + len > SESSION_BATCH) return false;
+        plain[used++] = len & 0xFF;
+        plain[used++] = len >> 8;
+        memcpy(plain + used, data, len);
+        used += len;
+        return true;
+    }
+
+    // The batch as one datagram and its length, 0 when empty; the batch
+    // is empty after
+    size_t seal(const uint8_t*& out){
+        if (!used) return 0;
+        memcpy(sealed, SESSION_MAGIC, 4);
+        memcpy(sealed + 4, &nonce, 8);
+        uint8_t* iv = sealed + 12;
+        memcpy(iv, &boot, sizeof(boot));
+        memcpy(iv + sizeof(boot), &counter, sizeof(counter));
+        counter++;
+        mbedtls_gcm_crypt_and_tag(&gcm, MBEDTLS_GCM_ENCRYPT, used, iv, SESSION_IV_LEN, sealed, 12,
+                                  plain, sealed + SESSION_HEADER, SESSION_TAG_LEN, sealed + SESSION_HEADER + used);
+        size_t len = SESSION_HEADER + used + SESSION_TAG_LEN;
+        used = 0;
+        out = sealed;
+        return len;
+    }
+
+private:
+    mbedtls_gcm_context gcm;
+    bool on = false;
+    uint64_t nonce = 0;
+    uint32_t boot = 0;
+    uint64_t counter = 0;
+    size_t used = 0;
+    uint8_t plain[SESSION_BATCH];
+    uint8_t sealed[SESSION_HEADER + SESSION_BATCH + SESSION_TAG_LEN];
+};
@@ -0,0 +1,279 @@
+#pragma once
+
+#include "common.h"
+#include "config.hpp"
+#include "screen.hpp"
+#include "stats.hpp"
+#include "trigger.hpp"
+#include "uart_decoder.hpp"
+#include "udp.hpp"
+#include <driver/gpio.h>
+#include <driver/ledc.h>
+#include <driver/periph_ctrl.h>
+#include <esp_heap_caps.h>
+#include <esp_intr_alloc.h>
+#include <esp32/rom/gpio.h>
+#include <esp32/rom/lldesc.h>
+#include <soc/gpio_sig_map.h>
+#include <soc/i2s_struct.h>
+#include <soc/io_mux_reg.h>
+
+#define SOFT_UART_OVERSAMPLE 8
+#define SOFT_UART_DMA_BUFS 4
+#define SOFT_UART_DMA_BUF_SIZE 4092
+#define SOFT_UART_FLUSH_MS 50
+// gpio matrix input tied high
+#define SOFT_UART_CONST_HIGH 0x38
+
+// Up to 8 RX lines sampled together by I2S0 in camera mode: every line is
+// one data bit, the sample clock comes from LEDC looped back into the I2S
+// clock input. DMA fills a ring of buffers, the task decodes every line in
+// software and feeds each channel to its own message lane.
+class SoftUart: public Thread{
+public:
+    static const int CHANNELS = STATS_SOFT_UARTS;
+
+    SoftUart(Config& config): Thread("SUART"), config(config), baud(config.soft_uart_baud()){
+        for (int i = 0; i < CHANNELS; i++){
+            int pin = config.get_soft_uart_io(i);
+            channels[i].pin = pin && GPIO_IS_VALID_GPIO(pin) ? pin : -1;
+            if (channels[i].pin >= 0) active++;
+        }
+    }
+
+    inline bool enabled() {return active > 0;}
+
+private:
+    struct Channel{
+        int pin = -1;
+        UartDecoder decoder;
+        uint16_t h = Pool::NONE;
+        uint8_t trigger_state = 0;
+    };
+
+    // The interrupt is allocated on the cpu running setup(), so it is
+    // called from the task
+    void setup(){
+        done = xQueueCreate(SOFT_UART_DMA_BUFS, sizeof(lldesc_t*));
+
+        ledc_timer_config_t timer = {};
+        timer.speed_mode = LEDC_HIGH_SPEED_MODE;
+        timer.duty_resolution = LEDC_TIMER_1_BIT;
+        timer.timer_num = LEDC_TIMER_0;
+        timer.freq_hz = baud * SOFT_UART_OVERSAMPLE;
+        timer.clk_cfg = LEDC_AUTO_CLK;
+        ESP_ERROR_CHECK(ledc_timer_config(&timer));
+        ledc_channel_config_t clock = {};
+        clock.gpio_num = CONFIG_SOFT_UART_CLOCK_PIN;
+        clock.speed_mode = LEDC_HIGH_SPEED_MODE;
+        clock.channel = LEDC_CHANNEL_0;
+        clock.timer_sel = LEDC_TIMER_0;
+        clock.duty = 1;
+        ESP_ERROR_CHECK(ledc_channel_config(&clock));
+        // the real rate, the divider is not exact
+        uint32_t rate = ledc_get_freq(LEDC_HIGH_SPEED_MODE, LEDC_TIMER_0);
+        ESP_LOGI(TAG, "%d channels at %d baud, sampled at %d Hz", active, baud, rate);
+
+        PIN_INPUT_ENABLE(GPIO_PIN_MUX_REG[CONFIG_SOFT_UART_CLOCK_PIN]);
+        gpio_matrix_in(CONFIG_SOFT_UART_CLOCK_PIN, I2S0I_WS_IN_IDX, false);
+        gpio_matrix_in(SOFT_UART_CONST_HIGH, I2S0I_V_SYNC_IDX, false);
+        gpio_matrix_in(SOFT_UART_CONST_HIGH, I2S0I_H_SYNC_IDX, false);
+        gpio_matrix_in(SOFT_UART_CONST_HIGH, I2S0I_H_ENABLE_IDX, false);
+        for (int i = 0; i < CHANNELS; i++){
+            Channel& c = channels[i];
+            if (c.pin >= 0){
+                gpio_set_direction(static_cast<gpio_num_t>(c.pin), GPIO_MODE_INPUT);
+                gpio_set_pull_mode(static_cast<gpio_num_t>(c.pin), GPIO_PULLUP_ONLY);
+                gpio_matrix_in(c.pin, I2S0I_DATA_IN0_IDX + i, false);
+                c.decoder = UartDecoder(i, rate, baud);
+                Stats::set(Stats::channel_counter(Stats::UART_BAUD, Stats::soft_channel(i)), baud);
+            }else{
+                // unused lines idle high
+                gpio_matrix_in(SOFT_UART_CONST_HIGH, I2S0I_DATA_IN0_IDX + i, false);
+            }
+        }
+
+        for (int i = 0; i < SOFT_UART_DMA_BUFS; i++){
+            bufs[i] = (uint8_t*)heap_caps_malloc(SOFT_UART_DMA_BUF_SIZE, MALLOC_CAP_DMA);
+            if (!bufs[i]){
+                ESP_LOGE(TAG, "No memory for DMA buffers");
+                return;
+            }
+            lldesc_t& d = desc[i];
+            d.size = SOFT_UART_DMA_BUF_SIZE;
+            d.length = 0;
+            d.offset = 0;
+            d.sosf = 0;
+            d.eof = 0;
+            d.owner = 1;
+            d.buf = bufs[i];
+            d.qe.stqe_next = &desc[(i + 1) % SOFT_UART_DMA_BUFS];
+        }
+
+        periph_module_enable(PERIPH_I2S0_MODULE);
+        I2S0.conf.rx_reset = 1;
+        I2S0.conf.rx_reset = 0;
+        I2S0.conf.rx_fifo_reset = 1;
+        I2S0.conf.rx_fifo_reset = 0;
+        I2S0.lc_conf.in_rst = 1;
+        I2S0.lc_conf.in_rst = 0;
+        I2S0.conf.rx_slave_mod = 1;
+        I2S0.conf2.lcd_en = 1;
+        I2S0.conf2.camera_en = 1;
+        I2S0.conf.rx_msb_right = 0;
+        I2S0.conf.rx_right_first = 0;
+        I2S0.clkm_conf.clkm_div_a = 0;
+        I2S0.clkm_conf.clkm_div_b = 0;
+        I2S0.clkm_conf.clkm_div_num = 2;
+        I2S0.sample_rate_conf.rx_bck_div_num = 1;
+        I2S0.sample_rate_conf.rx_bits_mod = 0;
+        // one sample per 16 bits, see unpack()
+        I2S0.fifo_conf.rx_fifo_mod = 1;
+        I2S0.fifo_conf.rx_fifo_mod_force_en = 1;
+        I2S0.fifo_conf.dscr_en = 1;
+        I2S0.conf_chan.rx_chan_mod = 1;
+        I2S0.timing.val = 0;
+        I2S0.timing.rx_dsync_sw = 1;
+        // eof after every buffer, counted in 32 bit words
+        I2S0.rx_eof_num = SOFT_UART_DMA_BUF_SIZE / 4;
+        I2S0.in_link.addr = (uintptr_t)&desc[0] & 0xFFFFF;
+        I2S0.int_clr.val = ~0u;
+        I2S0.int_ena.val = 0;
+        I2S0.int_ena.in_suc_eof = 1;
+        ESP_ERROR_CHECK(esp_intr_alloc(ETS_I2S0_INTR_SOURCE, ESP_INTR_FLAG_IRAM, &SoftUart::isr, this, &intr));
+        I2S0.in_link.start = 1;
+        I2S0.conf.rx_start = 1;
+    }
+
+    static void IRAM_ATTR isr(void* arg){
+        SoftUart* thiz = (SoftUart*)arg;
+        BaseType_t woken = pdFALSE;
+        if (I2S0.int_st.in_suc_eof){
+            lldesc_t* d = (lldesc_t*)(uintptr_t)I2S0.in_eof_des_addr;
+            if (xQueueSendFromISR(thiz->done, &d, &woken) != pdTRUE){
+                thiz->lost++;
+            }
+        }
+        I2S0.int_clr.val = I2S0.int_st.val;
+        if (woken){
+            portYIELD_FROM_ISR();
+        }
+    }
+
+    // Every 32 bit word holds two samples, the first one in byte 2 and
+    // the second in byte 0. Packs them in place, returns the sample count.
+    static size_t unpack(uint8_t* buf, size_t len){
+        size_t n = 0;
+        for (size_t w = 0; w + 4 <= len; w += 4){
+            uint8_t first = buf[w + 2];
+            uint8_t second = buf[w];
+            buf[n++] = first;
+            buf[n++] = second;
+        }
+        return n;
+    }
+
+    void append(int i, const uint8_t* data, size_t len, int64_t now){
+        Channel& c = channels[i];
+        Pool& pool = UDP::pool();
+        while (len){
+            if (c.h == Pool::NONE){
+                c.h = pool.alloc();
+                if (c.h == Pool::NONE){
+                    ESP_LOGE(TAG, "No free buffers");
+                    Stats::add(Stats::MSG_DROPPED);
+                    return;
+                }
+                // stamped with the DMA buffer holding the first byte
+                pool[c.h].rx_us = now;
+                Power::annotate(pool[c.h]);
+            }
+            Buffer& b = pool[c.h];
+            size_t n = std::min(len, b.capacity() - b.len);
+            memcpy(b.payload() + b.len, data, n);
+            b.len += n;
+            data += n;
+            len -= n;
+            if (b.len == b.capacity()){
+                flush(i);
+            }
+        }
+    }
+
+    void flush(int i){
+        Channel& c = channels[i];
+        if (c.h == Pool::NONE) return;
+        UDP::send(Messages::soft_lane(i), c.h);
+        c.h = Pool::NONE;
+    }
+
+    void decode(lldesc_t* d, int64_t now){
+        uint8_t* samples = (uint8_t*)d->buf;
+        size_t n = unpack(samples, d->length);
+        // at most one byte per 10 bits of samples
+        uint8_t out[SOFT_UART_DMA_BUF_SIZE / 2 / (SOFT_UART_OVERSAMPLE * 10) + 1];
+        bool got = false;
+        for (int i = 0; i < CHANNELS; i++){
+            Channel& c = channels[i];
+            if (c.pin < 0) continue;
+            size_t len = c.decoder.decode(samples, n, out, sizeof(out));
+            if (len){
+                Stats::uart_rx(Stats::soft_channel(i), (const char*)out, len);
+                Screen::log(Stats::soft_channel(i), (const char*)out, len);
+                triggers.feed(c.trigger_state, out, len,
+                    [i, now, this](int p) { triggers.fired(Messages::soft_lane(i), Stats::soft_channel(i), p, now); });
+                append(i, out, len, now);
+                got = true;
+            }
+            if (c.decoder.framing_errors){
+                Stats::add(Stats::channel_counter(Stats::UART_FRAMING, Stats::soft_channel(i)), c.decoder.framing_errors);
+                c.decoder.framing_errors = 0;
+            }
+            if (c.decoder.overflows){
+                Stats::add(Stats::channel_counter(Stats::UART_OVERRUN, Stats::soft_channel(i)), c.decoder.overflows);
+                c.decoder.overflows = 0;
+            }
+        }
+        d->owner = 1;
+        if (got){
+            config.led().toggle();
+        }
+    }
+
+    virtual void run() override{
+        setup();
+        Pool& pool = UDP::pool();
+        lldesc_t* d;
+        while (true){
+            bool got = xQueueReceive(done, &d, SOFT_UART_FLUSH_MS / portTICK_RATE_MS) == pdTRUE;
+            int64_t now = esp_timer_get_time();
+            if (got){
+                decode(d, now);
+            }
+            // buffers the ISR had no room for were overwritten by DMA
+            uint32_t missed = lost.exchange(0);
+            for (int i = 0; i < CHANNELS; i++){
+                Channel& c = channels[i];
+                if (c.pin < 0) continue;
+                if (missed){
+                    Stats::add(Stats::channel_counter(Stats::UART_OVERRUN, Stats::soft_channel(i)), missed);
+                }
+                if (c.h != Pool::NONE && now - pool[c.h].rx_us >= SOFT_UART_FLUSH_MS * 1000){
+                    flush(i);
+                }
+            }
+        }
+    }
+
+private:
+    Config& config;
+    uint32_t baud;
+    int active = 0;
+    Channel channels[CHANNELS];
+    QueueHandle_t done = nullptr;
+    intr_handle_t intr = nullptr;
+    lldesc_t desc[SOFT_UART_DMA_BUFS];
+    uint8_t* bufs[SOFT_UART_DMA_BUFS] = {};
+    std::atomic<uint32_t> lost{0};
+    const Triggers& triggers = Triggers::global();
+};
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "common.h"
+#include <driver/uart.h>
+#include <esp_timer.h>
+
+#define STATS_UARTS 3
+#define STATS_SOFT_UARTS 8
+// hardware ports first, then the software sampled channels
+#define STATS_CHANNELS (STATS_UARTS + STATS_SOFT_UARTS)
+
+// Global runtime counters. Updates are relaxed atomics, cheap enough for
+// the capture path.
+class Stats{
+public:
+    enum Counter {
+        UART_RX,                                    // bytes per channel
+        UART_LINES = UART_RX + STATS_CHANNELS,      // lines per channel
+        UART_OVERRUN = UART_LINES + STATS_CHANNELS, // fifo, ring or DMA buffer overflows per channel
+        UART_FRAMING = UART_OVERRUN + STATS_CHANNELS, // framing errors per channel
+        UART_BAUD = UART_FRAMING + STATS_CHANNELS,  // current rate per channel, 0 - not running
+        UART_TRIGGERS = UART_BAUD + STATS_CHANNELS, // trigger pattern matches per channel
+        MSG_ENQUEUED = UART_TRIGGERS + STATS_CHANNELS,
+        MSG_DROPPED,
+        MSG_QUEUE_HW,                           // high-water mark
+        UDP_SENT,
+        UDP_FAILED,
+        WIFI_RECONNECTS,
+        WIFI_LAST_MS,                           // last (re)connect, disconnect to got ip
+        WIFI_MAX_MS,
+        WIFI_DOWN_MS,                           // total time offline
+        SCREEN_DROPPED,
+        SCREEN_QUEUE_HW,
+        COUNTERS
+    };
+
+    static inline void add(Counter c, uint32_t n = 1){
+        counters[c].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    static inline void high_water(Counter c, uint32_t val){
+        uint32_t cur = counters[c].load(std::memory_order_relaxed);
+        while (val > cur && !counters[c].compare_exchange_weak(cur, val, std::memory_order_relaxed));
+    }
+
+    static inline void set(Counter c, uint32_t val){
+        counters[c].store(val, std::memory_order_relaxed);
+    }
+
+    static inline uint32_t get(Counter c){
+        return counters[c].load(std::memory_order_relaxed);
+    }
+
+    static inline int soft_channel(int channel){
+        return STATS_UARTS + channel;
+    }
+
+    static inline Counter channel_counter(Counter c, int channel){
+        return static_cast<Counter>(c + channel);
+    }
+
+    // channel is a uart port or soft_channel()
+    static void uart_rx(int channel, const char* buf, int len){
+        if (channel < 0 || channel >= STATS_CHANNELS) return;
+        add(channel_counter(UART_RX, channel), len);
+        uint32_t lines = 0;
+        for (const char* p = buf; (p = (const char*)memchr(p, '\n', buf + len - p)) != nullptr; p++){
+            lines++;
+        }
+        if (lines){
+            add(channel_counter(UART_LINES, channel), lines);
+        }
+    }
+
+    // "key=value ..." snapshot for UUL STATS
+    static std::string snapshot(){
+        std::string ret = "up=" + std::to_string(esp_timer_get_time() / 1000000)
+            + " heap=" + std::to_string(esp_get_free_heap_size())
+            + " minheap=" + std::to_string(esp_get_minimum_free_heap_size());
+        for (int i = 0; i < STATS_CHANNELS; i++){
+            std::string ch = i < STATS_UARTS ? "u" + std::to_string(i) : "s" + std::to_string(i - STATS_UARTS);
+            // idle soft channels are left out
+            if (i >= STATS_UARTS && !get(channel_counter(UART_RX, i)) && !get(channel_counter(UART_FRAMING, i))){
+                continue;
+            }
+            ret += " " + ch + ".rx=" + std::to_string(get(channel_counter(UART_RX, i)))
+                + " " + ch + ".lines=" + std::to_string(get(channel_counter(UART_LINES, i)))
+                + " " + ch + ".ovf=" + std::to_string(get(channel_counter(UART_OVERRUN, i)))
+                + " " + ch + ".ferr=" + std::to_string(get(channel_counter(UART_FRAMING, i)));
+            if (get(channel_counter(UART_BAUD, i))){
+                ret += " " + ch + ".baud=" + std::to_string(get(channel_counter(UART_BAUD, i)));
+            }
+            if (get(channel_counter(UART_TRIGGERS, i))){
+                ret += " " + ch + ".trig=" + std::to_string(get(channel_counter(UART_TRIGGERS, i)));
+            }
+        }
+        static const char* names[] = {"msg.in", "msg.drop", "msg.qhw", "udp.sent", "udp.fail",
+            "wifi.reconn", "wifi.last_ms", "wifi.max_ms", "wifi.down_ms", "scr.drop", "scr.qhw"};
+        for (int c = MSG_ENQUEUED; c < COUNTERS; c++){
+            ret += std::string(" ") + names[c - MSG_ENQUEUED] + "=" + std::to_string(get(static_cast<Counter>(c)));
+        }
+        Thread* t;
+        for (int i = 0; (t = Thread::started(i)) != nullptr; i++){
+            ret += " stk." + t->get_name() + "=" + std::to_string(t->stack_high_water());
+        }
+        return ret;
+    }
+
+private:
+    static std::atomic<uint32_t> counters[COUNTERS];
+};
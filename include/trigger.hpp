@@ -0,0 +1,147 @@
+#pragma once
+
+#include "common.h"
+#include "screen.hpp"
+#include "stats.hpp"
+#include "udp.hpp"
+#include <vector>
+
+// uint8_t state ids
+#define TRIGGER_MAX_STATES 256
+// one output bit per pattern
+#define TRIGGER_MAX_PATTERNS 16
+
+// Aho-Corasick automaton over the configured trigger patterns, compiled to
+// a full transition table: one lookup per byte whatever the pattern count.
+// Bytes not in any pattern share one column. Built once before the capture
+// tasks start, then only read; every channel keeps its own state.
+class Triggers: public Base{
+public:
+    // Screen label of the last match
+    static const int LABEL_TRIGGER = 9;
+
+    Triggers(): Base("Triggers") {}
+
+    // The patterns of all channels
+    static Triggers& global(){
+        static Triggers t;
+        return t;
+    }
+
+    // Patterns are "a|b|c", empty ones are skipped
+    bool build(const std::string& list){
+        patterns.clear();
+        size_t start = 0;
+        while (start <= list.length()){
+            size_t end = list.find('|', start);
+            if (end == std::string::npos) end = list.length();
+            if (end > start) patterns.push_back(list.substr(start, end - start));
+            start = end + 1;
+        }
+        if (patterns.size() > TRIGGER_MAX_PATTERNS){
+            ESP_LOGE(TAG, "%d patterns, only %d used", (int)patterns.size(), TRIGGER_MAX_PATTERNS);
+            patterns.resize(TRIGGER_MAX_PATTERNS);
+        }
+
+        memset(cls, 0, sizeof(cls));
+        classes = 1;
+        size_t chars = 0;
+        for (auto& p : patterns){
+            chars += p.length();
+            for (uint8_t c : p){
+                if (!cls[c]) cls[c] = classes++;
+            }
+        }
+        if (chars + 1 > TRIGGER_MAX_STATES){
+            ESP_LOGE(TAG, "Patterns too long, %d bytes", (int)chars);
+            patterns.clear();
+            classes = 1;
+            memset(cls, 0, sizeof(cls));
+        }
+
+        // trie, -1 - no edge yet
+        std::vector<int16_t> go(classes, -1);
+        out.assign(1, 0);
+        int states = 1;
+        for (size_t i = 0; i < patterns.size(); i++){
+            int s = 0;
+            for (uint8_t c : patterns[i]){
+                int16_t& edge = go[s * classes + cls[c]];
+                if (edge < 0){
+                    edge = states++;
+                    go.resize(states * classes, -1);
+                    out.push_back(0);
+                }
+                s = go[s * classes + cls[c]];
+            }
+            out[s] |= 1 << i;
+        }
+
+        // breadth first: missing edges follow the failure link, outputs
+        // of the longest proper suffix state are inherited
+        next.assign(states * classes, 0);
+        std::vector<uint8_t> fail(states, 0);
+        std::vector<uint8_t> order;
+        for (int c = 0; c < classes; c++){
+            int16_t t = go[c];
+            if (t > 0){
+                order.push_back(t);
+                next[c] = t;
+            }
+        }
+        for (size_t q = 0; q < order.size(); q++){
+            int s = order[q];
+            out[s] |= out[fail[s]];
+            for (int c = 0; c < classes; c++){
+                int16_t t = go[s * classes + c];
+                if (t > 0){
+                    fail[t] = next[fail[s] * classes + c];
+                    order.push_back(t);
+                    next[s * classes + c] = t;
+                }else{
+                    next[s * classes + c] = next[fail[s] * classes + c];
+                }
+            }
+        }
+        ESP_LOGI(TAG, "%d patterns, %d states, %d byte classes", (int)patterns.size(), states, classes);
+        return !patterns.empty();
+    }
+
+    inline bool empty() const {return patterns.empty();}
+
+    inline const std::string& pattern(int i) const {return patterns[i];}
+
+    // Runs the channel state over the data, calls match(pattern index)
+    // for every pattern ending in it
+    template<typename F>
+    void feed(uint8_t& state, const uint8_t* data, size_t len, F match) const{
+        if (patterns.empty()) return;
+        const uint8_t* table = next.data();
+        uint8_t s = state;
+        for (size_t i = 0; i < len; i++){
+            s = table[s * classes + cls[data[i]]];
+            if (out[s]){
+                for (uint16_t m = out[s]; m; m &= m - 1){
+                    match(__builtin_ctz(m));
+                }
+            }
+        }
+        state = s;
+    }
+
+    // A match on a capture channel: counted, shown and sent ahead of the
+    // data as "TRG <ms>: <source> <pattern>", stamped with the data's capture time
+    void fired(Messages::Lane lane, int channel, int index, int64_t rx_us) const{
+        Stats::add(Stats::channel_counter(Stats::UART_TRIGGERS, channel));
+        std::string text = std::string(UDP::messages().source(lane)) + " " + patterns[index];
+        Screen::update_label_nowait(LABEL_TRIGGER, "!" + text);
+        UDP::send(Messages::LANE_TRIGGERS, text + "\n", rx_us);
+    }
+
+private:
+    std::vector<std::string> patterns;
+    uint8_t cls[256];
+    int classes = 1;
+    std::vector<uint8_t> next;
+    std::vector<uint16_t> out;
+};
@@ -2,31 +2,48 @@
 
 #include "common.h"
 #include "config.hpp"
+#include "control.hpp"
+#include "power.hpp"
+#include "screen.hpp"
+#include "stats.hpp"
+#include "trigger.hpp"
 #include "udp.hpp"
 #include <driver/uart.h>
+#include <hal/uart_ll.h>
+#include <soc/soc.h>
 #include <sstream>
 #include <string>
 
 #define CFG_BUF 2048
-
-typedef std::vector<std::string> strings;
+#define EVENTS_QSIZE 32
+#define RX_BUF 8192
+#define AUTOBAUD_EDGES 64
+#define AUTOBAUD_POLL_MS 20
+#define AUTOBAUD_ERR_WINDOW_MS 10000
 
 class Uart : public Thread {
+    // host benchmarks of the config command helpers, sim/bench.cpp
+    friend class Bench;
+
 public:
     enum Mode {
         MODE_NORMAL = 0,
         MODE_CONFIG = 1
     };
 
+    // Screen labels "<port>:<baud>" of uart 1 and 2
+    static const int LABEL_BAUD = 7;
+
 public:
     Uart(Config& config, uart_port_t port, Mode mode = MODE_NORMAL)
         : Thread("UART" + std::to_string(port))
         , config(config)
         , port(port)
         , mode(mode)
+        , auto_baud(mode == MODE_NORMAL && config.auto_baud(port))
     {
         ESP_LOGD(TAG, "Init uart%d on pin %d", port, config.get_uart_io(port));
-        const uart_config_t uart_config = {
+        uart_config = {
             .baud_rate = 115200,
             .data_bits = UART_DATA_8_BITS,
             .parity = UART_PARITY_DISABLE,
@@ -36,34 +53,271 @@ public:
             .source_clk = UART_SCLK_APB,
         };
 
+        if (mode == MODE_NORMAL) {
+            uart_config.baud_rate = config.uart_baud(port);
+            set_frame(uart_config, config.uart_frame(port));
+            settings = xQueueCreate(1, sizeof(Settings));
+            Control::add("UART" + std::to_string(port), [this](const strings& args) { return request(args); });
+        }
+
         if (mode == MODE_CONFIG) {
             ESP_ERROR_CHECK(uart_driver_install(port, CFG_BUF, CFG_BUF, 0, NULL, 0));
             ESP_ERROR_CHECK(uart_param_config(port, &uart_config));
             ESP_ERROR_CHECK(uart_set_pin(port, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
 
-        } else {
-            // We won't use a buffer for sending data.
-            ESP_ERROR_CHECK(uart_driver_install(port, 500 * 2, 0, 0, NULL, 0));
-            ESP_ERROR_CHECK(uart_param_config(port, &uart_config));
-            ESP_ERROR_CHECK(uart_set_pin(port, UART_PIN_NO_CHANGE, config.get_uart_io(port), UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
         }
         ESP_LOGI(TAG, "uart%d enabled in mode %d on pin %d", port, mode, config.get_uart_io(port));
     }
 
 private:
+    struct Settings {
+        int pin;
+        uint32_t baud; // 0 - detect
+        uint8_t frame; // UART_FRAME_8N1 layout
+    };
+
+    static void set_frame(uart_config_t& cfg, uint8_t frame)
+    {
+        cfg.data_bits = static_cast<uart_word_length_t>(frame & 3);
+        cfg.parity = static_cast<uart_parity_t>((frame >> 2) & 3);
+        cfg.stop_bits = static_cast<uart_stop_bits_t>((frame >> 4) & 3);
+    }
+
+    // UART<port> pin=N baud=N|auto bits=5..8 parity=none|even|odd stop=1|1.5|2
+    // Runs in the UDP task, the uart task applies the change between reads
+    // and the driver's answer comes back as the result
+    std::string request(const strings& args)
+    {
+        Settings s = { config.get_uart_io(port), auto_baud ? 0 : baud, config.uart_frame(port) };
+        std::string key, val;
+        for (auto& a : args) {
+            if (!Control::arg(a, key, val)) {
+                return "BAD ARG " + a;
+            }
+            if (key == "pin") {
+                s.pin = atoi(val.c_str());
+                if (!GPIO_IS_VALID_GPIO(s.pin)) return "BAD PIN";
+            } else if (key == "baud") {
+                s.baud = val == "auto" ? 0 : atoi(val.c_str());
+                if (val != "auto" && (s.baud < 300 || s.baud > 5000000)) return "BAD BAUD";
+            } else if (key == "bits") {
+                int bits = atoi(val.c_str());
+                if (bits < 5 || bits > 8) return "BAD BITS";
+                s.frame = (s.frame & ~3) | (bits - 5);
+            } else if (key == "parity") {
+                int p = val == "none" ? UART_PARITY_DISABLE : val == "even" ? UART_PARITY_EVEN : val == "odd" ? UART_PARITY_ODD : -1;
+                if (p < 0) return "BAD PARITY";
+                s.frame = (s.frame & ~(3 << 2)) | (p << 2);
+            } else if (key == "stop") {
+                int st = val == "1" ? UART_STOP_BITS_1 : val == "1.5" ? UART_STOP_BITS_1_5 : val == "2" ? UART_STOP_BITS_2 : -1;
+                if (st < 0) return "BAD STOP";
+                s.frame = (s.frame & ~(3 << 4)) | (st << 4);
+            } else {
+                return "UNKNOWN " + key;
+            }
+        }
+        // a port reads for up to 100ms before it takes them, the sender
+        // does not wait: the outcome comes as an event
+        xQueueOverwrite(settings, &s);
+        return Control::PENDING;
+    }
+
+    // On a driver error the port keeps its settings
+    esp_err_t apply(const Settings& s)
+    {
+        uart_config_t cfg = uart_config;
+        set_frame(cfg, s.frame);
+        cfg.baud_rate = s.baud ? s.baud : baud;
+        esp_err_t err = uart_param_config(port, &cfg);
+        if (err == ESP_OK && s.pin != config.get_uart_io(port)) {
+            err = uart_set_pin(port, UART_PIN_NO_CHANGE, s.pin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+        }
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "uart%d reconfiguration failed: %d", port, err);
+            uart_param_config(port, &uart_config);
+            UDP::event("uart" + std::to_string(port) + " driver error " + std::to_string(err));
+            return err;
+        }
+        uart_config = cfg;
+        uart_flush_input(port);
+        auto_baud = s.baud == 0;
+        if (auto_baud) {
+            start_detect();
+        } else {
+            detecting = false;
+            set_baud(s.baud);
+        }
+        ESP_LOGI(TAG, "uart%d reconfigured: pin %d baud %d frame 0x%02x", port, s.pin, s.baud, s.frame);
+        UDP::event("uart" + std::to_string(port) + " pin " + std::to_string(s.pin) + " baud "
+            + (s.baud ? std::to_string(s.baud) : "auto"));
+        config.set_uart(port, s.pin, s.baud, s.frame, auto_baud);
+        return ESP_OK;
+    }
+
+    // The driver interrupt is allocated on the cpu installing it, so normal
+    // mode installs from its own task, away from the WiFi cpu
+    void install_normal()
+    {
+        // We won't use a buffer for sending data.
+        ESP_ERROR_CHECK(uart_driver_install(port, RX_BUF, 0, EVENTS_QSIZE, &events, 0));
+        ESP_ERROR_CHECK(uart_param_config(port, &uart_config));
+        ESP_ERROR_CHECK(uart_set_pin(port, UART_PIN_NO_CHANGE, config.get_uart_io(port), UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+    }
+
+    // Counts overruns and framing errors, returns the framing errors
+    uint32_t count_events()
+    {
+        uart_event_t event;
+        uint32_t framing = 0;
+        while (xQueueReceive(events, &event, 0) == pdTRUE) {
+            if (event.type == UART_FIFO_OVF || event.type == UART_BUFFER_FULL) {
+                Stats::add(static_cast<Stats::Counter>(Stats::UART_OVERRUN + port));
+            } else if (event.type == UART_FRAME_ERR) {
+                Stats::add(static_cast<Stats::Counter>(Stats::UART_FRAMING + port));
+                framing++;
+            }
+        }
+        return framing;
+    }
+
+    // Nearest standard rate, by ratio
+    static uint32_t snap_baud(uint32_t measured)
+    {
+        static const uint32_t rates[] = { 1200, 2400, 4800, 9600, 14400, 19200, 28800, 38400, 57600,
+            74880, 115200, 230400, 250000, 460800, 500000, 921600, 1000000, 1500000, 2000000 };
+        uint32_t best = rates[0];
+        double best_err = 1e9;
+        for (uint32_t r : rates) {
+            double err = measured > r ? (double)measured / r : (double)r / measured;
+            if (err < best_err) {
+                best_err = err;
+                best = r;
+            }
+        }
+        return best;
+    }
+
+    void set_baud(uint32_t rate)
+    {
+        baud = rate;
+        uart_set_baudrate(port, rate);
+        Stats::set(static_cast<Stats::Counter>(Stats::UART_BAUD + port), rate);
+        Screen::update_label_nowait(LABEL_BAUD + port - 1, std::to_string(port) + ":" + std::to_string(rate));
+    }
+
+    void start_detect()
+    {
+        uart_dev_t* hw = UART_LL_GET_HW(port);
+        uart_ll_set_autobaud_en(hw, false);
+        uart_ll_set_autobaud_en(hw, true);
+        detecting = true;
+        Stats::set(static_cast<Stats::Counter>(Stats::UART_BAUD + port), 0);
+        Screen::update_label_nowait(LABEL_BAUD + port - 1, std::to_string(port) + ":auto");
+    }
+
+    // One poll of the autobaud unit. The shortest high or low pulse is one
+    // bit; data arriving meanwhile is at the wrong rate and is dropped.
+    void detect()
+    {
+        delay(AUTOBAUD_POLL_MS);
+        uart_flush_input(port);
+        count_events();
+        uart_dev_t* hw = UART_LL_GET_HW(port);
+        if (uart_ll_get_rxd_edge_cnt(hw) < AUTOBAUD_EDGES) {
+            return;
+        }
+        uint32_t pulse = std::min(uart_ll_get_low_pulse_cnt(hw), uart_ll_get_high_pulse_cnt(hw)) + 1;
+        uart_ll_set_autobaud_en(hw, false);
+        detecting = false;
+        uint32_t measured = APB_CLK_FREQ / pulse;
+        set_baud(snap_baud(measured));
+        uart_flush_input(port);
+        frame_errors = 0;
+        ESP_LOGI(TAG, "uart%d measured %d baud, locked to %d", port, measured, baud);
+        UDP::event("uart" + std::to_string(port) + " baud " + std::to_string(baud));
+    }
+
+    // Too many framing errors in the window mean the rate changed
+    void check_framing(uint32_t errors)
+    {
+        int64_t now = esp_timer_get_time();
+        if (now - errors_since_us > AUTOBAUD_ERR_WINDOW_MS * 1000) {
+            errors_since_us = now;
+            frame_errors = 0;
+        }
+        frame_errors += errors;
+        if (frame_errors >= config.auto_baud_errors()) {
+            ESP_LOGW(TAG, "uart%d %d framing errors at %d baud, detecting", port, frame_errors, baud);
+            start_detect();
+        }
+    }
+
     void normal_run()
     {
-        char buf[500];
+        install_normal();
+        set_baud(uart_config.baud_rate);
+        if (auto_baud) {
+            start_detect();
+        }
+        // data is read straight into a pool buffer which then goes to the
+        // sender; without free buffers it is read into drop_buf and lost
+        Pool& pool = UDP::pool();
+        uint16_t h = Pool::NONE;
+        char drop_buf[128];
+        int64_t pending_us = 0;
+        Settings s;
         while (true) {
-            int rxBytes = uart_read_bytes(port, buf, 500, 50 / portTICK_RATE_MS);
+            if (xQueueReceive(settings, &s, 0) == pdTRUE) {
+                // a reconfigured port starts empty
+                apply(s);
+                pending_us = 0;
+            }
+            if (detecting) {
+                detect();
+                pending_us = 0;
+                continue;
+            }
+            if (h == Pool::NONE) {
+                h = pool.alloc();
+            }
+            char* buf = h != Pool::NONE ? (char*)pool[h].payload() : drop_buf;
+            size_t size = h != Pool::NONE ? pool[h].capacity() : sizeof(drop_buf);
+            // the record is stamped when its first byte can be read, the
+            // rest comes within 50ms or until the buffer is full. Bytes
+            // left in the driver by a full buffer were there before.
+            int rxBytes = uart_read_bytes(port, buf, 1, 50 / portTICK_RATE_MS);
+            int64_t rx_us = pending_us ? pending_us : esp_timer_get_time();
+            if (rxBytes == 1) {
+                int more = uart_read_bytes(port, buf + 1, size - 1, 50 / portTICK_RATE_MS);
+                rxBytes = more < 0 ? more : more + 1;
+                size_t left = 0;
+                uart_get_buffered_data_len(port, &left);
+                pending_us = left ? esp_timer_get_time() : 0;
+            }
+            uint32_t framing = count_events();
+            if (auto_baud) {
+                check_framing(framing);
+            }
             if (rxBytes < 0) {
                 ESP_LOGE(TAG, "UART read error: %d", rxBytes);
             }
             if (rxBytes > 0) {
                 ESP_LOGI(TAG, "UART %d read %d bytes", port, rxBytes);
-                buf[rxBytes] = 0;
-                std::string msg(buf);
-                UDP::send(std::to_string(port) + ": " + msg);
+                Stats::uart_rx(port, buf, rxBytes);
+                Screen::log(port, buf, rxBytes);
+                // also over data without a buffer, a crash is worth a trigger
+                triggers.feed(trigger_state, (const uint8_t*)buf, rxBytes,
+                    [this, rx_us](int i) { triggers.fired(Messages::uart_lane(port), port, i, rx_us); });
+                if (h == Pool::NONE) {
+                    ESP_LOGE(TAG, "No free buffers");
+                    Stats::add(Stats::MSG_DROPPED);
+                } else {
+                    pool[h].len = rxBytes;
+                    pool[h].rx_us = rx_us;
+                    Power::annotate(pool[h]);
+                    UDP::send(Messages::uart_lane(port), h);
+                    h = Pool::NONE;
+                }
                 // some indication
                 config.led().toggle();
             }
@@ -80,13 +334,53 @@ private:
             ret.push_back(std::to_string(config.get_uart()));
             ret.push_back(std::to_string(config.screen_i2c()));
             ret.push_back(std::to_string(config.ina_i2c()));
+            ret.push_back(std::to_string(config.get_soft_uart()));
+            ret.push_back(std::to_string(config.soft_uart_baud()));
+            ret.push_back(std::to_string(config.get_auto_baud()));
+            ret.push_back(std::to_string(config.auto_baud_errors()));
+            ret.push_back(std::to_string(config.static_ip()));
+            ret.push_back(std::to_string(config.static_gw()));
+            ret.push_back(std::to_string(config.static_mask()));
+            ret.push_back(config.triggers());
+            ret.push_back(std::to_string(config.ina_config()));
+            ret.push_back(std::to_string((uint64_t)config.ina_shunt(1) | (uint64_t)config.ina_shunt(2) << 16
+                | (uint64_t)config.ina_shunt(3) << 32));
+            ret.push_back(std::to_string(config.ina_period()));
+            ret.push_back(std::to_string(config.ina_annotate()));
+            ret.push_back(std::to_string(config.session_required()));
         } else if (cmd[0] == "setconfig") {
-            if (cmd.size() != 7) {
+            // soft uart, auto baud, static ip, control key, trigger, INA and session fields are optional for older tools
+            if (cmd.size() != 7 && cmd.size() != 9 && cmd.size() != 11 && cmd.size() != 14 && cmd.size() != 15
+                && cmd.size() != 16 && cmd.size() != 19 && cmd.size() != 20 && cmd.size() != 21) {
                 ret.push_back("error");
                 ret.push_back("wrong config");
             } else {
                 config.set_config_wifi(cmd[1], cmd[2], std::stoi(cmd[3]));
                 config.set_config_ports(std::stoi(cmd[4]), std::stoi(cmd[5]), std::stoi(cmd[6]));
+                if (cmd.size() >= 9) {
+                    config.set_config_soft_uart(std::stoull(cmd[7]), std::stoul(cmd[8]));
+                }
+                if (cmd.size() >= 11) {
+                    config.set_config_auto_baud(std::stoi(cmd[9]), std::stoi(cmd[10]));
+                }
+                if (cmd.size() >= 14) {
+                    config.set_config_static_ip(std::stoul(cmd[11]), std::stoul(cmd[12]), std::stoul(cmd[13]));
+                }
+                if (cmd.size() >= 15) {
+                    config.set_config_control_key(cmd[14]);
+                }
+                if (cmd.size() >= 16) {
+                    config.set_config_triggers(cmd[15]);
+                }
+                if (cmd.size() >= 19) {
+                    config.set_config_ina(std::stoul(cmd[16]), std::stoull(cmd[17]), std::stoul(cmd[18]));
+                }
+                if (cmd.size() >= 20) {
+                    config.set_config_ina_annotate(std::stoul(cmd[19]));
+                }
+                if (cmd.size() >= 21) {
+                    config.set_config_session(std::stoul(cmd[20]) != 0);
+                }
                 ret.push_back("ok");
             }
         } else if (cmd[0] == "save") {
@@ -112,18 +406,20 @@ private:
         return ret;
     }
 
+    // Fields between ':', trimmed; empty ones stay, as empty strings
     strings split_string(const std::string& str)
     {
         strings ret;
         std::string word;
         std::stringstream ss(str);
-        std::string trim = " :\r\n\t";
+        const char* trim = " :\r\n\t";
         while (std::getline(ss, word, ':')) {
-            while (trim.find(word[0]) != std::string::npos)
-                word = word.substr(1);
-            while (trim.find(word[word.length() - 1]) != std::string::npos)
-                word = word.substr(0, word.length() - 2);
-            ret.push_back(word);
+            size_t first = word.find_first_not_of(trim);
+            if (first == std::string::npos) {
+                ret.push_back("");
+                continue;
+            }
+            ret.push_back(word.substr(first, word.find_last_not_of(trim) - first + 1));
         }
         return ret;
     }
@@ -180,6 +476,16 @@ private:
     Config& config;
     uart_port_t port;
     Mode mode;
+    bool auto_baud;
+    bool detecting = false;
+    uint32_t baud = 0;
+    uint32_t frame_errors = 0;
+    int64_t errors_since_us = 0;
+    uart_config_t uart_config;
+    QueueHandle_t events = nullptr;
+    QueueHandle_t settings = nullptr;
+    const Triggers& triggers = Triggers::global();
+    uint8_t trigger_state = 0;
     bool in_config = false;
     std::string cmd;
 };
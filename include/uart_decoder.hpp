@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Software UART receiver over a sampled line. Samples are packed: bit
+// `line` of every sample byte is one line level, so up to 8 channels share
+// one buffer. Depends on nothing but the samples and its own state, which
+// carries frames across buffers, so it runs the same on the host.
+class UartDecoder{
+public:
+    UartDecoder(uint8_t line = 0, uint32_t sample_rate = 8, uint32_t baud = 1, uint8_t data_bits = 8)
+        : line(line), data_bits(data_bits)
+    {
+        set_rate(sample_rate, baud);
+    }
+
+    // Samples per bit, 16.16 fixed point
+    void set_rate(uint32_t sample_rate, uint32_t baud){
+        spb = ((uint64_t)sample_rate << 16) / baud;
+        state = WAIT_IDLE;
+    }
+
+    // Decodes a buffer, writes at most `cap` bytes to `out`, returns the
+    // number of bytes written. Bytes past `cap` are counted as overflows.
+    size_t decode(const uint8_t* samples, size_t n, uint8_t* out, size_t cap){
+        size_t got = 0;
+        size_t i = 0;
+        const uint8_t mask = 1 << line;
+        while (true){
+            if (state == IDLE || state == WAIT_IDLE){
+                // skip to the next start edge, or to the line going high
+                uint8_t want = state == IDLE ? 0 : mask;
+                while (i < n && (samples[i] & mask) != want) i++;
+                if (i >= n) break;
+                if (state == WAIT_IDLE){
+                    state = IDLE;
+                    continue;
+                }
+                // first low sample: the start bit is checked in its middle
+                next = ((int64_t)i << 16) + spb / 2;
+                bit = 0;
+                shift = 0;
+                state = START;
+            }
+            size_t idx = next >> 16;
+            if (idx >= n) break;
+            bool level = samples[idx] & mask;
+            next += spb;
+            if (state == START){
+                if (level){
+                    // glitch, not a start bit
+                    state = IDLE;
+                    i = idx + 1;
+                }else{
+                    state = DATA;
+                }
+            }else if (state == DATA){
+                shift |= (uint16_t)level << bit;
+                if (++bit == data_bits) state = STOP;
+            }else{
+                if (level){
+                    if (got < cap){
+                        out[got++] = (uint8_t)shift;
+                    }else{
+                        overflows++;
+                    }
+                    bytes++;
+                    state = IDLE;
+                }else{
+                    framing_errors++;
+                    state = WAIT_IDLE;
+                }
+                i = idx + 1;
+            }
+        }
+        // positions are relative to the buffer start
+        next -= (int64_t)n << 16;
+        return got;
+    }
+
+    uint32_t bytes = 0;
+    uint32_t framing_errors = 0;
+    uint32_t overflows = 0;
+
+private:
+    enum State { WAIT_IDLE, IDLE, START, DATA, STOP };
+
+    uint8_t line;
+    uint8_t data_bits;
+    uint32_t spb;
+    State state = WAIT_IDLE;
+    int64_t next = 0;
+    uint8_t bit = 0;
+    uint16_t shift = 0;
+};
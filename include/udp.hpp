@@ -2,43 +2,77 @@
 #define UDP_H
 
 #include "common.h"
+#include "boot.hpp"
 #include "config.hpp"
+#include "control.hpp"
 #include "messages.hpp"
+#include "ota.hpp"
 #include "screen.hpp"
+#include "session.hpp"
+#include "stats.hpp"
 #include <lwip/err.h>
 #include <lwip/sockets.h>
 #include <lwip/sys.h>
 #include <lwip/netdb.h>
 #include <esp_wifi.h>
+#include <esp_timer.h>
+#include <esp_ota_ops.h>
 #include <sstream>
 
+#define UUL_PROTOCOL_VERSION 1
+// Beacons go to this group on the control port + 1
+#define ANNOUNCE_GROUP "239.255.60.60"
+#define ANNOUNCE_PERIOD_MS 2000
+
 class UDP: public Thread{
+    // host benchmarks of the command parser, sim/bench.cpp
+    friend class Bench;
 public:
-    UDP(Config& config):Thread("UDP"){
+    UDP(Config& config):Thread("UDP"), config(config){
         port = config.port();
+        memset(&ota_peer, 0, sizeof(ota_peer));
+        restore_receiver();
+        announce_msg = build_announce();
     }
 
     void run(){
-        std::string message;
+        Pool& pool = msg.buffers();
+        uint16_t h;
         while(true){
+            // records wait in their lanes until the net is up, so the
+            // first seconds after a reset are not lost
             if (!netready){
-                ESP_LOGI(TAG, "Net not ready");
+                ESP_LOGD(TAG, "Net not ready");
                 close_udp();
-                msg.clear();
-                delay(1000);
+                delay(10);
                 continue;
             }
+            // records stay queued, a full lane drops by its policy
             if (_socket < 0 && !createSocket()){
                 ESP_LOGI(TAG, "No socket");
-                msg.clear();
                 delay(100);
                 continue;
             }
-            processUDPCommands();
-            while(msg.get_message(message)){
-                if (!remote_addr) continue;
-                sendUdp(message, remote_addr);
+            // an update drains the socket, its chunks come a window at a time
+            for (int i = 0; processUDPCommands(i ? MSG_DONTWAIT : 0) && ota.active() && i < OTA_WINDOW; i++);
+            ota.poll();
+            announce();
+            while(msg.get_message(h)){
+                Buffer& b = pool[h];
+                if (remote_addr && session.active()){
+                    // a batch goes out when full and after the queue is
+                    // drained, so records never wait for the next loop
+                    if (!session.add(b.begin(), b.len)){
+                        sendSealed();
+                        session.add(b.begin(), b.len);
+                    }
+                    sent(b);
+                }else if (remote_addr && sendUdp(b.begin(), b.len, remote_addr)){
+                    sent(b);
+                }
+                pool.release(h);
             }
+            sendSealed();
             delay(1);
         }
     }
@@ -54,11 +88,48 @@ public:
         Screen::update_label(6, "---.---.---.---");
     }
 
-    static void send(const std::string& message){
-        msg.add_message(message);
+    static inline Pool& pool(){
+        return msg.buffers();
+    }
+
+    // Data record: "<source> <device ms>: <payload>", stamped with the
+    // capture time when there is one. Queues a filled buffer, the reference
+    // is passed to the sender.
+    static void send(Messages::Lane lane, uint16_t h){
+        Messages::stamp(pool()[h], msg.source(lane));
+        msg.add_message(lane, h);
+    }
+
+    static void send(Messages::Lane lane, const std::string& message, int64_t rx_us = 0){
+        msg.add_message(lane, message, rx_us);
+    }
+
+    // Device event record, e.g. "EVT 1234: net up"
+    static void event(const std::string& message){
+        msg.add_message(Messages::LANE_EVENTS, message + "\n");
+    }
+
+    static inline Messages& messages(){
+        return msg;
     }
 
 private:
+    void sent(Buffer& b){
+        Latency::sent(b.rx_us, b.enqueue_us);
+        if (Boot::mark(Boot::FIRST_SEND)){
+            ESP_LOGI(TAG, "Boot timeline, ms: %s", Boot::snapshot().c_str());
+            event("boot " + Boot::snapshot());
+        }
+    }
+
+    void sendSealed(){
+        const uint8_t* data;
+        size_t len = session.seal(data);
+        if (len && remote_addr){
+            sendUdp(data, len, remote_addr);
+        }
+    }
+
     bool createSocket(){
         struct sockaddr_in bind_addr;
         bind_addr.sin_family = AF_INET;
@@ -84,12 +155,14 @@ private:
             return false;
         }
         ESP_LOGI(TAG, "Socket bound, port %d", port);
+        Boot::mark(Boot::SOCKET);
         _socket = sock;
         return true;
     }
 
+    // The receiver outlives the socket, records go on after a reconnect
     void close_udp(){
-        remote_addr = nullptr;
+        next_announce_us = 0;
         if (_socket < 0) return;
         ::shutdown(_socket, 0);
         ::close(_socket);
@@ -97,69 +170,304 @@ private:
     }
 
     bool sendUdp(const std::string &msg, struct sockaddr_storage *addr){
+        return sendUdp((const uint8_t*)msg.c_str(), msg.length(), addr);
+    }
+
+    bool sendUdp(const uint8_t* data, size_t len, struct sockaddr_storage *addr){
         char addr_str[128];
         inet_ntoa_r(((struct sockaddr_in *)addr)->sin_addr, addr_str, sizeof(addr_str) - 1);
         uint16_t port = ntohs( ((struct sockaddr_in *)addr)->sin_port );
-        ESP_LOGD(TAG, "Send udp data %s to %s:%d", msg.c_str(), addr_str, port);
-        int err = ::sendto(_socket, msg.c_str(), msg.length(), 0, (struct sockaddr *)addr, sizeof(struct sockaddr_storage));
+        ESP_LOGD(TAG, "Send udp data %.*s to %s:%d", (int)len, data, addr_str, port);
+        int err = ::sendto(_socket, data, len, 0, (struct sockaddr *)addr, sizeof(struct sockaddr_storage));
         if (err < 0) {
             ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
+            Stats::add(Stats::UDP_FAILED);
             return false;
         }
+        Stats::add(Stats::UDP_SENT);
         return true;
     }
 
-    std::string receiveCommand(struct sockaddr_storage *source_addr){
-        char buf[512];
+    // Datagram length, 0 when there is none
+    int receive(struct sockaddr_storage *source_addr, int flags){
         socklen_t socklen = sizeof(struct sockaddr_storage);
-        int len = recvfrom(_socket, buf, 511, 0, (struct sockaddr *)source_addr, &socklen);
-        if (len == 0) return "";
+        int len = recvfrom(_socket, rx, sizeof(rx), flags, (struct sockaddr *)source_addr, &socklen);
         if (len < 0) {
-            if (errno != EAGAIN){
+            if (errno != EAGAIN && errno != EWOULDBLOCK){
                 ESP_LOGE(TAG, "recvfrom failed: errno %d", errno);
             }
-            return "";
+            return 0;
         }
-        std::string cmd(buf, len);
-        if(cmd.substr(0,4) != "UUL "){
-            ESP_LOGE(TAG, "Received unsupported message format");
-            return "";
-        }
-        return cmd;
+        return len;
     }
 
-    void processUDPCommands(){
+    // False when nothing came
+    bool processUDPCommands(int flags = 0){
         char addr_str[128];
         struct sockaddr_storage source_addr;
-        std::string cmd = receiveCommand(&source_addr);
-        if (cmd.empty()){
-            return;
+        int len = receive(&source_addr, flags);
+        if (len == 0){
+            return false;
+        }
+        if (len >= OTA_DATA_HEADER && memcmp(rx, OTA_DATA_PREFIX, OTA_DATA_HEADER - 4) == 0){
+            otaData(len, source_addr);
+            return true;
+        }
+        std::string cmd((const char*)rx, std::min(len, 511));
+        if(cmd.substr(0,4) != "UUL "){
+            ESP_LOGE(TAG, "Received unsupported message format");
+            return true;
         }
         inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr, addr_str, sizeof(addr_str) - 1);
         ESP_LOGI(TAG, "Command received %s from %s", cmd.c_str(), addr_str);
+        std::string text = cmd;
         std::stringstream ss(cmd);
         std::string s;
         std::getline(ss, s, ' ');
         std::getline(ss, cmd, ' ');
         ESP_LOGI(TAG, "Command is %s", cmd.c_str());
+        // "UUL AUTH <nonce> <command> [args] <mac>": the command signed as
+        // UUL SET is; a START so signed starts an encrypted session
+        uint64_t signed_nonce = 0;
+        if (cmd == "AUTH"){
+            strings words;
+            std::string err = authenticate(text, words, 4);
+            if (!err.empty()){
+                sendUdp("UUL ERR " + err, &source_addr);
+                return true;
+            }
+            signed_nonce = strtoull(words[2].c_str(), nullptr, 10);
+            text = "UUL";
+            for (size_t i = 3; i < words.size(); i++){
+                text += " " + words[i];
+            }
+            ss.clear();
+            ss.str(text);
+            std::getline(ss, s, ' ');
+            std::getline(ss, cmd, ' ');
+        }else if (config.session_required() && (cmd == "START" || cmd == "STOP" || cmd == "LATENCY")){
+            // queries stay open, the stream and its receiver do not
+            sendUdp("UUL ERR AUTH REQUIRED", &source_addr);
+            return true;
+        }
         delay(100);
         if (cmd == "PING"){
             sendUdp("UUL PONG", &source_addr);
         }else if (cmd == "STOP"){
             remote_addr = nullptr;
+            session.stop();
+            config.save_receiver(0);
             sendUdp("UUL OK", &source_addr);
         }else if (cmd == "START"){
-            uint16_t rport = -1;
-            if (std::getline(ss, s, ' ')){
-                rport = (uint16_t)std::stoi(s);
+            // "START <port>" sends the data to another port of the
+            // collector; the control socket stays bound to its own
+            long rport = 0;
+            if (std::getline(ss, s, ' ') && !s.empty()){
+                char* end;
+                rport = strtol(s.c_str(), &end, 10);
+                while (isspace((unsigned char)*end)) end++;
+                if (end == s.c_str() || *end || rport < 1 || rport > 0xFFFF){
+                    sendUdp("UUL ERR BAD PORT", &source_addr);
+                    return true;
+                }
             }
-            port = rport;
+            sendSealed();
             receiver = source_addr;
+            if (rport){
+                ((struct sockaddr_in*)&receiver)->sin_port = htons((uint16_t)rport);
+            }
             remote_addr = &receiver;
-            sendUdp("UUL OK", remote_addr);
+            if (signed_nonce){
+                session.start(config.control_key(), signed_nonce, config.boot_count());
+            }else{
+                session.stop();
+            }
+            save_receiver(signed_nonce);
+            sendUdp("UUL OK", &source_addr);
+        }else if (cmd == "STATS"){
+            sendUdp("UUL STATS " + Stats::snapshot() + msg.snapshot(), &source_addr);
+        }else if (cmd == "BOOT"){
+            sendUdp("UUL BOOT " + Boot::snapshot(), &source_addr);
+        }else if (cmd == "LATENCY"){
+            sendUdp("UUL LATENCY " + Latency::snapshot(), &source_addr);
+            if (std::getline(ss, s, ' ') && s == "RESET"){
+                Latency::reset();
+            }
+        }else if (cmd == "SET"){
+            sendUdp(control(text), &source_addr);
+        }else if (cmd == "OTA"){
+            sendUdp(otaCommand(text, source_addr), &source_addr);
         }else{
             sendUdp("UUL ERR UNSUPPORTED COMMAND", &source_addr);
         }
+        return true;
+    }
+
+    // Signed command "UUL <cmd> <nonce> ... <mac>", mac is the truncated
+    // HMAC-SHA256 of everything before it with the control key. The nonce
+    // must grow, so a captured command can not be replayed. The words
+    // before the mac go to `words`; returns an error or "".
+    std::string authenticate(std::string text, strings& words, size_t min_words){
+        const std::string& key = config.control_key();
+        if (key.empty()){
+            return "NO KEY";
+        }
+        text.erase(text.find_last_not_of(" \r\n") + 1);
+        size_t pos = text.find_last_of(' ');
+        std::string body = text.substr(0, pos);
+        if (!Control::verify(key, body, text.substr(pos + 1))){
+            ESP_LOGW(TAG, "Control command with a bad signature");
+            return "AUTH";
+        }
+        std::stringstream ss(body);
+        std::string s;
+        while (std::getline(ss, s, ' ')){
+            if (!s.empty()) words.push_back(s);
+        }
+        if (words.size() < min_words){
+            return "USAGE";
+        }
+        uint64_t nonce = strtoull(words[2].c_str(), nullptr, 10);
+        if (nonce <= config.control_nonce()){
+            return "NONCE";
+        }
+        if (!config.set_control_nonce(nonce)){
+            return "NONCE STORE";
+        }
+        return "";
+    }
+
+    // "UUL SET <nonce> <target> <key=value>... <mac>"
+    std::string control(const std::string& text){
+        strings words;
+        std::string err = authenticate(text, words, 4);
+        if (err.empty()){
+            err = Control::call(words[3], strings(words.begin() + 4, words.end()));
+        }
+        if (err == Control::PENDING) return "UUL OK pending";
+        return err.empty() ? "UUL OK" : "UUL ERR " + err;
+    }
+
+    // "UUL OTA <nonce> <size> <sha256 hex> <mac>" starts an update from
+    // the sender's address, "UUL OTA" is its state, "UUL OTA ABORT" drops it
+    std::string otaCommand(const std::string& text, const struct sockaddr_storage& source_addr){
+        std::stringstream ss(text);
+        std::string s, arg;
+        ss >> s >> s >> arg;
+        if (arg.empty()){
+            return ota.status();
+        }
+        if (arg == "ABORT"){
+            if (ota.active() && samePeer(source_addr, ota_peer)){
+                ota.abort();
+                event("ota aborted");
+            }
+            return ota.status();
+        }
+        strings words;
+        std::string err = authenticate(text, words, 5);
+        if (err.empty()){
+            err = ota.begin(strtoul(words[3].c_str(), nullptr, 10), words[4]);
+        }
+        if (!err.empty()){
+            return "UUL ERR " + err;
+        }
+        ota_peer = source_addr;
+        event("ota " + words[3] + " bytes");
+        return ota.status();
+    }
+
+    // Chunks are taken from the address that started the update only;
+    // after the end they are answered with the outcome, the last ack may
+    // have been lost
+    void otaData(int len, const struct sockaddr_storage& source_addr){
+        if (!samePeer(source_addr, ota_peer)) return;
+        uint32_t seq;
+        memcpy(&seq, rx + OTA_DATA_HEADER - 4, sizeof(seq));
+        bool ack = ota.chunk(seq, rx + OTA_DATA_HEADER, len - OTA_DATA_HEADER);
+        if (ack){
+            sendUdp(ota.status(), &ota_peer);
+        }
+    }
+
+    static bool samePeer(const struct sockaddr_storage& a, const struct sockaddr_storage& b){
+        const struct sockaddr_in* x = (const struct sockaddr_in*)&a;
+        const struct sockaddr_in* y = (const struct sockaddr_in*)&b;
+        return x->sin_addr.s_addr == y->sin_addr.s_addr && x->sin_port == y->sin_port;
+    }
+
+    // "UUL ANNOUNCE proto=1 name=uul-a1b2c3 port=60606 fw=1.0 ch=1,2,INA ip=", the
+    // address is appended when sent
+    std::string build_announce(){
+        uint8_t mac[6] = {0};
+        esp_efuse_mac_get_default(mac);
+        char name[16];
+        snprintf(name, sizeof(name), "uul-%02x%02x%02x", mac[3], mac[4], mac[5]);
+        std::string channels;
+        for (int i = Messages::LANE_INA; i < Messages::LANES; i++){
+            Messages::Lane lane = static_cast<Messages::Lane>(i);
+            bool on;
+            if (lane == Messages::LANE_CAPTURE){
+                continue;
+            }else if (lane == Messages::LANE_INA){
+                on = config.ina_i2c() != 0;
+            }else if (lane < Messages::LANE_SOFT0){
+                on = config.get_uart_io(lane - Messages::LANE_UART1 + 1) != 0;
+            }else{
+                on = config.get_soft_uart_io(lane - Messages::LANE_SOFT0) != 0;
+            }
+            if (!on) continue;
+            if (!channels.empty()) channels += ",";
+            channels += msg.source(lane);
+        }
+        return "UUL ANNOUNCE proto=" + std::to_string(UUL_PROTOCOL_VERSION)
+            + " name=" + name
+            + " port=" + std::to_string(config.port())
+            + " fw=" + esp_ota_get_app_description()->version
+            + " ch=" + channels
+            + " ip=";
+    }
+
+    // Multicast beacon on net up and every ANNOUNCE_PERIOD_MS after
+    void announce(){
+        int64_t now = esp_timer_get_time();
+        if (now < next_announce_us) return;
+        next_announce_us = now + ANNOUNCE_PERIOD_MS * 1000;
+        struct sockaddr_storage group;
+        memset(&group, 0, sizeof(group));
+        struct sockaddr_in* a = (struct sockaddr_in*)&group;
+        a->sin_family = AF_INET;
+        a->sin_addr.s_addr = inet_addr(ANNOUNCE_GROUP);
+        a->sin_port = htons(config.port() + 1);
+        sendUdp(announce_msg + ip_addr_str(&addr), &group);
+    }
+
+    // The last receiver is kept in NVS, so streaming resumes after a reset
+    // without a new START; written later by the main task
+    void save_receiver(uint64_t session_nonce){
+        struct sockaddr_in* a = (struct sockaddr_in*)&receiver;
+        config.save_receiver((uint64_t)a->sin_addr.s_addr << 16 | ntohs(a->sin_port), session_nonce);
+    }
+
+    // An encrypted session goes on under the key of this boot; without a
+    // stored boot count it could repeat an old one, a new START is needed
+    void restore_receiver(){
+        uint64_t r = config.receiver();
+        uint64_t n = config.receiver_session();
+        if (!r || (config.session_required() && !n)) return;
+        if (n){
+            if (!config.boot_counted()){
+                ESP_LOGW(TAG, "Session not restored, boot count not stored");
+                return;
+            }
+            session.start(config.control_key(), n, config.boot_count());
+        }
+        memset(&receiver, 0, sizeof(receiver));
+        struct sockaddr_in* a = (struct sockaddr_in*)&receiver;
+        a->sin_family = AF_INET;
+        a->sin_addr.s_addr = (uint32_t)(r >> 16);
+        a->sin_port = htons(r & 0xFFFF);
+        remote_addr = &receiver;
     }
 
     std::string ip_addr_str(esp_ip4_addr_t *a){
@@ -170,13 +478,23 @@ private:
     }
 
 private:
+    Config& config;
+    // the control port the socket binds, config.port()
     uint16_t port;
     esp_ip4_addr_t addr;
     static Messages msg;
     volatile bool netready = false;
     volatile int _socket = -1;
+    // data goes to the START sender, or to the port it named
     struct sockaddr_storage receiver;
     struct sockaddr_storage *remote_addr = nullptr;
+    std::string announce_msg;
+    int64_t next_announce_us = 0;
+    // a command or an update chunk with its header
+    uint8_t rx[OTA_DATA_HEADER + OTA_CHUNK];
+    Ota ota;
+    struct sockaddr_storage ota_peer;
+    Session session;
 };
 
 #endif //UDP_H
\ No newline at end of file
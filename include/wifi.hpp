@@ -1,11 +1,22 @@
 #pragma once
 
 #include "common.h"
+#include "boot.hpp"
 #include "config.hpp"
 #include "udp.hpp"
+#include <esp_timer.h>
 #include <esp_wifi.h>
 #include <freertos/event_groups.h>
 
+#define WIFI_CONNECT BIT0
+#define WIFI_GOT_IP BIT1
+// directed attempts to the cached access point before scanning
+#define WIFI_DIRECTED_TRIES 2
+#define WIFI_BACKOFF_MIN_MS 100
+#define WIFI_BACKOFF_MAX_MS 30000
+
+// Connects and keeps reconnecting for ever. The event handler only signals
+// the task, retries and their backoff run here.
 class WiFi: public Thread{
 
 public:
@@ -17,38 +28,38 @@ public:
         ESP_LOGI(TAG, "init  wifi");
         init_wifi(config);
         ESP_LOGI(TAG, "after init wifi");
-
-        /* Waiting until either the connection is established (WIFI_CONNECTED_BIT) or connection failed for the maximum
-        * number of re-tries (WIFI_FAIL_BIT). The bits are set by event_handler() (see above) */
-        EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
-                BIT0 | BIT1,
-                pdFALSE,
-                pdFALSE,
-                portMAX_DELAY);
-
-        /* xEventGroupWaitBits() returns the bits before the call returned, hence we can test which event actually
-        * happened. */
-        if (bits & BIT0) {
-            ESP_LOGI(TAG, "connected to ap SSID: %s", config.ssid().c_str());
-        } else if (bits & BIT1) {
-            ESP_LOGI(TAG, "Failed to connect to SSID: %s", config.ssid().c_str());
-        } else {
-            ESP_LOGE(TAG, "UNEXPECTED EVENT");
-        }
         while(true){
-            vTaskDelay(portMAX_DELAY);
+            EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
+                    WIFI_CONNECT | WIFI_GOT_IP,
+                    pdTRUE,
+                    pdFALSE,
+                    portMAX_DELAY);
+            if (bits & WIFI_GOT_IP) {
+                connected();
+            }
+            if (bits & WIFI_CONNECT) {
+                connect();
+            }
         }
     }
 
 private:
     void init_wifi(Config& config)
     {
-        s_wifi_event_group = xEventGroupCreate();
-
         ESP_ERROR_CHECK(esp_netif_init());
 
         ESP_ERROR_CHECK(esp_event_loop_create_default());
-        esp_netif_create_default_wifi_sta();
+        esp_netif_t* netif = esp_netif_create_default_wifi_sta();
+        // a static address skips DHCP, got ip follows the association
+        if (config.static_ip()) {
+            esp_netif_ip_info_t info;
+            info.ip.addr = config.static_ip();
+            info.gw.addr = config.static_gw();
+            info.netmask.addr = config.static_mask();
+            ESP_ERROR_CHECK(esp_netif_dhcpc_stop(netif));
+            ESP_ERROR_CHECK(esp_netif_set_ip_info(netif, &info));
+            ESP_LOGI(TAG, "static ip " IPSTR, IP2STR(&info.ip));
+        }
 
         wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
         ESP_ERROR_CHECK(esp_wifi_init(&cfg));
@@ -66,39 +77,108 @@ private:
                                                             this,
                                                             &instance_got_ip));
 
+        ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
+        down_us = esp_timer_get_time();
+        Boot::mark(Boot::WIFI_START);
+        ESP_ERROR_CHECK(esp_wifi_start() );
+
+        ESP_LOGI(TAG, "wifi_init_sta finished.");
+    }
+
+    // The cached access point first, then a full scan
+    void set_config(bool directed)
+    {
         wifi_config_t wifi_config;
         memset(&wifi_config, 0, sizeof(wifi_config_t));
         std::string& ssid = config.ssid();
-        memcpy(wifi_config.sta.ssid, ssid.c_str(), ssid.length()+1); 
+        memcpy(wifi_config.sta.ssid, ssid.c_str(), std::min(ssid.length() + 1, sizeof(wifi_config.sta.ssid)));
         std::string& pswd = config.pswd();
-        memcpy(wifi_config.sta.password, pswd.c_str(), pswd.length()+1);
+        memcpy(wifi_config.sta.password, pswd.c_str(), std::min(pswd.length() + 1, sizeof(wifi_config.sta.password)));
         wifi_config.sta.threshold.authmode = WIFI_AUTH_WPA_WPA2_PSK;
-        ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
+        if (directed) {
+            uint64_t bssid = config.ap_bssid();
+            for (int i = 0; i < 6; i++) {
+                wifi_config.sta.bssid[i] = (bssid >> (8 * (5 - i))) & 0xFF;
+            }
+            wifi_config.sta.bssid_set = true;
+            wifi_config.sta.channel = config.ap_channel();
+            wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+        } else {
+            wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+            wifi_config.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+        }
         ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
-        ESP_ERROR_CHECK(esp_wifi_start() );
+    }
 
-        ESP_LOGI(TAG, "wifi_init_sta finished.");
+    // Exponential backoff from the second scan on, never giving up
+    uint32_t backoff_ms()
+    {
+        int scans = attempt - WIFI_DIRECTED_TRIES;
+        if (scans <= 0) return 0;
+        uint32_t ms = WIFI_BACKOFF_MIN_MS << std::min(scans - 1, 16);
+        return std::min<uint32_t>(ms, WIFI_BACKOFF_MAX_MS);
+    }
+
+    void connect()
+    {
+        bool directed = config.ap_bssid() && config.ap_channel() && attempt < WIFI_DIRECTED_TRIES;
+        uint32_t wait = backoff_ms();
+        if (wait) {
+            ESP_LOGI(TAG, "retry in %d ms", wait);
+            delay(wait);
+        }
+        ESP_LOGI(TAG, "connect attempt %d, %s", attempt + 1, directed ? "directed" : "scan");
+        set_config(directed);
+        last_directed = directed;
+        attempt++;
+        esp_wifi_connect();
+    }
+
+    void connected()
+    {
+        uint32_t ms = (esp_timer_get_time() - down_us) / 1000;
+        ESP_LOGI(TAG, "connected to ap SSID: %s in %d ms, attempt %d", config.ssid().c_str(), ms, attempt);
+        Stats::set(Stats::WIFI_LAST_MS, ms);
+        Stats::high_water(Stats::WIFI_MAX_MS, ms);
+        Stats::add(Stats::WIFI_DOWN_MS, ms);
+        if (ever_connected) {
+            Stats::add(Stats::WIFI_RECONNECTS);
+        }
+        UDP::event(std::string(ever_connected ? "wifi reconnected" : "wifi connected") + " in "
+            + std::to_string(ms) + " ms, attempt " + std::to_string(attempt) + (last_directed ? " directed" : " scan"));
+        ever_connected = true;
+        attempt = 0;
+        wifi_ap_record_t ap;
+        if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+            uint64_t bssid = 0;
+            for (int i = 0; i < 6; i++) {
+                bssid = (bssid << 8) | ap.bssid[i];
+            }
+            config.save_ap(bssid, ap.primary);
+        }
     }
 
     void on_event(esp_event_base_t event_base, int32_t event_id, void* event_data){
         if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-            esp_wifi_connect();
+            xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECT);
+        } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+            Boot::mark(Boot::ASSOC);
         } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-            udp.net_end();
-            if (s_retry_num < 100) {
-                esp_wifi_connect();
-                s_retry_num++;
-                ESP_LOGI(TAG, "retry to connect to the AP");
-            } else {
-                xEventGroupSetBits(s_wifi_event_group, BIT1);
+            wifi_event_sta_disconnected_t* event = (wifi_event_sta_disconnected_t*) event_data;
+            if (online) {
+                online = false;
+                down_us = esp_timer_get_time();
+                udp.net_end();
             }
-            ESP_LOGE(TAG,"connect to the AP fail");
+            ESP_LOGE(TAG,"connect to the AP fail, reason %d", event->reason);
+            xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECT);
         } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
             ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
             ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
-            s_retry_num = 0;
-            xEventGroupSetBits(s_wifi_event_group, BIT0);
+            online = true;
+            Boot::mark(Boot::GOT_IP);
             udp.net_start(event->ip_info.ip);
+            xEventGroupSetBits(s_wifi_event_group, WIFI_GOT_IP);
         }
     }
 
@@ -111,6 +191,12 @@ private:
 private:
     Config& config;
     UDP& udp;
-    int s_retry_num = 0;
+    int attempt = 0;
+    bool last_directed = false;
+    bool ever_connected = false;
+    // touched by the event loop only
+    bool online = false;
+    // start of the current outage, the task reads it after WIFI_GOT_IP
+    int64_t down_us = 0;
     EventGroupHandle_t s_wifi_event_group;
 };
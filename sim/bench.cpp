@@ -0,0 +1,657 @@
+// Host microbenchmarks of the firmware hot paths, built with the simulator
+// over the same shims. Results are JSON, one benchmark per line, so a saved
+// run is the baseline of the next:
+//
+//   udplogger_bench -o bench.json
+//   udplogger_bench -b bench.json -t 10
+//
+// With a baseline it exits 1 when a benchmark got slower by more than the
+// threshold. Times are per operation, the best of the repetitions is
+// compared, the median shows the spread. Every benchmark also checks its
+// output once, a wrong one fails the run with or without a baseline.
+#include "boot.hpp"
+#include "config.hpp"
+#include "ina.hpp"
+#include "led.hpp"
+#include "screen.hpp"
+#include "trigger.hpp"
+#include "uart.hpp"
+#include "uart_decoder.hpp"
+#include "udp.hpp"
+#include "ina3221.hpp"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <getopt.h>
+#include <map>
+#include <thread>
+
+#define CONFIG_USER_LED 2
+#define BENCH_REPEAT 9
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
+QueueHandle_t Screen::queue = nullptr;
+QueueHandle_t Screen::log_queue = nullptr;
+std::atomic<int> Screen::log_channel{-1};
+Messages UDP::msg;
+std::atomic<uint32_t> Stats::counters[Stats::COUNTERS];
+std::atomic<uint32_t> Power::slots[3];
+std::atomic<bool> Power::valid{false};
+std::atomic<int> Power::channel{0};
+float Power::ma_lsb[3];
+float Power::v_lsb;
+Histogram Latency::stages[Latency::STAGES];
+std::atomic<uint32_t> Boot::marks[Boot::STAGES];
+
+// Keeps a result the compiler could otherwise drop
+static inline void keep(const void* p)
+{
+    asm volatile("" : : "g"(p) : "memory");
+}
+
+// A display taking every write
+class NullDevice : public sim::I2CDevice {
+public:
+    void write(const uint8_t*, size_t) override { }
+    void read(uint8_t* data, size_t len) override { memset(data, 0, len); }
+};
+
+class Bench {
+public:
+    struct Result {
+        std::string name;
+        double ns;
+        double median;
+        uint64_t iterations;
+        // payload of an operation, 0 - not a throughput benchmark
+        size_t bytes;
+        // what the check found wrong, "" - the output is right
+        std::string wrong;
+    };
+
+    // body(n) runs the operation n times
+    typedef std::function<void(uint64_t n)> Body;
+    // Looks at the output of the operation once, "" when it is right: a
+    // change that breaks it must not pass by being fast
+    typedef std::function<std::string()> Check;
+
+    struct Case {
+        std::string name;
+        Body body;
+        size_t bytes;
+        Check check;
+    };
+
+    Bench(Config& config, int rep_ms, int repeat)
+        : config(config)
+        , rep_ms(rep_ms)
+        , repeat(repeat)
+    {
+    }
+
+    // The repetitions go round the selected benchmarks, so a busy moment
+    // of the host costs one run of several, not all runs of one
+    std::vector<Result> run(const std::string& filter)
+    {
+        built = cases();
+        std::vector<Case> selected;
+        for (auto& b : built) {
+            if (b.name.find(filter) != std::string::npos) selected.push_back(b);
+        }
+        std::vector<uint64_t> n(selected.size());
+        for (size_t i = 0; i < selected.size(); i++) {
+            n[i] = calibrate(selected[i].body);
+        }
+        std::vector<std::vector<double>> ns(selected.size());
+        for (int r = 0; r < repeat; r++) {
+            for (size_t i = 0; i < selected.size(); i++) {
+                ns[i].push_back(elapsed_ns(selected[i].body, n[i]) / n[i]);
+            }
+        }
+        std::vector<Result> ret;
+        for (size_t i = 0; i < selected.size(); i++) {
+            std::sort(ns[i].begin(), ns[i].end());
+            ret.push_back({ selected[i].name, ns[i].front(), ns[i][ns[i].size() / 2], n[i], selected[i].bytes,
+                selected[i].check() });
+        }
+        return ret;
+    }
+
+private:
+    std::vector<Case> cases()
+    {
+        std::vector<Case> all;
+        add_messages(all);
+        add_uart(all);
+        add_screen(all);
+        add_ina(all);
+        add_udp(all);
+        add_session(all);
+        add_decoders(all);
+        return all;
+    }
+
+    static double elapsed_ns(const Body& body, uint64_t n)
+    {
+        auto start = std::chrono::steady_clock::now();
+        body(n);
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Iterations for a run of rep_ms: the count doubles until one takes it
+    uint64_t calibrate(const Body& body)
+    {
+        uint64_t n = 1;
+        while (elapsed_ns(body, n) < rep_ms * 1e6 && n < (1ull << 30)) {
+            n *= 2;
+        }
+        return n;
+    }
+
+    void add_messages(std::vector<Case>& all)
+    {
+        all.push_back({ "messages.stamp", [](uint64_t n) {
+            Messages& msg = UDP::messages();
+            uint16_t h = msg.buffers().alloc();
+            Buffer& b = msg.buffers()[h];
+            b.rx_us = 123456789;
+            for (uint64_t i = 0; i < n; i++) {
+                b.start = POOL_HEADROOM;
+                b.len = 64;
+                b.power = i & 1;
+                Messages::stamp(b, "1");
+                keep(b.begin());
+            }
+            msg.buffers().release(h);
+        }, 0, [] {
+            Messages& msg = UDP::messages();
+            uint16_t h = msg.buffers().alloc();
+            Buffer& b = msg.buffers()[h];
+            b.rx_us = 123456789;
+            b.start = POOL_HEADROOM;
+            b.len = 1;
+            b.power = false;
+            b.payload()[0] = 'x';
+            Messages::stamp(b, "1");
+            std::string got((const char*)b.begin(), b.len);
+            msg.buffers().release(h);
+            return got == "1 123456: x" ? "" : "stamped \"" + got + "\"";
+        } });
+        all.push_back({ "messages.enqueue_dequeue", [](uint64_t n) {
+            Messages& msg = UDP::messages();
+            Pool& pool = msg.buffers();
+            for (uint64_t i = 0; i < n; i++) {
+                uint16_t h = pool.alloc();
+                pool[h].len = 64;
+                msg.add_message(Messages::LANE_UART1, h);
+                if (msg.get_message(h)) pool.release(h);
+            }
+        }, 0, [] {
+            Messages& msg = UDP::messages();
+            Pool& pool = msg.buffers();
+            uint16_t h = pool.alloc(), got = Pool::NONE;
+            pool[h].len = 64;
+            msg.add_message(Messages::LANE_UART1, h);
+            if (!msg.get_message(got)) return std::string("nothing dequeued");
+            pool.release(got);
+            return got == h ? "" : std::string("another buffer dequeued");
+        } });
+        // both uart tasks and a soft channel against the sender, per record
+        all.push_back({ "messages.contention_3p1c", [](uint64_t n) {
+            Messages& msg = UDP::messages();
+            Pool& pool = msg.buffers();
+            std::atomic<int> producing { 3 };
+            auto producer = [&](Messages::Lane lane) {
+                for (uint64_t i = 0; i < n / 3; i++) {
+                    uint16_t h;
+                    while ((h = pool.alloc()) == Pool::NONE) {
+                        std::this_thread::yield();
+                    }
+                    pool[h].len = 64;
+                    msg.add_message(lane, h);
+                }
+                producing--;
+            };
+            std::thread p1(producer, Messages::LANE_UART1);
+            std::thread p2(producer, Messages::LANE_UART2);
+            std::thread p3(producer, Messages::soft_lane(0));
+            uint16_t h;
+            while (true) {
+                if (msg.get_message(h)) {
+                    pool.release(h);
+                } else if (!producing.load()) {
+                    break;
+                }
+            }
+            p1.join();
+            p2.join();
+            p3.join();
+            msg.clear();
+        }, 0, [this] {
+            // every record is either sent or dropped, no buffer leaks
+            Pool& pool = UDP::messages().buffers();
+            uint32_t before = Stats::get(Stats::MSG_ENQUEUED) + Stats::get(Stats::MSG_DROPPED);
+            cases_named("messages.contention_3p1c").body(300);
+            uint32_t counted = Stats::get(Stats::MSG_ENQUEUED) + Stats::get(Stats::MSG_DROPPED) - before;
+            if (counted < 300) return "300 records, " + std::to_string(counted) + " counted";
+            return pool.available() == pool.size() ? "" : std::string("buffers leaked");
+        } });
+    }
+
+    void add_uart(std::vector<Case>& all)
+    {
+        uart = std::make_unique<Uart>(config, 1);
+        all.push_back({ "uart.split_string", [this](uint64_t n) {
+            std::string cmd = "setconfig:ssid:password:60606:1052688:5654:4882:0:115200:0:8:0:0:0:key:"
+                              "Guru Meditation|WDT:30000:13107400:5000:0";
+            for (uint64_t i = 0; i < n; i++) {
+                strings s = uart->split_string(cmd);
+                keep(s.data());
+            }
+        }, 0, [this] {
+            strings s = uart->split_string("setconfig:ssid::60606:Guru Meditation|WDT");
+            return s.size() == 5 && s[2].empty() && s[4] == "Guru Meditation|WDT" ? ""
+                : std::to_string(s.size()) + " fields";
+        } });
+        all.push_back({ "uart.build_config_cmd", [this](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                // a command split over two reads
+                std::string a = uart->build_config_cmd("getcon");
+                std::string b = uart->build_config_cmd("fig\n");
+                keep(b.data());
+            }
+        }, 0, [this] {
+            std::string a = uart->build_config_cmd("getcon");
+            std::string b = uart->build_config_cmd("fig\n");
+            return a.empty() && b == "getconfig" ? "" : "\"" + a + "\", \"" + b + "\"";
+        } });
+    }
+
+    void add_screen(std::vector<Case>& all)
+    {
+        sim::i2c_attach(0, 0x3C, &display);
+        screen = std::make_unique<Screen>(config);
+        int small = screen->add_label(0, 0, 64, 0, "3.296V");
+        int large = screen->add_label(0, 24, 128, 1, "192.168.100.200");
+        all.push_back({ "screen.draw_label_7x10", [this, small](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                screen->draw_label(small);
+            }
+        }, 0, [this, small] { return check_label(small, 64); } });
+        all.push_back({ "screen.draw_label_11x18", [this, large](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                screen->draw_label(large);
+            }
+        }, 0, [this, large] { return check_label(large, 128); } });
+    }
+
+    void add_ina(std::vector<Case>& all)
+    {
+        sim::i2c_attach(1, 0x40, &ina_chip);
+        ina = std::make_unique<INA>(config);
+        all.push_back({ "ina.conv_val", [](uint64_t n) {
+            int32_t sum = 0;
+            for (uint64_t i = 0; i < n; i++) {
+                sum += INA::conv_val((uint16_t)(i * 0x9E37));
+            }
+            keep(&sum);
+        }, 0, [] {
+            // registers come big endian, the low 3 bits are not data
+            int a = INA::conv_val(0x1000), b = INA::conv_val(0x00F8);
+            return a == 2 && b == -256 ? "" : std::to_string(a) + " " + std::to_string(b);
+        } });
+        all.push_back({ "ina.format", [this](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                std::string s = ina->format(3.296 + (i & 7));
+                keep(s.data());
+            }
+        }, 0, [this] {
+            std::string a = ina->format(3.296), b = ina->format(4.0);
+            return a == "3.29" && b == "4" ? "" : a + " " + b;
+        } });
+    }
+
+    // A signed SET with a stale nonce: trimming, HMAC check and the split,
+    // then rejected before reaching the handler
+    void add_udp(std::vector<Case>& all)
+    {
+        config.set_config_control_key("bench");
+        config.set_control_nonce(1000);
+        udp = std::make_unique<UDP>(config);
+        std::string body = "UUL SET 1000 UART1 baud=57600 parity=even";
+        std::string cmd = body + " " + Control::sign("bench", body) + "\n";
+        all.push_back({ "udp.control", [this, cmd](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                std::string r = udp->control(cmd);
+                keep(r.data());
+            }
+        }, 0, [this, cmd] {
+            std::string r = udp->control(cmd);
+            return r == "UUL ERR NONCE" ? "" : r;
+        } });
+    }
+
+    // Records of 64 bytes to a local socket nobody reads: one datagram each,
+    // batched as a session does, or batched into its AES-GCM datagrams, and
+    // the sealing alone. Host AES is not the ESP32's, sealed against
+    // batched tells the share of the cipher here, not on the device
+    void add_session(std::vector<Case>& all)
+    {
+        udp->port = 0;
+        udp->createSocket();
+        sink = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+        struct sockaddr_in* a = (struct sockaddr_in*)&udp->receiver;
+        memset(&udp->receiver, 0, sizeof(udp->receiver));
+        a->sin_family = AF_INET;
+        a->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bind(sink, (struct sockaddr*)a, sizeof(*a));
+        socklen_t len = sizeof(*a);
+        getsockname(sink, (struct sockaddr*)a, &len);
+        udp->remote_addr = &udp->receiver;
+        record.assign(63, 'x');
+        record += "\n";
+        const uint8_t* rec = (const uint8_t*)record.data();
+        all.push_back({ "udp.send_plain_64", [this, rec](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                udp->sendUdp(rec, record.size(), udp->remote_addr);
+            }
+        }, record.size(), [this] { return check_sent("udp.send_plain_64", 1, record.size()); } });
+        // the batching of a session without the cipher, against sealed
+        // it leaves the cost of AES-GCM
+        all.push_back({ "udp.send_batched_64", [this, rec](uint64_t n) {
+            uint8_t batch[SESSION_BATCH];
+            size_t used = 0;
+            for (uint64_t i = 0; i < n; i++) {
+                if (used + 2 + record.size() > sizeof(batch)) {
+                    udp->sendUdp(batch, used, udp->remote_addr);
+                    used = 0;
+                }
+                batch[used++] = record.size() & 0xFF;
+                batch[used++] = record.size() >> 8;
+                memcpy(batch + used, rec, record.size());
+                used += record.size();
+            }
+            if (used) udp->sendUdp(batch, used, udp->remote_addr);
+        }, record.size(), [this] { return check_sent("udp.send_batched_64", 3, 3 * (record.size() + 2)); } });
+        udp->session.start("bench", 1, 1);
+        all.push_back({ "udp.send_sealed_64", [this, rec](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                if (!udp->session.add(rec, record.size())) {
+                    udp->sendSealed();
+                    udp->session.add(rec, record.size());
+                }
+            }
+            udp->sendSealed();
+        }, record.size(), [this] {
+            return check_sent("udp.send_sealed_64", 3, SESSION_HEADER + 3 * (record.size() + 2) + SESSION_TAG_LEN,
+                SESSION_MAGIC);
+        } });
+        size_t batch = SESSION_BATCH / (record.size() + 2) * record.size();
+        all.push_back({ "session.seal_1400", [this, rec](uint64_t n) {
+            const uint8_t* out;
+            for (uint64_t i = 0; i < n; i++) {
+                while (udp->session.add(rec, record.size())) { }
+                size_t len = udp->session.seal(out);
+                keep(&len);
+            }
+        }, batch, [this, rec] {
+            // a new IV every datagram, the counter after the boot
+            const uint8_t* out;
+            uint64_t counter[2];
+            for (auto& c : counter) {
+                udp->session.add(rec, record.size());
+                if (udp->session.seal(out) != SESSION_HEADER + record.size() + 2 + SESSION_TAG_LEN) {
+                    return std::string("wrong length");
+                }
+                memcpy(&c, out + 16, sizeof(c));
+            }
+            return counter[1] == counter[0] + 1 ? "" : std::string("IV counter did not step");
+        } });
+    }
+
+    // 512 bytes of log text through the per-byte paths of a capture task
+    void add_decoders(std::vector<Case>& all)
+    {
+        text.clear();
+        while (text.size() < 512) {
+            text += "I (12345) wifi: station connected, rssi -54, channel 6\n";
+        }
+        text.resize(512);
+        triggers.build(TRIGGERS_DEFAULT);
+        all.push_back({ "trigger.feed_512", [this](uint64_t n) {
+            uint8_t state = 0;
+            int matches = 0;
+            for (uint64_t i = 0; i < n; i++) {
+                triggers.feed(state, (const uint8_t*)text.data(), text.size(), [&](int) { matches++; });
+            }
+            keep(&matches);
+        }, 0, [this] {
+            std::string log = text + "Guru Meditation Error: Core 1 panic'ed";
+            uint8_t state = 0;
+            int matches = 0;
+            triggers.feed(state, (const uint8_t*)log.data(), log.size(), [&](int) { matches++; });
+            return matches == 1 ? "" : std::to_string(matches) + " matches";
+        } });
+        // line 0 at 8 samples a bit, idle high
+        samples.assign(16, 1);
+        for (uint8_t c : text) {
+            samples.insert(samples.end(), 8, 0);
+            for (int bit = 0; bit < 8; bit++) {
+                samples.insert(samples.end(), 8, (c >> bit) & 1);
+            }
+            samples.insert(samples.end(), 8, 1);
+        }
+        all.push_back({ "uart_decoder.decode_512", [this](uint64_t n) {
+            UartDecoder decoder;
+            uint8_t out[600];
+            for (uint64_t i = 0; i < n; i++) {
+                size_t len = decoder.decode(samples.data(), samples.size(), out, sizeof(out));
+                keep(&len);
+            }
+        }, 0, [this] {
+            UartDecoder decoder;
+            uint8_t out[600];
+            size_t len = decoder.decode(samples.data(), samples.size(), out, sizeof(out));
+            return std::string((const char*)out, len) == text ? "" : std::to_string(len) + " bytes differ";
+        } });
+    }
+
+    Case cases_named(const std::string& name)
+    {
+        for (auto& b : built) {
+            if (b.name == name) return b;
+        }
+        return { name, [](uint64_t) { }, 0, [] { return std::string(); } };
+    }
+
+    // Something drawn, nothing right of the label
+    std::string check_label(int id, int width)
+    {
+        memset(screen->buf, 0, 128 * 8);
+        screen->draw_label(id);
+        int lit = 0;
+        for (int i = 0; i < 128 * 8; i++) {
+            if (!screen->buf[i]) continue;
+            if (i % 128 >= width) return "drawn outside the label";
+            lit++;
+        }
+        return lit ? "" : std::string("nothing drawn");
+    }
+
+    // One run of n records reaches the sink as one datagram of len bytes
+    std::string check_sent(const std::string& name, uint64_t n, size_t len, const char* magic = nullptr)
+    {
+        uint8_t buf[2048];
+        while (recv(sink, buf, sizeof(buf), MSG_DONTWAIT) > 0) { }
+        cases_named(name).body(n);
+        ssize_t got = recv(sink, buf, sizeof(buf), MSG_DONTWAIT);
+        if (got != (ssize_t)len) return "got " + std::to_string(got) + " bytes, not " + std::to_string(len);
+        if (magic && memcmp(buf, magic, strlen(magic)) != 0) return std::string("no magic");
+        return recv(sink, buf, sizeof(buf), MSG_DONTWAIT) > 0 ? "more than one datagram" : "";
+    }
+
+private:
+    Config& config;
+    int rep_ms;
+    int repeat;
+    std::vector<Case> built;
+    NullDevice display;
+    sim::INA3221 ina_chip { 0.2 };
+    std::unique_ptr<Uart> uart;
+    std::unique_ptr<Screen> screen;
+    std::unique_ptr<INA> ina;
+    std::unique_ptr<UDP> udp;
+    int sink = -1;
+    std::string record;
+    Triggers triggers;
+    std::string text;
+    std::vector<uint8_t> samples;
+};
+
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -f, --filter TEXT      run the benchmarks with TEXT in the name\n"
+        "  -o, --output FILE      write the results to FILE as well\n"
+        "  -b, --baseline FILE    compare with the results in FILE\n"
+        "  -t, --threshold PCT    slower than the baseline by more fails (20)\n"
+        "  -m, --ms MS            time of a repetition (20)\n"
+        "  -r, --repeat N         repetitions of every benchmark (" STR(BENCH_REPEAT) ")\n",
+        prog);
+    exit(2);
+}
+
+static std::string to_json(const std::vector<Bench::Result>& results)
+{
+    std::string ret = "{\"benchmarks\": [\n";
+    char line[200];
+    char rate[40];
+    for (size_t i = 0; i < results.size(); i++) {
+        rate[0] = 0;
+        if (results[i].bytes) {
+            snprintf(rate, sizeof(rate), ", \"mb_per_s\": %.2f", results[i].bytes * 1e3 / results[i].ns);
+        }
+        snprintf(line, sizeof(line), "  {\"name\": \"%s\", \"ns_per_op\": %.2f, \"median_ns\": %.2f, \"iterations\": %llu%s}%s\n",
+            results[i].name.c_str(), results[i].ns, results[i].median, (unsigned long long)results[i].iterations, rate,
+            i + 1 < results.size() ? "," : "");
+        ret += line;
+    }
+    return ret + "]}\n";
+}
+
+// Name to ns of a saved run
+static std::map<std::string, double> read_baseline(const char* file)
+{
+    std::map<std::string, double> ret;
+    std::ifstream f(file);
+    if (!f) {
+        fprintf(stderr, "Can not read %s\n", file);
+        exit(2);
+    }
+    std::string line;
+    char name[64];
+    double ns;
+    while (std::getline(f, line)) {
+        if (sscanf(line.c_str(), " {\"name\": \"%63[^\"]\", \"ns_per_op\": %lf", name, &ns) == 2) {
+            ret[name] = ns;
+        }
+    }
+    return ret;
+}
+
+int main(int argc, char** argv)
+{
+    static const struct option options[] = {
+        { "filter", required_argument, nullptr, 'f' },
+        { "output", required_argument, nullptr, 'o' },
+        { "baseline", required_argument, nullptr, 'b' },
+        { "threshold", required_argument, nullptr, 't' },
+        { "ms", required_argument, nullptr, 'm' },
+        { "repeat", required_argument, nullptr, 'r' },
+        { nullptr, 0, nullptr, 0 },
+    };
+    std::string filter;
+    const char* output = nullptr;
+    const char* baseline = nullptr;
+    double threshold = 20;
+    int rep_ms = 20;
+    int repeat = BENCH_REPEAT;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f:o:b:t:m:r:", options, nullptr)) != -1) {
+        switch (opt) {
+        case 'f':
+            filter = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'b':
+            baseline = optarg;
+            break;
+        case 't':
+            threshold = atof(optarg);
+            break;
+        case 'm':
+            rep_ms = atoi(optarg);
+            if (rep_ms <= 0) usage(argv[0]);
+            break;
+        case 'r':
+            repeat = atoi(optarg);
+            if (repeat <= 0) usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    // Config complains about the empty NVS
+    esp_log_level_set("*", ESP_LOG_NONE);
+
+    Led led(static_cast<gpio_num_t>(CONFIG_USER_LED));
+    Config config(led);
+    config.set_config_wifi("bench", "bench", 60606);
+    config.set_config_ports(16 << 8 | 17 << 16, 22 | 21 << 8, 19 | 18 << 8);
+
+    Bench bench(config, rep_ms, repeat);
+    std::vector<Bench::Result> results = bench.run(filter);
+    std::string json = to_json(results);
+    fputs(json.c_str(), stdout);
+    if (output) {
+        std::ofstream(output) << json;
+    }
+    int wrong = 0;
+    for (auto& r : results) {
+        if (r.wrong.empty()) continue;
+        fprintf(stderr, "%-28s WRONG: %s\n", r.name.c_str(), r.wrong.c_str());
+        wrong++;
+    }
+    if (wrong) {
+        fprintf(stderr, "%d benchmarks with a wrong result\n", wrong);
+        return 1;
+    }
+    if (!baseline) {
+        return 0;
+    }
+
+    std::map<std::string, double> base = read_baseline(baseline);
+    int regressions = 0;
+    for (auto& r : results) {
+        auto it = base.find(r.name);
+        if (it == base.end()) {
+            fprintf(stderr, "%-28s %10.2f ns, not in the baseline\n", r.name.c_str(), r.ns);
+            continue;
+        }
+        double change = (r.ns / it->second - 1) * 100;
+        bool slow = change > threshold;
+        regressions += slow;
+        fprintf(stderr, "%-28s %10.2f ns %10.2f ns %+7.1f%%%s\n", r.name.c_str(), r.ns, it->second, change,
+            slow ? "  REGRESSION" : "");
+    }
+    if (regressions) {
+        fprintf(stderr, "%d benchmarks slower than the baseline by more than %.0f%%\n", regressions, threshold);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "waveform.hpp"
+#include <driver/i2c.h>
+#include <esp_timer.h>
+
+namespace sim {
+
+// INA3221 register model. Shunt and bus registers are sampled from the
+// waveforms when read, other registers keep what was written.
+class INA3221: public I2CDevice{
+public:
+    static constexpr double SHUNT_LSB = 40e-6;  // V
+    static constexpr double BUS_LSB = 8e-3;     // V
+
+    INA3221(double shunt_ohm): shunt_ohm(shunt_ohm) {
+        regs[0x00] = 0x7127;
+        regs[0xFE] = 0x5449;
+        regs[0xFF] = 0x3220;
+    }
+
+    void write(const uint8_t* data, size_t len) override{
+        reg = data[0];
+        if (len >= 3){
+            regs[reg] = data[1] << 8 | data[2];
+        }
+    }
+
+    void read(uint8_t* data, size_t len) override{
+        uint16_t val = value(reg);
+        for (size_t i = 0; i < len; i++){
+            data[i] = i % 2 ? val & 0xFF : val >> 8;
+        }
+    }
+
+    Waveform bus_v[3] = {Waveform(3.3), Waveform(3.3), Waveform(3.3)};
+    Waveform current_ma[3] = {Waveform(10), Waveform(10), Waveform(10)};
+
+private:
+    uint16_t value(uint8_t r){
+        if (r < 1 || r > 6) return regs[r];
+        double t = esp_timer_get_time() / 1e6;
+        int ch = (r - 1) / 2;
+        if (r % 2){
+            return encode(current_ma[ch].value(t) / 1000 * shunt_ohm / SHUNT_LSB);
+        }
+        return encode(bus_v[ch].value(t) / BUS_LSB);
+    }
+
+    // 13 bit two's complement value in bits 15..3
+    static uint16_t encode(double lsbs){
+        long v = lround(lsbs);
+        if (v > 4095) v = 4095;
+        if (v < -4096) v = -4096;
+        return (uint16_t)((uint16_t)v << 3);
+    }
+
+    double shunt_ohm;
+    uint8_t reg = 0;
+    uint16_t regs[256] = {0};
+};
+
+}
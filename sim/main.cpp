@@ -0,0 +1,171 @@
+#include "boot.hpp"
+#include "config.hpp"
+#include "ina.hpp"
+#include "led.hpp"
+#include "screen.hpp"
+#include "trigger.hpp"
+#include "uart.hpp"
+#include "udp.hpp"
+#include "ina3221.hpp"
+#include <getopt.h>
+
+#define CONFIG_USER_LED 2
+
+QueueHandle_t Screen::queue = nullptr;
+QueueHandle_t Screen::log_queue = nullptr;
+std::atomic<int> Screen::log_channel{-1};
+Messages UDP::msg;
+std::atomic<uint32_t> Stats::counters[Stats::COUNTERS];
+std::atomic<uint32_t> Power::slots[3];
+std::atomic<bool> Power::valid{false};
+std::atomic<int> Power::channel{0};
+float Power::ma_lsb[3];
+float Power::v_lsb;
+Histogram Latency::stages[Latency::STAGES];
+std::atomic<uint32_t> Boot::marks[Boot::STAGES];
+
+static TaskMemory<STACK_UDP> udp_task;
+static TaskMemory<STACK_UART> uart1_task;
+static TaskMemory<STACK_UART> uart2_task;
+static TaskMemory<STACK_INA> ina_task;
+
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -p, --port PORT       UUL control port (60606)\n"
+        "  -l, --link PREFIX     symlink UART ptys as PREFIX<port>\n"
+        "  -V, --bus CH=WAVE     INA bus voltage of channel 1..3, V\n"
+        "  -I, --current CH=WAVE INA current of channel 1..3, mA\n"
+        "  -r, --shunt OHM       INA shunt resistor (0.2)\n"
+        "  -b, --baud PORT=BAUD  target on uart PORT talks at BAUD, the port detects it\n"
+        "  -k, --key KEY         control key of signed UUL SET commands\n"
+        "  -s, --session         START and STOP only signed, the stream encrypted\n"
+        "  -q, --quiet           log warnings and errors only\n"
+        "  -v, --verbose         debug log\n"
+        "WAVE: const:V | sine:OFFSET:AMP:PERIOD | square:LOW:HIGH:PERIOD[:DUTY] | ramp:FROM:TO:PERIOD\n",
+        prog);
+    exit(1);
+}
+
+static void parse_wave(sim::Waveform* waves, const char* arg, const char* prog)
+{
+    int ch = atoi(arg);
+    const char* spec = strchr(arg, '=');
+    if (ch < 1 || ch > 3 || !spec || !waves[ch - 1].parse(spec + 1)) {
+        fprintf(stderr, "Wrong waveform %s\n", arg);
+        usage(prog);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    static const struct option options[] = {
+        { "port", required_argument, nullptr, 'p' },
+        { "link", required_argument, nullptr, 'l' },
+        { "bus", required_argument, nullptr, 'V' },
+        { "current", required_argument, nullptr, 'I' },
+        { "shunt", required_argument, nullptr, 'r' },
+        { "baud", required_argument, nullptr, 'b' },
+        { "key", required_argument, nullptr, 'k' },
+        { "session", no_argument, nullptr, 's' },
+        { "quiet", no_argument, nullptr, 'q' },
+        { "verbose", no_argument, nullptr, 'v' },
+        { nullptr, 0, nullptr, 0 },
+    };
+    int port = 60606;
+    uint8_t auto_baud = 0;
+    const char* key = "";
+    bool session = false;
+    double shunt = 0.2;
+    sim::Waveform bus[3] = { sim::Waveform(3.3), sim::Waveform(3.3), sim::Waveform(3.3) };
+    sim::Waveform current[3] = { sim::Waveform(10), sim::Waveform(10), sim::Waveform(10) };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "p:l:V:I:r:b:k:sqv", options, nullptr)) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'l':
+            sim::pty_link = optarg;
+            break;
+        case 'V':
+            parse_wave(bus, optarg, argv[0]);
+            break;
+        case 'I':
+            parse_wave(current, optarg, argv[0]);
+            break;
+        case 'r':
+            shunt = atof(optarg);
+            break;
+        case 'b': {
+            int uart = atoi(optarg);
+            const char* rate = strchr(optarg, '=');
+            if (uart < 1 || uart > 2 || !rate || atoi(rate + 1) <= 0) {
+                fprintf(stderr, "Wrong baud %s\n", optarg);
+                usage(argv[0]);
+            }
+            sim::line_baud[uart] = atoi(rate + 1);
+            auto_baud |= 1 << uart;
+            break;
+        }
+        case 'k':
+            key = optarg;
+            break;
+        case 's':
+            session = true;
+            break;
+        case 'q':
+            esp_log_level_set("*", ESP_LOG_WARN);
+            break;
+        case 'v':
+            esp_log_level_set("*", ESP_LOG_DEBUG);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    Boot::mark(Boot::APP_MAIN);
+    Led led(static_cast<gpio_num_t>(CONFIG_USER_LED));
+    Config config(led);
+    Boot::mark(Boot::CONFIG);
+    config.set_config_wifi("sim", "sim", port);
+    // uart1 rx 16, uart2 rx 17, screen 22/21, INA 19/18; pins are not used by the shims
+    config.set_config_ports(16 << 8 | 17 << 16, 22 | 21 << 8, 19 | 18 << 8);
+    config.set_config_auto_baud(auto_baud, 0);
+    config.set_config_control_key(key);
+    config.set_config_session(session);
+    uint64_t mohm = lround(shunt * 1000);
+    config.set_config_ina(INA_CONFIG_DEFAULT, mohm | mohm << 16 | mohm << 32, 0);
+
+    sim::INA3221 ina_chip(shunt);
+    for (int i = 0; i < 3; i++) {
+        ina_chip.bus_v[i] = bus[i];
+        ina_chip.current_ma[i] = current[i];
+    }
+    sim::i2c_attach(1, 0x40, &ina_chip);
+
+    // same layout as start_normal_mode, without screen and WiFi
+    Triggers::global().build(config.triggers());
+    UDP udp(config);
+    Uart uart1(config, 1);
+    Uart uart2(config, 2);
+    INA ina(config);
+    udp.start(udp_task, Thread::PRIO_NET, Thread::CORE_NET);
+    uart1.start(uart1_task, Thread::PRIO_CAPTURE, Thread::CORE_CAPTURE);
+    uart2.start(uart2_task, Thread::PRIO_CAPTURE, Thread::CORE_CAPTURE);
+    Boot::mark(Boot::CAPTURE);
+    ina.start(ina_task, Thread::PRIO_TELEMETRY, Thread::CORE_CAPTURE);
+    Boot::mark(Boot::INA);
+
+    esp_ip4_addr_t addr;
+    addr.addr = inet_addr("127.0.0.1");
+    Boot::mark(Boot::GOT_IP);
+    udp.net_start(addr);
+    while (true) {
+        vTaskDelay(1000 / portTICK_RATE_MS);
+        config.save_if_requested();
+    }
+    return 0;
+}
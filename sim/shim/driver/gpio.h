@@ -0,0 +1,50 @@
+#pragma once
+
+#include <esp_err.h>
+#include <esp_log.h>
+#include <stdint.h>
+
+typedef enum {
+    GPIO_NUM_NC = -1,
+    GPIO_NUM_0 = 0,
+    GPIO_NUM_2 = 2,
+    GPIO_NUM_MAX = 40,
+} gpio_num_t;
+
+typedef enum { GPIO_MODE_DISABLE, GPIO_MODE_INPUT, GPIO_MODE_OUTPUT } gpio_mode_t;
+typedef enum { GPIO_PULLUP_DISABLE, GPIO_PULLUP_ENABLE } gpio_pullup_t;
+typedef enum { GPIO_PULLDOWN_DISABLE, GPIO_PULLDOWN_ENABLE } gpio_pulldown_t;
+typedef enum { GPIO_INTR_DISABLE } gpio_int_type_t;
+
+typedef struct {
+    uint64_t pin_bit_mask;
+    gpio_mode_t mode;
+    gpio_pullup_t pull_up_en;
+    gpio_pulldown_t pull_down_en;
+    gpio_int_type_t intr_type;
+} gpio_config_t;
+
+#define GPIO_IS_VALID_GPIO(pin) ((pin) >= 0 && (pin) < GPIO_NUM_MAX)
+
+namespace sim {
+    // Inputs read high (button released), outputs keep what was written
+    inline int gpio_levels[GPIO_NUM_MAX];
+}
+
+inline esp_err_t gpio_config(const gpio_config_t* conf){
+    for (int i = 0; i < GPIO_NUM_MAX; i++){
+        if (conf->pin_bit_mask & (1ULL << i)) sim::gpio_levels[i] = conf->mode == GPIO_MODE_INPUT;
+    }
+    return ESP_OK;
+}
+
+inline esp_err_t gpio_set_level(gpio_num_t pin, uint32_t level){
+    if (pin < 0 || pin >= GPIO_NUM_MAX) return ESP_ERR_INVALID_ARG;
+    sim::gpio_levels[pin] = level;
+    return ESP_OK;
+}
+
+inline int gpio_get_level(gpio_num_t pin){
+    if (pin < 0 || pin >= GPIO_NUM_MAX) return 0;
+    return sim::gpio_levels[pin];
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <esp_err.h>
+#include <driver/gpio.h>
+#include <freertos/FreeRTOS.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+typedef int i2c_port_t;
+typedef enum { I2C_MODE_SLAVE, I2C_MODE_MASTER } i2c_mode_t;
+typedef enum { I2C_MASTER_ACK, I2C_MASTER_NACK, I2C_MASTER_LAST_NACK } i2c_ack_type_t;
+
+#define I2C_MASTER_WRITE 0
+#define I2C_MASTER_READ 1
+
+typedef struct {
+    i2c_mode_t mode;
+    int sda_io_num;
+    int scl_io_num;
+    gpio_pullup_t sda_pullup_en;
+    gpio_pullup_t scl_pullup_en;
+    struct {
+        uint32_t clk_speed;
+    } master;
+    uint32_t clk_flags;
+} i2c_config_t;
+
+namespace sim {
+    // Bus target model, addressed by 7 bit address
+    class I2CDevice{
+    public:
+        virtual ~I2CDevice(){}
+        virtual void write(const uint8_t* data, size_t len) = 0;
+        virtual void read(uint8_t* data, size_t len) = 0;
+    };
+
+    inline std::map<std::pair<i2c_port_t, uint8_t>, I2CDevice*> i2c_devices;
+    inline std::mutex i2c_lock;
+
+    inline void i2c_attach(i2c_port_t port, uint8_t addr, I2CDevice* dev){
+        i2c_devices[{port, addr}] = dev;
+    }
+
+    // A command link is replayed as transactions split on every start
+    struct I2COp{
+        enum { START, WRITE, READ, STOP } type;
+        std::vector<uint8_t> data;
+        uint8_t* out = nullptr;
+    };
+}
+
+typedef std::vector<sim::I2COp>* i2c_cmd_handle_t;
+
+inline esp_err_t i2c_param_config(i2c_port_t, const i2c_config_t*){
+    return ESP_OK;
+}
+
+inline esp_err_t i2c_driver_install(i2c_port_t, i2c_mode_t, size_t, size_t, int){
+    return ESP_OK;
+}
+
+inline void* i2c_cmd_link_create(){
+    return new std::vector<sim::I2COp>;
+}
+
+inline void i2c_cmd_link_delete(void* cmd){
+    delete (i2c_cmd_handle_t)cmd;
+}
+
+inline esp_err_t i2c_master_start(void* cmd){
+    ((i2c_cmd_handle_t)cmd)->push_back({sim::I2COp::START, {}});
+    return ESP_OK;
+}
+
+inline esp_err_t i2c_master_stop(void* cmd){
+    ((i2c_cmd_handle_t)cmd)->push_back({sim::I2COp::STOP, {}});
+    return ESP_OK;
+}
+
+inline esp_err_t i2c_master_write(void* cmd, const uint8_t* data, size_t len, bool){
+    ((i2c_cmd_handle_t)cmd)->push_back({sim::I2COp::WRITE, std::vector<uint8_t>(data, data + len)});
+    return ESP_OK;
+}
+
+inline esp_err_t i2c_master_write_byte(void* cmd, uint8_t data, bool ack){
+    return i2c_master_write(cmd, &data, 1, ack);
+}
+
+inline esp_err_t i2c_master_read(void* cmd, uint8_t* data, size_t len, i2c_ack_type_t){
+    sim::I2COp op{sim::I2COp::READ, std::vector<uint8_t>(len)};
+    op.out = data;
+    ((i2c_cmd_handle_t)cmd)->push_back(op);
+    return ESP_OK;
+}
+
+inline esp_err_t i2c_master_cmd_begin(i2c_port_t port, void* cmd, TickType_t){
+    // the transfer takes its time on a 400 kHz bus, 9 clocks a byte
+    size_t bytes = 0;
+    for (auto& op: *(i2c_cmd_handle_t)cmd){
+        bytes += op.data.size();
+    }
+    usleep(bytes * 9 * 1000000 / 400000);
+    std::lock_guard<std::mutex> lock(sim::i2c_lock);
+    sim::I2CDevice* dev = nullptr;
+    bool addressed = false;
+    for (auto& op: *(i2c_cmd_handle_t)cmd){
+        switch (op.type){
+        case sim::I2COp::START:
+            addressed = false;
+            break;
+        case sim::I2COp::WRITE:
+            if (!addressed){
+                auto it = sim::i2c_devices.find({port, (uint8_t)(op.data[0] >> 1)});
+                if (it == sim::i2c_devices.end()) return ESP_FAIL;
+                dev = it->second;
+                addressed = true;
+                if (op.data.size() > 1) dev->write(&op.data[1], op.data.size() - 1);
+            }else{
+                dev->write(op.data.data(), op.data.size());
+            }
+            break;
+        case sim::I2COp::READ:
+            if (!dev) return ESP_FAIL;
+            dev->read(op.out, op.data.size());
+            break;
+        case sim::I2COp::STOP:
+            break;
+        }
+    }
+    return ESP_OK;
+}
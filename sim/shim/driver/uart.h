@@ -0,0 +1,186 @@
+#pragma once
+
+#include <driver/gpio.h>
+#include <esp_err.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+
+typedef int uart_port_t;
+
+typedef enum { UART_DATA_5_BITS, UART_DATA_6_BITS, UART_DATA_7_BITS, UART_DATA_8_BITS } uart_word_length_t;
+typedef enum { UART_PARITY_DISABLE = 0, UART_PARITY_EVEN = 2, UART_PARITY_ODD = 3 } uart_parity_t;
+typedef enum { UART_STOP_BITS_1 = 1, UART_STOP_BITS_1_5 = 2, UART_STOP_BITS_2 = 3 } uart_stop_bits_t;
+typedef enum { UART_HW_FLOWCTRL_DISABLE } uart_hw_flowcontrol_t;
+typedef enum { UART_SCLK_APB, UART_SCLK_REF_TICK } uart_sclk_t;
+
+#define UART_PIN_NO_CHANGE (-1)
+
+typedef enum {
+    UART_DATA,
+    UART_BREAK,
+    UART_BUFFER_FULL,
+    UART_FIFO_OVF,
+    UART_FRAME_ERR,
+    UART_PARITY_ERR,
+    UART_DATA_BREAK,
+    UART_PATTERN_DET,
+    UART_EVENT_MAX,
+} uart_event_type_t;
+
+typedef struct {
+    uart_event_type_t type;
+    size_t size;
+    bool timeout_flag;
+} uart_event_t;
+
+typedef struct {
+    int baud_rate;
+    uart_word_length_t data_bits;
+    uart_parity_t parity;
+    uart_stop_bits_t stop_bits;
+    uart_hw_flowcontrol_t flow_ctrl;
+    uint8_t rx_flow_ctrl_thresh;
+    uart_sclk_t source_clk;
+} uart_config_t;
+
+namespace sim {
+    // Every installed UART is a pseudo-terminal. Test scripts write into the
+    // slave side, the driver reads the master side.
+    struct Pty{
+        int master = -1;
+        int slave = -1;
+        std::string path;
+        QueueHandle_t events = nullptr;
+        int baud = 115200;
+        // autobaud unit: edges seen while enabled
+        bool autobaud = false;
+        uint32_t edges = 0;
+    };
+    inline std::map<uart_port_t, Pty> uarts;
+    inline std::string pty_link;
+    // rate the simulated target talks at, per port
+    inline std::map<uart_port_t, int> line_baud;
+
+    inline int get_line_baud(uart_port_t port){
+        auto it = line_baud.find(port);
+        return it != line_baud.end() ? it->second : 115200;
+    }
+
+    // Every read at a rate other than the line rate reports a framing error
+    inline void check_rate(Pty& p, uart_port_t port){
+        if (p.baud == get_line_baud(port) || !p.events) return;
+        uart_event_t ev = {UART_FRAME_ERR, 0, false};
+        xQueueSendToBack(p.events, &ev, 0);
+    }
+
+    inline esp_err_t open_pty(uart_port_t port){
+        Pty p;
+        p.master = posix_openpt(O_RDWR | O_NOCTTY);
+        if (p.master < 0 || grantpt(p.master) || unlockpt(p.master)) return ESP_FAIL;
+        p.path = ptsname(p.master);
+        // keep the slave open so the master never sees a hangup between writers
+        p.slave = open(p.path.c_str(), O_RDWR | O_NOCTTY);
+        if (p.slave < 0) return ESP_FAIL;
+        struct termios tio;
+        tcgetattr(p.slave, &tio);
+        cfmakeraw(&tio);
+        tcsetattr(p.slave, TCSANOW, &tio);
+        if (!pty_link.empty()){
+            std::string link = pty_link + std::to_string(port);
+            unlink(link.c_str());
+            if (symlink(p.path.c_str(), link.c_str()) == 0) p.path = link;
+        }
+        uarts[port] = p;
+        printf("UART%d %s\n", port, p.path.c_str());
+        fflush(stdout);
+        return ESP_OK;
+    }
+}
+
+// A pty never overruns, the event queue stays empty
+inline esp_err_t uart_driver_install(uart_port_t port, int, int, int queue_size, QueueHandle_t* queue, int){
+    if (sim::uarts.count(port)) return ESP_ERR_INVALID_STATE;
+    QueueHandle_t events = queue ? xQueueCreate(queue_size, sizeof(uart_event_t)) : nullptr;
+    if (queue) *queue = events;
+    esp_err_t err = sim::open_pty(port);
+    if (err == ESP_OK) sim::uarts[port].events = events;
+    return err;
+}
+
+inline esp_err_t uart_param_config(uart_port_t port, const uart_config_t* cfg){
+    auto it = sim::uarts.find(port);
+    if (it == sim::uarts.end()) return ESP_ERR_INVALID_STATE;
+    it->second.baud = cfg->baud_rate;
+    return ESP_OK;
+}
+
+inline esp_err_t uart_set_baudrate(uart_port_t port, uint32_t baud){
+    auto it = sim::uarts.find(port);
+    if (it == sim::uarts.end()) return ESP_ERR_INVALID_STATE;
+    it->second.baud = baud;
+    return ESP_OK;
+}
+
+// Drops pending input; the autobaud unit sees its edges
+inline esp_err_t uart_flush_input(uart_port_t port){
+    auto it = sim::uarts.find(port);
+    if (it == sim::uarts.end()) return ESP_ERR_INVALID_STATE;
+    uint8_t buf[256];
+    struct pollfd pfd = {it->second.master, POLLIN, 0};
+    while (poll(&pfd, 1, 0) > 0){
+        int len = read(it->second.master, buf, sizeof(buf));
+        if (len <= 0) break;
+        if (it->second.autobaud) it->second.edges += len * 4;
+    }
+    return ESP_OK;
+}
+
+inline esp_err_t uart_set_pin(uart_port_t, int, int, int, int){
+    return ESP_OK;
+}
+
+// Like the driver: returns when `length` bytes are read or the timeout expires
+inline int uart_read_bytes(uart_port_t port, void* buf, uint32_t length, TickType_t ticks){
+    auto it = sim::uarts.find(port);
+    if (it == sim::uarts.end()) return -1;
+    int64_t deadline = esp_timer_get_time() / 1000 + ticks * portTICK_PERIOD_MS;
+    uint32_t got = 0;
+    while (got < length){
+        int timeout = -1;
+        if (ticks != portMAX_DELAY){
+            timeout = (int)(deadline - esp_timer_get_time() / 1000);
+            if (timeout < 0) break;
+        }
+        struct pollfd pfd = {it->second.master, POLLIN, 0};
+        if (poll(&pfd, 1, timeout) <= 0) break;
+        int len = read(it->second.master, (uint8_t*)buf + got, length - got);
+        if (len < 0) return got ? (int)got : -1;
+        got += len;
+    }
+    if (got) sim::check_rate(it->second, port);
+    return got;
+}
+
+inline esp_err_t uart_get_buffered_data_len(uart_port_t port, size_t* size){
+    auto it = sim::uarts.find(port);
+    if (it == sim::uarts.end()) return ESP_ERR_INVALID_STATE;
+    int n = 0;
+    ioctl(it->second.master, FIONREAD, &n);
+    *size = n;
+    return ESP_OK;
+}
+
+inline int uart_write_bytes(uart_port_t port, const void* src, size_t size){
+    auto it = sim::uarts.find(port);
+    if (it == sim::uarts.end()) return -1;
+    return write(it->second.master, src, size);
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "esp_err.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
+typedef const char* esp_event_base_t;
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "esp_timer.h"
+#include <stdio.h>
+#include <stdarg.h>
+
+typedef enum {
+    ESP_LOG_NONE,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+    ESP_LOG_DEBUG,
+    ESP_LOG_VERBOSE
+} esp_log_level_t;
+
+namespace sim {
+    inline esp_log_level_t log_level = ESP_LOG_INFO;
+
+    inline void log(esp_log_level_t level, const char* tag, const char* fmt, ...){
+        if (level > log_level) return;
+        static const char letters[] = "NEWIDV";
+        char line[512];
+        va_list args;
+        va_start(args, fmt);
+        vsnprintf(line, sizeof(line), fmt, args);
+        va_end(args);
+        // formatted here: glibc prints to unbuffered stderr through an 8 KB
+        // stack buffer, which would show in every task's stack use
+        char out[600];
+        int n = snprintf(out, sizeof(out), "%c (%lld) %s: %s\n", letters[level], (long long)(esp_timer_get_time() / 1000), tag, line);
+        fwrite(out, 1, n < (int)sizeof(out) ? n : sizeof(out) - 1, stderr);
+    }
+}
+
+inline void esp_log_level_set(const char*, esp_log_level_t level){
+    sim::log_level = level;
+}
+
+#define ESP_LOGE(tag, fmt, ...) sim::log(ESP_LOG_ERROR, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) sim::log(ESP_LOG_WARN, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) sim::log(ESP_LOG_INFO, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) sim::log(ESP_LOG_DEBUG, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGV(tag, fmt, ...) sim::log(ESP_LOG_VERBOSE, tag, fmt, ##__VA_ARGS__)
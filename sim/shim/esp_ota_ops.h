@@ -0,0 +1,85 @@
+#pragma once
+
+#include "esp_err.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#define ESP_ERR_OTA_BASE 0x1500
+#define ESP_ERR_OTA_VALIDATE_FAILED (ESP_ERR_OTA_BASE + 0x03)
+#define ESP_IMAGE_HEADER_MAGIC 0xE9
+#define OTA_SIZE_UNKNOWN 0xffffffff
+#define OTA_WITH_SEQUENTIAL_WRITES 0xfffffffe
+
+typedef uint32_t esp_ota_handle_t;
+
+typedef struct {
+    char version[32];
+    char project_name[32];
+} esp_app_desc_t;
+
+typedef struct {
+    uint32_t address;
+    uint32_t size;
+    char label[17];
+} esp_partition_t;
+
+inline const esp_app_desc_t* esp_ota_get_app_description(){
+    static const esp_app_desc_t desc = {"sim", "udplogger"};
+    return &desc;
+}
+
+// One update slot kept in memory; an image is valid when it starts with
+// the app image magic, which is all the sim checks
+struct SimOta{
+    std::vector<uint8_t> image;
+    size_t size = 0;
+    bool open = false;
+
+    static SimOta& get(){
+        static SimOta s;
+        return s;
+    }
+};
+
+inline const esp_partition_t* esp_ota_get_next_update_partition(const esp_partition_t*){
+    static const esp_partition_t part = {0x1F0000, 0x1E0000, "ota_1"};
+    return &part;
+}
+
+inline esp_err_t esp_ota_begin(const esp_partition_t* part, size_t size, esp_ota_handle_t* handle){
+    SimOta& s = SimOta::get();
+    if (size > part->size && size < OTA_WITH_SEQUENTIAL_WRITES) return ESP_ERR_INVALID_SIZE;
+    s.image.clear();
+    s.size = size < OTA_WITH_SEQUENTIAL_WRITES ? size : 0;
+    s.image.reserve(s.size);
+    s.open = true;
+    *handle = 1;
+    return ESP_OK;
+}
+
+inline esp_err_t esp_ota_write(esp_ota_handle_t, const void* data, size_t size){
+    SimOta& s = SimOta::get();
+    if (!s.open) return ESP_ERR_INVALID_ARG;
+    s.image.insert(s.image.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+    return ESP_OK;
+}
+
+inline esp_err_t esp_ota_abort(esp_ota_handle_t){
+    SimOta::get().open = false;
+    return ESP_OK;
+}
+
+inline esp_err_t esp_ota_end(esp_ota_handle_t){
+    SimOta& s = SimOta::get();
+    if (!s.open) return ESP_ERR_INVALID_ARG;
+    s.open = false;
+    if (s.image.empty() || s.image[0] != ESP_IMAGE_HEADER_MAGIC) return ESP_ERR_OTA_VALIDATE_FAILED;
+    return ESP_OK;
+}
+
+inline esp_err_t esp_ota_set_boot_partition(const esp_partition_t* part){
+    fprintf(stderr, "sim: boot partition %s, %zu bytes\n", part->label, SimOta::get().image.size());
+    return ESP_OK;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "esp_err.h"
+#include <stdint.h>
+#include <string.h>
+#include <malloc.h>
+#include <unistd.h>
+
+#define SIM_HEAP_SIZE (320 * 1024)
+
+// Host heap usage mapped onto an ESP32 sized heap
+inline uint32_t esp_get_free_heap_size(){
+    size_t used = mallinfo2().uordblks;
+    return used < SIM_HEAP_SIZE ? SIM_HEAP_SIZE - used : 0;
+}
+
+inline uint32_t esp_get_minimum_free_heap_size(){
+    static uint32_t min_free = SIM_HEAP_SIZE;
+    uint32_t cur = esp_get_free_heap_size();
+    if (cur < min_free) min_free = cur;
+    return min_free;
+}
+
+// Locally administered, per process, so several sims tell apart
+inline esp_err_t esp_efuse_mac_get_default(uint8_t* mac){
+    uint32_t pid = getpid();
+    uint8_t m[6] = {0x26, 0x0a, 0xc4, (uint8_t)(pid >> 16), (uint8_t)(pid >> 8), (uint8_t)pid};
+    memcpy(mac, m, 6);
+    return ESP_OK;
+}
+
+// The sim process ends, a supervisor may start it again
+[[noreturn]] inline void esp_restart(){
+    fprintf(stderr, "sim: restart\n");
+    exit(0);
+}
+
+inline void esp_fill_random(void* buf, size_t len){
+    FILE* f = fopen("/dev/urandom", "rb");
+    if (!f || fread(buf, 1, len, f) != len) abort();
+    fclose(f);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+// Microseconds since the simulator started, like esp_timer since boot
+inline int64_t esp_timer_get_time(){
+    static struct timespec start = []{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts;
+    }();
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)(ts.tv_sec - start.tv_sec) * 1000000 + (ts.tv_nsec - start.tv_nsec) / 1000;
+}
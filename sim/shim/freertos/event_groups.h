@@ -0,0 +1,52 @@
+#pragma once
+
+#include "FreeRTOS.h"
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+typedef uint32_t EventBits_t;
+
+#define BIT0 0x00000001
+#define BIT1 0x00000002
+#define BIT2 0x00000004
+#define BIT3 0x00000008
+
+struct EventGroupDef_t{
+    EventBits_t bits = 0;
+    std::mutex m;
+    std::condition_variable cv;
+};
+typedef EventGroupDef_t* EventGroupHandle_t;
+
+inline EventGroupHandle_t xEventGroupCreate(){
+    return new EventGroupDef_t;
+}
+
+inline EventBits_t xEventGroupSetBits(EventGroupHandle_t g, EventBits_t bits){
+    std::lock_guard<std::mutex> lock(g->m);
+    g->bits |= bits;
+    g->cv.notify_all();
+    return g->bits;
+}
+
+inline EventBits_t xEventGroupClearBits(EventGroupHandle_t g, EventBits_t bits){
+    std::lock_guard<std::mutex> lock(g->m);
+    EventBits_t ret = g->bits;
+    g->bits &= ~bits;
+    return ret;
+}
+
+inline EventBits_t xEventGroupWaitBits(EventGroupHandle_t g, EventBits_t bits, BaseType_t clear,
+                                       BaseType_t all, TickType_t ticks){
+    std::unique_lock<std::mutex> lock(g->m);
+    auto ready = [&]{ return all ? (g->bits & bits) == bits : (g->bits & bits) != 0; };
+    if (ticks == portMAX_DELAY){
+        g->cv.wait(lock, ready);
+    }else{
+        g->cv.wait_for(lock, std::chrono::milliseconds(ticks * portTICK_PERIOD_MS), ready);
+    }
+    EventBits_t ret = g->bits;
+    if (clear && ready()) g->bits &= ~bits;
+    return ret;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "FreeRTOS.h"
+#include <string.h>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+// Fixed-size ring of items copied by value, like a FreeRTOS queue
+struct QueueDefinition{
+    QueueDefinition(UBaseType_t length, UBaseType_t item_size)
+        : length(length), item_size(item_size), data(length * item_size) {}
+
+    bool wait(std::unique_lock<std::mutex>& lock, std::condition_variable& cv,
+              TickType_t ticks, bool (QueueDefinition::*ready)()){
+        if (ticks == portMAX_DELAY){
+            cv.wait(lock, [&]{ return (this->*ready)(); });
+            return true;
+        }
+        // a poll, a zero wait_for still sleeps the timer slack
+        if (!ticks){
+            return (this->*ready)();
+        }
+        return cv.wait_for(lock, std::chrono::milliseconds(ticks * portTICK_PERIOD_MS),
+                           [&]{ return (this->*ready)(); });
+    }
+    bool has_items(){ return count > 0; }
+    bool has_space(){ return count < length; }
+
+    UBaseType_t length;
+    UBaseType_t item_size;
+    std::vector<uint8_t> data;
+    UBaseType_t head = 0;
+    UBaseType_t count = 0;
+    std::mutex m;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+};
+typedef QueueDefinition* QueueHandle_t;
+
+inline QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size){
+    return new QueueDefinition(length, item_size);
+}
+
+inline void vQueueDelete(QueueHandle_t q){
+    delete q;
+}
+
+inline BaseType_t xQueueGenericSend(QueueHandle_t q, const void* item, TickType_t ticks, bool front){
+    std::unique_lock<std::mutex> lock(q->m);
+    if (!q->wait(lock, q->not_full, ticks, &QueueDefinition::has_space)) return pdFALSE;
+    UBaseType_t pos;
+    if (front){
+        q->head = (q->head + q->length - 1) % q->length;
+        pos = q->head;
+    }else{
+        pos = (q->head + q->count) % q->length;
+    }
+    if (q->item_size) memcpy(&q->data[pos * q->item_size], item, q->item_size);
+    q->count++;
+    q->not_empty.notify_one();
+    return pdTRUE;
+}
+
+inline BaseType_t xQueueSendToBack(QueueHandle_t q, const void* item, TickType_t ticks){
+    return xQueueGenericSend(q, item, ticks, false);
+}
+
+inline BaseType_t xQueueSendToFront(QueueHandle_t q, const void* item, TickType_t ticks){
+    return xQueueGenericSend(q, item, ticks, true);
+}
+
+inline BaseType_t xQueueSend(QueueHandle_t q, const void* item, TickType_t ticks){
+    return xQueueGenericSend(q, item, ticks, false);
+}
+
+// Replaces the item of a one item queue, never blocks
+inline BaseType_t xQueueOverwrite(QueueHandle_t q, const void* item){
+    std::unique_lock<std::mutex> lock(q->m);
+    if (q->item_size) memcpy(&q->data[q->head * q->item_size], item, q->item_size);
+    q->count = 1;
+    q->not_empty.notify_one();
+    return pdTRUE;
+}
+
+inline BaseType_t xQueueReceive(QueueHandle_t q, void* item, TickType_t ticks){
+    std::unique_lock<std::mutex> lock(q->m);
+    if (!q->wait(lock, q->not_empty, ticks, &QueueDefinition::has_items)) return pdFALSE;
+    if (q->item_size) memcpy(item, &q->data[q->head * q->item_size], q->item_size);
+    q->head = (q->head + 1) % q->length;
+    q->count--;
+    q->not_full.notify_one();
+    return pdTRUE;
+}
+
+inline UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q){
+    std::lock_guard<std::mutex> lock(q->m);
+    return q->count;
+}
+
+inline UBaseType_t uxQueueSpacesAvailable(QueueHandle_t q){
+    std::lock_guard<std::mutex> lock(q->m);
+    return q->length - q->count;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "queue.h"
+
+// A mutex is a one item queue holding the token, as in FreeRTOS
+typedef QueueHandle_t SemaphoreHandle_t;
+
+inline SemaphoreHandle_t xSemaphoreCreateMutex(){
+    QueueHandle_t q = xQueueCreate(1, 0);
+    xQueueSend(q, nullptr, 0);
+    return q;
+}
+
+inline SemaphoreHandle_t xSemaphoreCreateBinary(){
+    return xQueueCreate(1, 0);
+}
+
+#define xSemaphoreTake(sem, ticks) xQueueReceive((sem), nullptr, (ticks))
+#define xSemaphoreGive(sem) xQueueSend((sem), nullptr, 0)
+#define vSemaphoreDelete(sem) vQueueDelete(sem)
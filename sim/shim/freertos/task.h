@@ -0,0 +1,107 @@
+#pragma once
+
+#include "FreeRTOS.h"
+#include <esp_timer.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+typedef void (*TaskFunction_t)(void*);
+
+// Host stacks are this much larger than the budget, they only measure
+#define SIM_STACK_SCALE 4
+#define SIM_STACK_MIN (256 * 1024)
+#define SIM_STACK_FILL 0xA5
+
+struct tskTaskControlBlock{
+    pthread_t thread;
+    uint32_t stack;
+    TaskFunction_t fn;
+    void* arg;
+    // painted host stack and the stack pointer the task started with
+    uint8_t* mem;
+    size_t mem_size;
+    std::atomic<uint8_t*> top{nullptr};
+};
+typedef tskTaskControlBlock* TaskHandle_t;
+
+inline void* sim_task_entry(void* p){
+    TaskHandle_t task = (TaskHandle_t)p;
+    uint8_t here;
+    task->top = &here;
+    task->fn(task->arg);
+    return nullptr;
+}
+
+// Tasks are detached threads on painted stacks, so the high-water mark
+// is measured; priority is left to the host scheduler
+inline BaseType_t xTaskCreate(TaskFunction_t fn, const char* name, uint32_t stack, void* arg,
+                              UBaseType_t, TaskHandle_t* handle){
+    TaskHandle_t task = new tskTaskControlBlock();
+    task->stack = stack;
+    task->fn = fn;
+    task->arg = arg;
+    task->mem_size = std::max<size_t>((size_t)stack * SIM_STACK_SCALE, SIM_STACK_MIN);
+    task->mem = (uint8_t*)aligned_alloc(4096, task->mem_size);
+    memset(task->mem, SIM_STACK_FILL, task->mem_size);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstack(&attr, task->mem, task->mem_size);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&task->thread, &attr, sim_task_entry, task);
+    pthread_attr_destroy(&attr);
+    if (err) return pdFAIL;
+    char tname[16] = {0};
+    snprintf(tname, sizeof(tname), "%s", name);
+    pthread_setname_np(task->thread, tname);
+    if (handle) *handle = task;
+    return pdPASS;
+}
+
+#define tskNO_AFFINITY 0x7FFFFFFF
+#define PRO_CPU_NUM 0
+#define APP_CPU_NUM 1
+
+struct StaticTask_t{
+    tskTaskControlBlock tcb;
+};
+
+// Host threads float over all cpus
+inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char* name, uint32_t stack, void* arg,
+                                          UBaseType_t priority, TaskHandle_t* handle, BaseType_t){
+    return xTaskCreate(fn, name, stack, arg, priority, handle);
+}
+
+// Host threads keep their own stacks, the buffer only marks the size
+inline TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t fn, const char* name, uint32_t stack, void* arg,
+                                                  UBaseType_t priority, StackType_t*, StaticTask_t*, BaseType_t){
+    TaskHandle_t handle = nullptr;
+    xTaskCreate(fn, name, stack, arg, priority, &handle);
+    return handle;
+}
+
+inline void vTaskDelay(TickType_t ticks){
+    if (ticks == portMAX_DELAY){
+        while(true) std::this_thread::sleep_for(std::chrono::hours(1));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks * portTICK_PERIOD_MS));
+}
+
+// Budget less the deepest the host stack was touched below the task
+// entry, 0 when it went over
+inline UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task){
+    uint8_t* top = task->top.load();
+    if (!top) return task->stack;
+    uint8_t* p = task->mem;
+    while (p < top && *p == SIM_STACK_FILL) p++;
+    size_t used = top - p;
+    return used < task->stack ? task->stack - used : 0;
+}
+
+inline TickType_t xTaskGetTickCount(){
+    return (TickType_t)(esp_timer_get_time() / 1000 / portTICK_PERIOD_MS);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <driver/uart.h>
+#include <soc/soc.h>
+
+// Autobaud registers of a port. Pulse widths follow the simulated line
+// rate, edges are counted from the data flushed while detecting.
+typedef struct {
+    uart_port_t port;
+} uart_dev_t;
+
+namespace sim {
+    inline uart_dev_t uart_hw[3] = {{0}, {1}, {2}};
+}
+
+#define UART_LL_GET_HW(num) (&sim::uart_hw[(num)])
+
+static inline void uart_ll_set_autobaud_en(uart_dev_t* hw, bool enable){
+    sim::Pty& p = sim::uarts[hw->port];
+    p.autobaud = enable;
+    if (enable) p.edges = 0;
+}
+
+static inline uint32_t uart_ll_get_rxd_edge_cnt(uart_dev_t* hw){
+    return sim::uarts[hw->port].edges;
+}
+
+static inline uint32_t uart_ll_get_low_pulse_cnt(uart_dev_t* hw){
+    return APB_CLK_FREQ / sim::get_line_baud(hw->port) - 1;
+}
+
+static inline uint32_t uart_ll_get_high_pulse_cnt(uart_dev_t* hw){
+    return APB_CLK_FREQ / sim::get_line_baud(hw->port) - 1;
+}
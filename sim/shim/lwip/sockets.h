@@ -0,0 +1,12 @@
+#pragma once
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+inline char* inet_ntoa_r(struct in_addr addr, char* buf, int buflen){
+    return (char*)inet_ntop(AF_INET, &addr, buf, buflen);
+}
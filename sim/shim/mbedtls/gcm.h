@@ -0,0 +1,50 @@
+#pragma once
+
+#include <openssl/evp.h>
+#include <string.h>
+
+// The mbedtls AES-GCM calls used by the firmware, over OpenSSL
+#define MBEDTLS_GCM_ENCRYPT 1
+typedef enum { MBEDTLS_CIPHER_ID_AES = 2 } mbedtls_cipher_id_t;
+
+typedef struct {
+    EVP_CIPHER_CTX* ctx;
+    unsigned char key[32];
+    unsigned int keybits;
+} mbedtls_gcm_context;
+
+inline void mbedtls_gcm_init(mbedtls_gcm_context* c){
+    c->ctx = EVP_CIPHER_CTX_new();
+    c->keybits = 0;
+}
+
+inline void mbedtls_gcm_free(mbedtls_gcm_context* c){
+    EVP_CIPHER_CTX_free(c->ctx);
+    c->ctx = nullptr;
+}
+
+inline int mbedtls_gcm_setkey(mbedtls_gcm_context* c, mbedtls_cipher_id_t, const unsigned char* key, unsigned int keybits){
+    if (keybits != 128 && keybits != 256) return -1;
+    memcpy(c->key, key, keybits / 8);
+    c->keybits = keybits;
+    return 0;
+}
+
+inline int mbedtls_gcm_crypt_and_tag(mbedtls_gcm_context* c, int mode, size_t length,
+                                     const unsigned char* iv, size_t iv_len,
+                                     const unsigned char* add, size_t add_len,
+                                     const unsigned char* input, unsigned char* output,
+                                     size_t tag_len, unsigned char* tag){
+    const EVP_CIPHER* cipher = c->keybits == 128 ? EVP_aes_128_gcm() : EVP_aes_256_gcm();
+    int len;
+    if (!EVP_CipherInit_ex(c->ctx, cipher, nullptr, nullptr, nullptr, mode)
+        || !EVP_CIPHER_CTX_ctrl(c->ctx, EVP_CTRL_GCM_SET_IVLEN, (int)iv_len, nullptr)
+        || !EVP_CipherInit_ex(c->ctx, nullptr, nullptr, c->key, iv, mode)
+        || !EVP_CipherUpdate(c->ctx, nullptr, &len, add, (int)add_len)
+        || !EVP_CipherUpdate(c->ctx, output, &len, input, (int)length)
+        || !EVP_CipherFinal_ex(c->ctx, output + len, &len)
+        || !EVP_CIPHER_CTX_ctrl(c->ctx, EVP_CTRL_GCM_GET_TAG, (int)tag_len, tag)){
+        return -1;
+    }
+    return 0;
+}
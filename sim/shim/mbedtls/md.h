@@ -0,0 +1,19 @@
+#pragma once
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+// The mbedtls message digest calls used by the firmware, over OpenSSL
+typedef enum { MBEDTLS_MD_NONE = 0, MBEDTLS_MD_SHA256 = 6 } mbedtls_md_type_t;
+typedef struct mbedtls_md_info_t mbedtls_md_info_t;
+
+inline const mbedtls_md_info_t* mbedtls_md_info_from_type(mbedtls_md_type_t type){
+    return type == MBEDTLS_MD_SHA256 ? (const mbedtls_md_info_t*)EVP_sha256() : nullptr;
+}
+
+inline int mbedtls_md_hmac(const mbedtls_md_info_t* info, const unsigned char* key, size_t keylen,
+                           const unsigned char* input, size_t ilen, unsigned char* output){
+    if (!info) return -1;
+    unsigned int len = 0;
+    return HMAC((const EVP_MD*)info, key, (int)keylen, input, ilen, output, &len) ? 0 : -1;
+}
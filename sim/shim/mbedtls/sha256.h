@@ -0,0 +1,29 @@
+#pragma once
+
+#include <openssl/evp.h>
+
+// The mbedtls SHA-256 calls used by the firmware, over OpenSSL
+typedef struct {
+    EVP_MD_CTX* ctx;
+} mbedtls_sha256_context;
+
+inline void mbedtls_sha256_init(mbedtls_sha256_context* c){
+    c->ctx = EVP_MD_CTX_new();
+}
+
+inline void mbedtls_sha256_free(mbedtls_sha256_context* c){
+    EVP_MD_CTX_free(c->ctx);
+    c->ctx = nullptr;
+}
+
+inline int mbedtls_sha256_starts_ret(mbedtls_sha256_context* c, int is224){
+    return EVP_DigestInit_ex(c->ctx, is224 ? EVP_sha224() : EVP_sha256(), nullptr) ? 0 : -1;
+}
+
+inline int mbedtls_sha256_update_ret(mbedtls_sha256_context* c, const unsigned char* input, size_t ilen){
+    return EVP_DigestUpdate(c->ctx, input, ilen) ? 0 : -1;
+}
+
+inline int mbedtls_sha256_finish_ret(mbedtls_sha256_context* c, unsigned char output[32]){
+    return EVP_DigestFinal_ex(c->ctx, output, nullptr) ? 0 : -1;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "esp_err.h"
+
+typedef enum { NVS_READONLY, NVS_READWRITE } nvs_open_mode_t;
+
+inline esp_err_t nvs_flash_init(){
+    return ESP_OK;
+}
+
+inline esp_err_t nvs_flash_erase(){
+    return ESP_OK;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "nvs_flash.h"
+#include <string.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace nvs {
+
+enum class ItemType : uint8_t { U8, I8, U16, I16, U32, I32, U64, I64, SZ, BLOB, ANY };
+
+// In-memory storage: namespace -> key -> raw value bytes
+inline std::map<std::string, std::map<std::string, std::string>> storage;
+inline std::mutex storage_lock;
+
+class NVSHandle{
+public:
+    NVSHandle(const std::string& ns): ns(ns){}
+
+    template<typename T> esp_err_t set_item(const char* key, T value){
+        return set_raw(key, std::string((const char*)&value, sizeof(T)));
+    }
+
+    template<typename T> esp_err_t get_item(const char* key, T& value){
+        std::string raw;
+        esp_err_t err = get_raw(key, raw);
+        if (err != ESP_OK) return err;
+        if (raw.size() != sizeof(T)) return ESP_ERR_NVS_TYPE_MISMATCH;
+        memcpy(&value, raw.data(), sizeof(T));
+        return ESP_OK;
+    }
+
+    esp_err_t set_string(const char* key, const char* value){
+        return set_raw(key, std::string(value, strlen(value) + 1));
+    }
+
+    esp_err_t get_string(const char* key, char* out, size_t len){
+        std::string raw;
+        esp_err_t err = get_raw(key, raw);
+        if (err != ESP_OK) return err;
+        if (raw.size() > len) return ESP_ERR_NVS_INVALID_LENGTH;
+        memcpy(out, raw.data(), raw.size());
+        return ESP_OK;
+    }
+
+    esp_err_t set_blob(const char* key, const void* blob, size_t len){
+        return set_raw(key, std::string((const char*)blob, len));
+    }
+
+    esp_err_t get_blob(const char* key, void* out, size_t len){
+        return get_string(key, (char*)out, len);
+    }
+
+    esp_err_t get_item_size(ItemType, const char* key, size_t& size){
+        std::string raw;
+        esp_err_t err = get_raw(key, raw);
+        size = raw.size();
+        return err;
+    }
+
+    esp_err_t erase_item(const char* key){
+        std::lock_guard<std::mutex> lock(storage_lock);
+        return storage[ns].erase(key) ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+    }
+
+    esp_err_t commit(){
+        return ESP_OK;
+    }
+
+private:
+    esp_err_t set_raw(const char* key, const std::string& raw){
+        std::lock_guard<std::mutex> lock(storage_lock);
+        storage[ns][key] = raw;
+        return ESP_OK;
+    }
+
+    esp_err_t get_raw(const char* key, std::string& raw){
+        std::lock_guard<std::mutex> lock(storage_lock);
+        auto& items = storage[ns];
+        auto it = items.find(key);
+        if (it == items.end()) return ESP_ERR_NVS_NOT_FOUND;
+        raw = it->second;
+        return ESP_OK;
+    }
+
+    std::string ns;
+};
+
+inline std::unique_ptr<NVSHandle> open_nvs_handle(const char* ns, nvs_open_mode_t, esp_err_t* err = nullptr){
+    if (err) *err = ESP_OK;
+    return std::unique_ptr<NVSHandle>(new NVSHandle(ns));
+}
+
+}
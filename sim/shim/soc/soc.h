@@ -0,0 +1,3 @@
+#pragma once
+
+#define APB_CLK_FREQ (80 * 1000000)
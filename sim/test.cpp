@@ -0,0 +1,480 @@
+// Host tests of the firmware classes, built with the simulator over the
+// same shims and run by ctest. Prints every failed expectation and exits 1
+// on any, a name on the command line runs only the tests starting with it:
+//
+//   udplogger_test
+//   udplogger_test decoder
+#include "trigger.hpp"
+#include "uart_decoder.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <set>
+#include <string>
+#include <vector>
+
+QueueHandle_t Screen::queue = nullptr;
+QueueHandle_t Screen::log_queue = nullptr;
+std::atomic<int> Screen::log_channel{-1};
+Messages UDP::msg;
+std::atomic<uint32_t> Stats::counters[Stats::COUNTERS];
+Histogram Latency::stages[Latency::STAGES];
+
+static int failed = 0;
+
+#define EXPECT(x) do { \
+        if (!(x)){ \
+            printf("%s:%d: %s\n", __FILE__, __LINE__, #x); \
+            failed++; \
+        } \
+    } while (0)
+
+// UartDecoder
+
+// Samples of a line at `rate` carrying `baud`, levels are placed by their
+// time so the bits fall on fractional sample positions
+struct Line {
+    uint32_t rate;
+    uint32_t baud;
+    uint8_t mask = 1;
+    std::vector<uint8_t> samples;
+    double end = 0;
+
+    void level(bool high, double bits){
+        end += bits;
+        while ((double)samples.size() * baud < end * rate) samples.push_back(high ? mask : 0);
+    }
+
+    void frame(uint8_t b, bool stop = true){
+        level(false, 1);
+        for (int i = 0; i < 8; i++) level(b >> i & 1, 1);
+        level(stop, 1);
+    }
+
+    void send(const std::string& s, double idle = 1.5){
+        for (uint8_t c : s){
+            level(true, idle);
+            frame(c);
+        }
+        level(true, 2);
+    }
+};
+
+static std::string decode(UartDecoder& d, const Line& l, size_t from, size_t to, size_t cap = 256){
+    uint8_t out[256];
+    size_t n = d.decode(l.samples.data() + from, to - from, out, cap);
+    return std::string((const char*)out, n);
+}
+
+static void decoder_bytes()
+{
+    const std::string text("Hello\x00\xff\x55\xaa", 9);
+    for (uint32_t baud : {9600u, 115200u, 250000u}){
+        Line l{1000000, baud};
+        l.send(text);
+        UartDecoder d(0, l.rate, l.baud);
+        EXPECT(decode(d, l, 0, l.samples.size()) == text);
+        EXPECT(d.bytes == text.size());
+        EXPECT(d.framing_errors == 0);
+        EXPECT(d.overflows == 0);
+    }
+}
+
+static void decoder_back_to_back()
+{
+    // stop bit straight into the next start bit
+    Line l{1000000, 115200};
+    l.level(true, 2);
+    l.send("0123456789", 0);
+    UartDecoder d(0, l.rate, l.baud);
+    EXPECT(decode(d, l, 0, l.samples.size()) == "0123456789");
+}
+
+static void decoder_framing()
+{
+    Line l{1000000, 115200};
+    l.send("a");
+    l.frame('x', false);
+    // a low line after a bad stop bit starts nothing until it goes high
+    l.level(false, 12);
+    l.send("b");
+    UartDecoder d(0, l.rate, l.baud);
+    EXPECT(decode(d, l, 0, l.samples.size()) == "ab");
+    EXPECT(d.framing_errors == 1);
+    EXPECT(d.bytes == 2);
+}
+
+static void decoder_wait_idle()
+{
+    // a decoder starting on a low line does not take it for a start bit
+    Line l{1000000, 115200};
+    l.level(false, 5);
+    l.send("z");
+    UartDecoder d(0, l.rate, l.baud);
+    EXPECT(decode(d, l, 0, l.samples.size()) == "z");
+    EXPECT(d.framing_errors == 0);
+}
+
+static void decoder_glitch()
+{
+    // a low pulse shorter than half a bit is not a start bit
+    Line l{1000000, 9600};
+    l.level(true, 2);
+    l.level(false, 0.3);
+    l.send("g");
+    UartDecoder d(0, l.rate, l.baud);
+    EXPECT(decode(d, l, 0, l.samples.size()) == "g");
+    EXPECT(d.bytes == 1);
+    EXPECT(d.framing_errors == 0);
+}
+
+static void decoder_overflow()
+{
+    Line l{1000000, 115200};
+    l.send("0123456789");
+    UartDecoder d(0, l.rate, l.baud);
+    EXPECT(decode(d, l, 0, l.samples.size(), 4) == "0123");
+    EXPECT(d.bytes == 10);
+    EXPECT(d.overflows == 6);
+    // the next buffer has room again
+    Line m{1000000, 115200};
+    m.send("ab");
+    EXPECT(decode(d, m, 0, m.samples.size(), 4) == "ab");
+    EXPECT(d.overflows == 6);
+}
+
+static void decoder_split()
+{
+    // every split point, so one lands in each bit of a frame
+    Line l{1000000, 115200};
+    l.send("Ux\x81");
+    for (size_t at = 0; at <= l.samples.size(); at++){
+        UartDecoder d(0, l.rate, l.baud);
+        std::string got = decode(d, l, 0, at);
+        got += decode(d, l, at, l.samples.size());
+        EXPECT(got == "Ux\x81");
+        EXPECT(d.framing_errors == 0);
+        if (got != "Ux\x81"){
+            printf("  split at sample %zu\n", at);
+            break;
+        }
+    }
+    // and a buffer per sample
+    UartDecoder d(0, l.rate, l.baud);
+    std::string got;
+    for (size_t i = 0; i < l.samples.size(); i++) got += decode(d, l, i, i + 1);
+    EXPECT(got == "Ux\x81");
+}
+
+static void decoder_lines()
+{
+    // line 5 between noise on the other bits of the sample
+    Line l{1000000, 115200};
+    l.mask = 1 << 5;
+    l.send("line");
+    for (size_t i = 0; i < l.samples.size(); i++) l.samples[i] |= (i * 37 + i / 3) & ~l.mask;
+    UartDecoder d(5, l.rate, l.baud);
+    EXPECT(decode(d, l, 0, l.samples.size()) == "line");
+}
+
+// Triggers
+
+// Matches as "<end>:<pattern>" in the order reported, from feeding
+// `data` in pieces of `step` bytes. feed() gives no offset, the end is
+// that of the piece, so a step of 1 is exact.
+static std::vector<std::string> matches(const Triggers& t, const std::string& data, size_t step){
+    std::vector<std::string> got;
+    uint8_t state = 0;
+    for (size_t at = 0; at < data.size(); at += step){
+        size_t end = std::min(at + step, data.size());
+        t.feed(state, (const uint8_t*)data.data() + at, end - at, [&](int i){
+            got.push_back(std::to_string(end) + ":" + t.pattern(i));
+        });
+    }
+    return got;
+}
+
+// The same by brute force: by end, then by pattern index
+static std::vector<std::string> naive(const std::vector<std::string>& patterns, const std::string& data, size_t step){
+    std::vector<std::string> got;
+    for (size_t end = 1; end <= data.size(); end++){
+        size_t piece = std::min((end + step - 1) / step * step, data.size());
+        for (auto& p : patterns){
+            if (p.size() <= end && data.compare(end - p.size(), p.size(), p) == 0){
+                got.push_back(std::to_string(piece) + ":" + p);
+            }
+        }
+    }
+    return got;
+}
+
+static std::vector<std::string> list(std::initializer_list<const char*> l){
+    return std::vector<std::string>(l.begin(), l.end());
+}
+
+static void trigger_overlapping()
+{
+    Triggers t;
+    EXPECT(t.build("abab|bab|ab"));
+    EXPECT(matches(t, "xababab", 1) == list({"3:ab", "5:abab", "5:bab", "5:ab", "7:abab", "7:bab", "7:ab"}));
+}
+
+static void trigger_same_end()
+{
+    // she, he and e all end at the e, hers later
+    Triggers t;
+    EXPECT(t.build("he|she|hers|e"));
+    EXPECT(matches(t, "ushers", 1) == list({"4:he", "4:she", "4:e", "6:hers"}));
+}
+
+static void trigger_split()
+{
+    // the state carried between calls finishes a match begun in the last
+    Triggers t;
+    EXPECT(t.build("ERROR|panic"));
+    const std::string data = "log: ERR";
+    uint8_t state = 0;
+    int hits = 0;
+    t.feed(state, (const uint8_t*)data.data(), data.size(), [&](int){ hits++; });
+    EXPECT(hits == 0);
+    EXPECT(state != 0);
+    t.feed(state, (const uint8_t*)"OR", 2, [&](int i){ hits++; EXPECT(t.pattern(i) == "ERROR"); });
+    EXPECT(hits == 1);
+    // a fresh state does not
+    uint8_t fresh = 0;
+    t.feed(fresh, (const uint8_t*)"OR", 2, [&](int){ hits++; });
+    EXPECT(hits == 1);
+}
+
+static void trigger_random()
+{
+    // against brute force, small alphabet for many overlaps, every piece size
+    uint32_t seed = 1;
+    auto rnd = [&](uint32_t n){ seed = seed * 1103515245 + 12345; return (seed >> 16) % n; };
+    for (int round = 0; round < 200; round++){
+        std::vector<std::string> patterns;
+        std::string spec;
+        for (uint32_t i = 0, n = 1 + rnd(6); i < n; i++){
+            std::string p;
+            for (uint32_t j = 0, len = 1 + rnd(5); j < len; j++) p += "abc\n"[rnd(4)];
+            patterns.push_back(p);
+            spec += (i ? "|" : "") + p;
+        }
+        std::string data;
+        for (int i = 0; i < 64; i++) data += "abcx\n\xff"[rnd(6)];
+        Triggers t;
+        t.build(spec);
+        for (size_t step : {1, 3, 7, 64}){
+            EXPECT(matches(t, data, step) == naive(patterns, data, step));
+        }
+    }
+}
+
+// Messages
+
+// Records in the order the sender gets them, as "<source> <text>"
+static std::vector<std::string> drain(Messages& m){
+    std::vector<std::string> got;
+    uint16_t h;
+    while (m.get_message(h)){
+        Buffer& b = m.buffers()[h];
+        std::string r((const char*)b.begin(), b.len);
+        got.push_back(r.substr(0, r.find(' ')) + " " + r.substr(r.find(": ") + 2));
+        m.buffers().release(h);
+    }
+    return got;
+}
+
+// "<source> <prefix><from>" .. "<source> <prefix><to - 1>"
+static std::vector<std::string> records(const char* source, const char* prefix, int from, int to){
+    std::vector<std::string> ret;
+    for (int i = from; i < to; i++) ret.push_back(std::string(source) + " " + prefix + std::to_string(i));
+    return ret;
+}
+
+static std::vector<std::string> operator+(std::vector<std::string> a, const std::vector<std::string>& b){
+    a.insert(a.end(), b.begin(), b.end());
+    return a;
+}
+
+static bool has(const std::string& s, const std::string& part){
+    return s.find(part) != std::string::npos;
+}
+
+static void messages_drop_newest()
+{
+    // capture lane: 16 deep
+    Messages m;
+    for (int i = 0; i < 20; i++) m.add_message(Messages::LANE_CAPTURE, "c" + std::to_string(i));
+    EXPECT(drain(m) == records("CAP", "c", 0, 16));
+    EXPECT(has(m.snapshot(), " lane.CAP=16/4/0"));
+}
+
+static void messages_drop_oldest()
+{
+    // events lane: 8 deep
+    Messages m;
+    for (int i = 0; i < 12; i++) m.add_message(Messages::LANE_EVENTS, "e" + std::to_string(i));
+    EXPECT(drain(m) == records("EVT", "e", 4, 12));
+    EXPECT(has(m.snapshot(), " lane.EVT=12/4/0"));
+}
+
+static void messages_summary()
+{
+    // UART lane: 40 deep. Records of 8 bytes with the "1 5: " header.
+    Messages m;
+    for (int i = 0; i < 45; i++) m.add_message(Messages::LANE_UART1, "u" + std::to_string(10 + i), 5000);
+    EXPECT(drain(m) == std::vector<std::string>{"1 [dropped 5 records, 40 bytes]\n"} + records("1", "u", 10, 50));
+    EXPECT(has(m.snapshot(), " lane.1=40/5/0"));
+    // counted once
+    m.add_message(Messages::LANE_UART1, "u99", 5000);
+    EXPECT(drain(m) == records("1", "u", 99, 100));
+}
+
+static void messages_rate()
+{
+    // over the rate is dropped whatever the policy, and summarised. The
+    // buckets fill at 100 bytes/s, the records come well within 10 ms.
+    Messages m;
+    m.configure(Messages::LANE_EVENTS, {"", 4, 0, Messages::DROP_OLDEST, 100, 30});
+    m.configure(Messages::LANE_UART1, {"", 2, 0, Messages::SUMMARISE, 100, 20});
+    esp_timer_get_time();
+    usleep(400000);
+    for (int i = 0; i < 4; i++){
+        m.add_message(Messages::LANE_EVENTS, "e" + std::to_string(i), 5000);
+        m.add_message(Messages::LANE_UART1, "u" + std::to_string(10 + i), 5000);
+    }
+    // three EVT records of 9 bytes in 30, two UART records of 8 in 20
+    EXPECT(drain(m) == records("EVT", "e", 0, 3) + std::vector<std::string>{"1 [dropped 2 records, 16 bytes]\n"} + records("1", "u", 10, 12));
+    EXPECT(has(m.snapshot(), " lane.EVT=3/1/0"));
+    EXPECT(has(m.snapshot(), " lane.1=2/2/0"));
+}
+
+static void messages_round_robin()
+{
+    // records per round: EVT 4, TRG 8, UART1 configured to 3, INA off
+    Messages m;
+    m.configure(Messages::LANE_UART1, {"", 3, 0, Messages::SUMMARISE, 0, 0});
+    m.configure(Messages::LANE_INA, {"", 0, 0, Messages::DROP_OLDEST, 0, 0});
+    for (int i = 0; i < 8; i++){
+        m.add_message(Messages::LANE_EVENTS, "e" + std::to_string(i));
+        m.add_message(Messages::LANE_TRIGGERS, "t" + std::to_string(i));
+        m.add_message(Messages::LANE_INA, "i" + std::to_string(i));
+    }
+    for (int i = 0; i < 9; i++) m.add_message(Messages::LANE_UART1, "u" + std::to_string(i));
+    EXPECT(drain(m) == records("EVT", "e", 0, 4) + records("TRG", "t", 0, 8) + records("1", "u", 0, 3)
+        + records("EVT", "e", 4, 8) + records("1", "u", 3, 6)
+        + records("1", "u", 6, 9));
+    EXPECT(has(m.snapshot(), " lane.INA=8/0/8"));
+    // back on, the queued records come out
+    m.configure(Messages::LANE_INA, {"", 4, 0, Messages::DROP_OLDEST, 0, 0});
+    EXPECT(drain(m) == records("INA", "i", 0, 8));
+}
+
+// Histogram, Latency
+
+static void histogram_buckets()
+{
+    // a value's bucket bound is within 25% above it: the percentile of a
+    // value under a larger one is that bound
+    for (uint32_t v = 0; v < 100000; v += 1 + v / 50){
+        Histogram h;
+        h.add(v);
+        h.add(UINT32_MAX);
+        uint32_t p = h.percentile(500);
+        EXPECT(p >= v && p <= v + v / 4);
+        if (p < v || p > v + v / 4){
+            printf("  %u in a bucket up to %u\n", v, p);
+            break;
+        }
+    }
+}
+
+static void histogram_percentiles()
+{
+    Histogram h;
+    EXPECT(h.summary() == "n=0 p50=0 p99=0 max=0");
+    for (uint32_t v = 1; v <= 1000; v++) h.add(v);
+    EXPECT(h.percentile(500) >= 500 && h.percentile(500) <= 625);
+    EXPECT(h.percentile(990) >= 990 && h.percentile(990) <= 1000);
+    // the top bucket is capped at the largest value seen
+    EXPECT(h.percentile(1000) == 1000);
+    h.reset();
+    EXPECT(h.percentile(500) == 0);
+}
+
+// "<stage> n=<count> p50=<us> ..." of UUL LATENCY
+static uint32_t latency(const char* stage, const char* key){
+    std::string s = Latency::snapshot();
+    size_t at = s.find(std::string(stage) + " ");
+    at = s.find(std::string(" ") + key + "=", at);
+    return strtoul(s.c_str() + at + strlen(key) + 2, nullptr, 10);
+}
+
+static void latency_capture_time()
+{
+    // a record carries the time its data was captured, into its header
+    // and the rx to enqueue histogram
+    Latency::reset();
+    Messages m;
+    int64_t rx_us = esp_timer_get_time() - 50000;
+    m.add_message(Messages::LANE_EVENTS, "x", rx_us);
+    uint16_t h;
+    EXPECT(m.get_message(h));
+    std::string r((const char*)m.buffers()[h].begin(), m.buffers()[h].len);
+    m.buffers().release(h);
+    EXPECT(r == "EVT " + std::to_string(rx_us / 1000) + ": x");
+    EXPECT(latency("rx_enq", "n") == 1);
+    EXPECT(latency("rx_enq", "p50") >= 50000 && latency("rx_enq", "p50") < 62500);
+    // without one it is stamped now and not counted
+    m.add_message(Messages::LANE_EVENTS, "y");
+    EXPECT(latency("rx_enq", "n") == 1);
+    EXPECT(latency("rx_send", "n") == 0);
+    // sent: the whole time since capture
+    Latency::sent(rx_us, esp_timer_get_time());
+    EXPECT(latency("rx_send", "n") == 1);
+    EXPECT(latency("rx_send", "p50") >= 50000);
+}
+
+struct Test {
+    const char* name;
+    void (*run)();
+};
+
+static const Test tests[] = {
+    {"decoder_bytes", decoder_bytes},
+    {"decoder_back_to_back", decoder_back_to_back},
+    {"decoder_framing", decoder_framing},
+    {"decoder_wait_idle", decoder_wait_idle},
+    {"decoder_glitch", decoder_glitch},
+    {"decoder_overflow", decoder_overflow},
+    {"decoder_split", decoder_split},
+    {"decoder_lines", decoder_lines},
+    {"trigger_overlapping", trigger_overlapping},
+    {"trigger_same_end", trigger_same_end},
+    {"trigger_split", trigger_split},
+    {"trigger_random", trigger_random},
+    {"messages_drop_newest", messages_drop_newest},
+    {"messages_drop_oldest", messages_drop_oldest},
+    {"messages_summary", messages_summary},
+    {"messages_rate", messages_rate},
+    {"messages_round_robin", messages_round_robin},
+    {"histogram_buckets", histogram_buckets},
+    {"histogram_percentiles", histogram_percentiles},
+    {"latency_capture_time", latency_capture_time},
+};
+
+int main(int argc, char** argv)
+{
+    sim::log_level = ESP_LOG_WARN;
+    int ran = 0;
+    for (const Test& t : tests){
+        if (argc > 1 && strncmp(t.name, argv[1], strlen(argv[1])) != 0) continue;
+        int before = failed;
+        t.run();
+        printf("%s %s\n", failed == before ? "ok    " : "FAILED", t.name);
+        ran++;
+    }
+    printf("%d tests, %d failed expectations\n", ran, failed);
+    return failed || !ran;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <math.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+namespace sim {
+
+// Programmable signal: "const:V", "sine:OFFSET:AMP:PERIOD",
+// "square:LOW:HIGH:PERIOD[:DUTY]" or "ramp:FROM:TO:PERIOD", period in seconds
+class Waveform{
+public:
+    enum Kind { CONST, SINE, SQUARE, RAMP };
+
+    Waveform(double value = 0): kind(CONST), args{value} {}
+
+    bool parse(const std::string& spec){
+        std::vector<std::string> parts;
+        size_t start = 0, pos;
+        while ((pos = spec.find(':', start)) != std::string::npos){
+            parts.push_back(spec.substr(start, pos - start));
+            start = pos + 1;
+        }
+        parts.push_back(spec.substr(start));
+        args.clear();
+        for (size_t i = 1; i < parts.size(); i++){
+            args.push_back(atof(parts[i].c_str()));
+        }
+        if (parts[0] == "const" && args.size() == 1){
+            kind = CONST;
+        }else if (parts[0] == "sine" && args.size() == 3){
+            kind = SINE;
+        }else if (parts[0] == "square" && (args.size() == 3 || args.size() == 4)){
+            kind = SQUARE;
+            if (args.size() == 3) args.push_back(0.5);
+        }else if (parts[0] == "ramp" && args.size() == 3){
+            kind = RAMP;
+        }else{
+            return false;
+        }
+        return kind == CONST || args[2] > 0;
+    }
+
+    double value(double t) const{
+        switch (kind){
+        case SINE:
+            return args[0] + args[1] * sin(2 * M_PI * t / args[2]);
+        case SQUARE:
+            return fmod(t, args[2]) < args[2] * args[3] ? args[1] : args[0];
+        case RAMP:
+            return args[0] + (args[1] - args[0]) * fmod(t, args[2]) / args[2];
+        default:
+            return args[0];
+        }
+    }
+
+private:
+    Kind kind;
+    std::vector<double> args;
+};
+
+}
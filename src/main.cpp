@@ -1,32 +1,88 @@
+#include "boot.hpp"
 #include "button.hpp"
 #include "config.hpp"
 #include "ina.hpp"
 #include "led.hpp"
 #include "screen.hpp"
+#include "soft_uart.hpp"
+#include "trigger.hpp"
 #include "uart.hpp"
 #include "udp.hpp"
 #include "wifi.hpp"
 #include <esp_system.h>
 
 QueueHandle_t Screen::queue = nullptr;
+QueueHandle_t Screen::log_queue = nullptr;
+std::atomic<int> Screen::log_channel{-1};
 Messages UDP::msg;
+std::atomic<uint32_t> Stats::counters[Stats::COUNTERS];
+std::atomic<uint32_t> Power::slots[3];
+std::atomic<bool> Power::valid{false};
+std::atomic<int> Power::channel{0};
+float Power::ma_lsb[3];
+float Power::v_lsb;
+Histogram Latency::stages[Latency::STAGES];
+std::atomic<uint32_t> Boot::marks[Boot::STAGES];
 
-void loop_forever()
+// Reserved at build time, the use measured on boot is logged by
+// Thread::report_stacks()
+static TaskMemory<STACK_SCREEN> screen_task;
+static TaskMemory<STACK_UDP> udp_task;
+static TaskMemory<STACK_UART> uart1_task;
+static TaskMemory<STACK_UART> uart2_task;
+static TaskMemory<STACK_SOFT_UART> soft_uart_task;
+static TaskMemory<STACK_INA> ina_task;
+static TaskMemory<STACK_WIFI> wifi_task;
+
+#define STACK_REPORT_DELAY_MS 10000
+#define SAVE_POLL_MS 1000
+
+// Writes runtime config changes to NVS, flash writes stall the cpu so
+// they stay out of the capture and network tasks
+void loop_forever(Config& config)
 {
+    // stacks are exercised once capture and network are up
+    for (int ms = 0; ms < STACK_REPORT_DELAY_MS; ms += SAVE_POLL_MS) {
+        vTaskDelay(SAVE_POLL_MS / portTICK_RATE_MS);
+        config.save_if_requested();
+    }
+    Thread::report_stacks();
     while (true) {
-        vTaskDelay(portMAX_DELAY);
+        vTaskDelay(SAVE_POLL_MS / portTICK_RATE_MS);
+        config.save_if_requested();
     }
 }
 
 void start_config_mode(Config& config)
 {
-    Uart uart(config, 0, Uart::MODE_CONFIG);
-    uart.start(4096 * 4, configMAX_PRIORITIES - 1);
-    loop_forever();
+    static Uart uart(config, 0, Uart::MODE_CONFIG);
+    uart.start(4096 * 4, Thread::PRIO_CAPTURE);
+    loop_forever(config);
 }
 
-void start_normal_mode(Config& config, Screen& screen)
+// Capture first, then the network, the screen and INA last: records are
+// queued until the net is up. The task objects are static, UDP alone is
+// bigger than the main task stack
+void start_normal_mode(Config& config, Button& btn)
 {
+    Screen::init_queue();
+    Triggers::global().build(config.triggers());
+    static UDP udp(config);
+    static Uart uart1(config, 1);
+    static Uart uart2(config, 2);
+    static SoftUart soft_uart(config);
+    // capture tasks own the APP cpu, the network side stays with WiFi
+    udp.start(udp_task, Thread::PRIO_NET, Thread::CORE_NET);
+    uart1.start(uart1_task, Thread::PRIO_CAPTURE, Thread::CORE_CAPTURE);
+    uart2.start(uart2_task, Thread::PRIO_CAPTURE, Thread::CORE_CAPTURE);
+    if (soft_uart.enabled()) {
+        soft_uart.start(soft_uart_task, Thread::PRIO_CAPTURE, Thread::CORE_CAPTURE);
+    }
+    Boot::mark(Boot::CAPTURE);
+    static WiFi wifi(config, udp);
+    wifi.start(wifi_task, Thread::PRIO_UI, Thread::CORE_NET);
+
+    static Screen screen(config);
     screen.add_label(0, 0, 42, 0, "-.--V");
     screen.add_label(0, 12, 42, 0, "-.--mA");
     screen.add_label(42, 0, 42, 0, "-.--V");
@@ -34,31 +90,31 @@ void start_normal_mode(Config& config, Screen& screen)
     screen.add_label(84, 0, 42, 0, "-.--V");
     screen.add_label(84, 12, 42, 0, "-.--mA");
     screen.add_label(0, 24, 128, 0, "---.---.---.---");
-    screen.start(4096 * 2, 1);
-    UDP udp(config);
-    Uart uart1(config, 1);
-    Uart uart2(config, 2);
-    INA ina(config);
-    udp.start(4096 * 10, configMAX_PRIORITIES - 2);
-    uart1.start(4096 * 2, configMAX_PRIORITIES - 1);
-    uart2.start(4096 * 2, configMAX_PRIORITIES - 1);
-    ina.start(4096 * 2, configMAX_PRIORITIES - 3);
-    WiFi wifi(config, udp);
-    wifi.start(4096, 1);
-    loop_forever();
+    screen.add_label(0, 36, 63, 0, "1:-");
+    screen.add_label(64, 36, 64, 0, "2:-");
+    screen.add_label(0, 48, 128, 0, "");
+    screen.add_log_pages(config, &btn);
+    screen.start(screen_task, Thread::PRIO_UI);
+    Boot::mark(Boot::SCREEN);
+    static INA ina(config);
+    ina.start(ina_task, Thread::PRIO_TELEMETRY, Thread::CORE_CAPTURE);
+    Boot::mark(Boot::INA);
+    loop_forever(config);
 }
 
 extern "C" void app_main()
 {
+    Boot::mark(Boot::APP_MAIN);
     ESP_LOGI("MAIN", "Main started");
     Led led(static_cast<gpio_num_t>(CONFIG_USER_LED));
     Config config(led);
+    Boot::mark(Boot::CONFIG);
     Button btn(static_cast<gpio_num_t>(CONFIG_USER_BUTTON));
-    Screen screen(config);
     if (!config.ready() || btn.is_long_pressed()) {
+        static Screen screen(config);
         screen.add_label(0, 8, 128, 0, "Config mode");
         start_config_mode(config);
     } else {
-        start_normal_mode(config, screen);
+        start_normal_mode(config, btn);
     }
 }
\ No newline at end of file